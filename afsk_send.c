@@ -26,7 +26,9 @@
 
 #include <sys/ioctl.h>
 #include <sys/soundcard.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <math.h>
@@ -36,15 +38,22 @@
 #endif
 #include <semaphore.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "afsk_send.h"
 #include "bsdtty.h"
+#include "fsk_demod.h"
+#include "rtsched.h"
+#include "trace.h"
 #include "ui.h"
+#include "xrun.h"
 
 enum afsk_bit {
 	AFSK_SPACE,
@@ -63,16 +72,60 @@ struct afsk_buf {
 	int16_t *buf;
 };
 
-/* AFSK queue */
-struct afsk_queue {
-	struct afsk_buf *buf;
-	struct afsk_queue *next;
+/*
+ * NCO synthesis
+ *
+ * The half-bit buffers end on a whole tone cycle, so every bit is
+ * rounded and the baud rate is off.  With "AFSK NCO" set, the AFSK
+ * thread synthesizes bits from a sine table with a phase accumulator
+ * instead.  The phase carries over from mark to space, and bit edges
+ * are kept in fractions of a sample (units of 1/nco_clock_den), so
+ * over time the baud rate is exact at any sample rate.
+ */
+#define NCO_TABLE_BITS	12
+enum nco_env {
+	NCO_FLAT,
+	NCO_RISE,
+	NCO_FALL
 };
-static struct afsk_queue *qhead;
-static struct afsk_queue *qtail;
-static pthread_mutex_t afsk_queue_lock;
-#define AQ_LOCK()	assert(pthread_mutex_lock(&afsk_queue_lock) == 0)
-#define AQ_UNLOCK()	assert(pthread_mutex_unlock(&afsk_queue_lock) == 0)
+static int16_t nco_table[1 << NCO_TABLE_BITS];
+static bool nco_table_ready;
+static uint32_t nco_mark_inc;
+static uint32_t nco_space_inc;
+static uint64_t nco_half_len;	// Half a bit, in 1/nco_clock_den samples
+static uint64_t nco_clock_den;
+static bool afsk_nco;
+static bool afsk_silent = true;	// The next bit fades in
+// Owned by the AFSK thread
+static uint32_t nco_phase;
+static uint64_t nco_clock;
+
+/*
+ * AFSK queue
+ *
+ * A ring of half-bit buffers for the AFSK thread to play.  Everything
+ * that adds to it holds the AFSK lock, so there's one producer at a
+ * time and one consumer, and the ring itself needs no lock.  The
+ * indexes only ever increase.  flush_queue() moves the tail from the
+ * sending side, so the AFSK thread advances it with a compare and swap.
+ *
+ * Senders wait for room for a whole batch (a character or the
+ * preamble) before taking the AFSK lock, since the AFSK thread needs it
+ * to make progress.  The AFSK thread is woken once per batch.
+ */
+#define AFSK_QUEUE_LEN	1024	// A power of two
+#define AFSK_MAX_BATCH	32	// Half-bits in a character or the preamble
+struct afsk_seg {
+	struct afsk_buf	*buf;	// NULL for NCO
+	uint32_t	inc;	// NCO phase increment
+	uint8_t		halves;
+	uint8_t		env;
+	bool		ends_char;	// Marks the end of a character, no audio
+};
+static struct afsk_seg afsk_queue[AFSK_QUEUE_LEN];
+static atomic_size_t qhead;
+static atomic_size_t qtail;
+static atomic_bool qspace_wanted;
 
 static struct afsk_buf zero_to_mark;
 static struct afsk_buf zero_to_space;
@@ -80,25 +133,149 @@ static struct afsk_buf mark_to_zero;
 static struct afsk_buf space_to_zero;
 static struct afsk_buf mark_to_mark;
 static struct afsk_buf space_to_space;
+#define AFSK_MAX_HALVES	4	// Half-bits in a bit, a two bit stop is longest
+static bool afsk_reversed;	// The half-bits have been swapped since they were made
+
+/*
+ * Baudot characters are rendered in advance for both polarities, from
+ * the end of the start bit through the stop bit.  Sending one queues the
+ * start bit, which depends on what came before, and a single buffer.
+ * The cache is only rebuilt when something it depends on changes.  ASCII
+ * framings would need megabytes, so they're sent a half-bit at a time.
+ */
+#define AFSK_CACHED_BITS	5
+struct afsk_cache_key {
+	double	mark_freq;
+	double	space_freq;
+	int	baud_numerator;
+	int	baud_denominator;
+	int	rate;
+	int	channels;
+	int	data_bits;
+	int	parity;
+	int	stop_halves;
+};
+static struct afsk_buf afsk_chars[2][1 << AFSK_CACHED_BITS];
+static struct afsk_cache_key afsk_cache_key;
+static bool afsk_chars_valid;
 enum afsk_bit last_afsk_bit = AFSK_UNKNOWN;
 static int dsp_afsk = -1;
+static bool dsp_afsk_started;	// Something has been written since it was opened
 static int dsp_afsk_channels = 1;
 static int afsk_dsp_rate = 48000;
+/*
+ * With "AFSK output" set, the audio goes to a file or pipe instead.
+ * It's truncated by setup_afsk(), and each transmission is appended.
+ */
+static char *afsk_file;
+static bool afsk_file_fresh;
+static bool afsk_wav;		// A WAV header is kept up to date
+static bool afsk_file_gone;	// The pipe reader went away
+static uint32_t afsk_wav_bytes;	// Sample data in the WAV file so far
+#define WAV_HEADER_LEN	44
+/*
+ * Queued half-bits are copied into the staging buffer and written a
+ * device fragment at a time, or all at once when the queue runs dry.
+ */
+static int16_t *afsk_stage;
+static size_t afsk_chunk;
+static int afsk_frag_bytes;
+// Character framing, copied from settings by generate_afsk_samples()
+static int afsk_data_bits = 5;
+static int afsk_parity = PARITY_NONE;
+static int afsk_stop_halves = 3;
 static pthread_mutex_t afsk_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define AFSK_LOCK() pthread_mutex_lock(&afsk_mutex);
+STATIC_LOCK_PROF(afsk_prof, "afsk");
+#define AFSK_LOCK() PROF_MUTEX_LOCK(&afsk_mutex, afsk_prof);
 #define AFSK_UNLOCK() pthread_mutex_unlock(&afsk_mutex);
 static sem_t qsem;
+static sem_t qspace;
 static bool qsem_initialized;
 static pthread_t afsk_threadid;
 static bool afsk_end;
 static pthread_cond_t afsk_ended = PTHREAD_COND_INITIALIZER;
+/*
+ * The device stays open between transmissions.  When one ends, the
+ * AFSK thread uses the output delay to wait until the last sample has
+ * been played, and end_afsk_tx() measures how long after that it was
+ * able to return and let PTT go.
+ */
+static struct timespec afsk_played;	// When the last sample was played
+static bool afsk_played_valid;
+static double afsk_drain_ms;
+static struct tx_turnaround turnaround;
+/*
+ * Set by abort_afsk(), and cleared by the next preamble.  Until then,
+ * nothing is queued.  afsk_abort tells the AFSK thread to drop what it
+ * has staged and stop the device.
+ */
+static bool afsk_aborting;
+static atomic_bool afsk_abort;
+/*
+ * In full duplex, the RX capture thread owns the sound card and plays a
+ * block for every block it reads.  The AFSK thread hands it samples
+ * through this ring instead of writing them itself.
+ */
+#define DUPLEX_RING_LEN	8192	// A power of two
+static int16_t duplex_ring[DUPLEX_RING_LEN];
+static atomic_size_t dhead;
+static atomic_size_t dtail;
+static atomic_bool dspace_wanted;
+static atomic_bool duplex_tx;	// Running dry now is an underrun
+static sem_t dspace;
+static int duplex_dsp = -1;
+/*
+ * To tell when a character has been played, the AFSK thread notes the
+ * sample count where each one ends as it renders them, and
+ * afsk_unsent() compares those with how many samples have been written
+ * less what the device still has queued.  Counts are in int16_t
+ * samples, like the buffers.
+ */
+#define AFSK_CHAR_ENDS	256
+static uint64_t afsk_char_ends[AFSK_CHAR_ENDS];
+static size_t ends_head;
+static size_t ends_tail;
+static uint64_t afsk_rendered;		// Handed to write_afsk_samples()
+static atomic_uint_fast64_t afsk_samples_out;	// Written to the device
+static size_t afsk_queued_chars;
+static size_t afsk_aired_chars;
+static pthread_mutex_t afsk_echo_mutex = PTHREAD_MUTEX_INITIALIZER;
+STATIC_LOCK_PROF(afsk_echo_prof, "afsk echo");
+#define AFSK_ECHO_LOCK()	assert(PROF_MUTEX_LOCK(&afsk_echo_mutex, afsk_echo_prof) == 0)
+#define AFSK_ECHO_UNLOCK()	assert(pthread_mutex_unlock(&afsk_echo_mutex) == 0)
+#ifdef SNDCTL_DSP_HALT_OUTPUT
+#define AFSK_HALT	SNDCTL_DSP_HALT_OUTPUT
+#else
+#define AFSK_HALT	SNDCTL_DSP_RESET
+#endif
 
+static void abort_afsk(void);
+static size_t afsk_unsent(void);
+static void clear_char_ends(void);
+static void note_char_end(uint64_t end);
 static void adjust_wave(struct afsk_buf *buf, double start_phase);
+static void check_afsk_abort(size_t *staged);
+static void build_afsk_cache(void);
+static void render_afsk_char(unsigned code, struct afsk_buf *out);
 static void * afsk_thread(void *arg);
+static int afsk_bit_bufs(enum afsk_bit bit, enum afsk_bit last, struct afsk_buf **out);
 static void generate_afsk_samples(void);
 static void generate_sine(double freq, struct afsk_buf *buf);
+static void close_afsk_dev(void);
+static void push_duplex(const int16_t *buf, size_t size);
+static void wait_duplex_room(size_t room);
+static void drain_afsk_dev(void);
 static void open_afsk_dev(void);
+static void update_wav_header(void);
+static void queue_afsk_char(char ch);
+static bool next_afsk_seg(struct afsk_seg *seg, bool *emptied);
+static size_t render_nco(const struct afsk_seg *seg, int16_t *out);
 static void send_afsk_buf(struct afsk_buf *buf);
+static void send_afsk_seg(const struct afsk_seg *seg);
+static void send_nco_bit(enum afsk_bit bit);
+static void setup_nco(void);
+static void setup_afsk_stage(void);
+static void wait_afsk_space(void);
 static void send_afsk_bit(enum afsk_bit bit);
 static void swap_afsk_bufs(struct afsk_buf *buf1, struct afsk_buf *buf2);
 static void flush_queue(void);
@@ -166,152 +343,566 @@ generate_afsk_samples(void)
 	adjust_wave(&mark_to_zero, 0.0);
 	adjust_wave(&zero_to_space, M_PI);
 	adjust_wave(&space_to_zero, 0.0);
+
+	afsk_data_bits = settings.data_bits;
+	afsk_parity = settings.parity;
+	afsk_stop_halves = lround(settings.stop_bits * 2);
+	afsk_reversed = false;
 }
 
+/*
+ * Renders everything after the start bit of a character from the
+ * current half-bits.
+ */
 static void
-send_afsk_bit(enum afsk_bit bit)
+render_afsk_char(unsigned code, struct afsk_buf *out)
+{
+	struct afsk_buf *bufs[AFSK_MAX_HALVES * (AFSK_CACHED_BITS + 2)];
+	enum afsk_bit last = AFSK_SPACE;
+	enum afsk_bit bit;
+	size_t size = 0;
+	int i, n = 0;
+
+	for (i = 0; i < afsk_data_bits; i++) {
+		bit = code & (1 << i) ? AFSK_MARK : AFSK_SPACE;
+		n += afsk_bit_bufs(bit, last, &bufs[n]);
+		last = bit;
+	}
+	if (afsk_parity != PARITY_NONE) {
+		bit = parity_bit(code, afsk_data_bits, afsk_parity) ? AFSK_MARK : AFSK_SPACE;
+		n += afsk_bit_bufs(bit, last, &bufs[n]);
+		last = bit;
+	}
+	n += afsk_bit_bufs(AFSK_STOP, last, &bufs[n]);
+
+	for (i = 0; i < n; i++)
+		size += bufs[i]->size;
+	free(out->buf);
+	out->buf = malloc(size * sizeof(out->buf[0]));
+	if (out->buf == NULL)
+		printf_errno("allocating AFSK character");
+	out->size = 0;
+	for (i = 0; i < n; i++) {
+		memcpy(out->buf + out->size, bufs[i]->buf, bufs[i]->size * sizeof(out->buf[0]));
+		out->size += bufs[i]->size;
+	}
+}
+
+/*
+ * Requires the settings lock to be held, and the AFSK thread not
+ * running.
+ */
+static void
+build_afsk_cache(void)
+{
+	struct afsk_cache_key key;
+	unsigned code;
+	int r;
+
+	memset(&key, 0, sizeof(key));
+	key.mark_freq = settings.mark_freq;
+	key.space_freq = settings.space_freq;
+	key.baud_numerator = settings.baud_numerator;
+	key.baud_denominator = settings.baud_denominator;
+	key.rate = afsk_dsp_rate;
+	key.channels = dsp_afsk_channels;
+	key.data_bits = afsk_data_bits;
+	key.parity = afsk_parity;
+	key.stop_halves = afsk_stop_halves;
+	if (afsk_chars_valid && memcmp(&key, &afsk_cache_key, sizeof(key)) == 0)
+		return;
+	afsk_chars_valid = false;
+	if (afsk_data_bits > AFSK_CACHED_BITS)
+		return;
+
+	for (r = 0; r < 2; r++) {
+		for (code = 0; code < 1U << afsk_data_bits; code++)
+			render_afsk_char(code, &afsk_chars[r][code]);
+		// Reversed for the second pass, then back again
+		swap_afsk_bufs(&zero_to_mark, &zero_to_space);
+		swap_afsk_bufs(&mark_to_zero, &space_to_zero);
+		swap_afsk_bufs(&mark_to_mark, &space_to_space);
+	}
+	afsk_cache_key = key;
+	afsk_chars_valid = true;
+}
+
+/*
+ * Looks up the half-bit buffers that send bit after last.  Returns how
+ * many there are.
+ */
+static int
+afsk_bit_bufs(enum afsk_bit bit, enum afsk_bit last, struct afsk_buf **out)
 {
+	int n = 0;
+	int i;
+
 	switch(bit) {
 		case AFSK_MARK:
-			switch(last_afsk_bit) {
+			switch(last) {
 				case AFSK_UNKNOWN:
 					printf_errno("mark after unknown");
 				case AFSK_SPACE:
-					send_afsk_buf(&space_to_zero);
-					send_afsk_buf(&zero_to_mark);
+					out[n++] = &space_to_zero;
+					out[n++] = &zero_to_mark;
 					break;
 				case AFSK_MARK:
-					send_afsk_buf(&mark_to_mark);
-					send_afsk_buf(&mark_to_mark);
+					out[n++] = &mark_to_mark;
+					out[n++] = &mark_to_mark;
 					break;
 				case AFSK_STOP:
 					printf_errno("mark after stop");
 			}
 			break;
 		case AFSK_SPACE:
-			switch(last_afsk_bit) {
+			switch(last) {
 				case AFSK_UNKNOWN:
-					send_afsk_buf(&zero_to_space);
+					out[n++] = &zero_to_space;
 					break;
 				case AFSK_SPACE:
-					send_afsk_buf(&space_to_space);
-					send_afsk_buf(&space_to_space);
+					out[n++] = &space_to_space;
+					out[n++] = &space_to_space;
 					break;
 				case AFSK_STOP:
 				case AFSK_MARK:
-					send_afsk_buf(&mark_to_zero);
-					send_afsk_buf(&zero_to_space);
+					out[n++] = &mark_to_zero;
+					out[n++] = &zero_to_space;
 					break;
 			}
 			break;
 		case AFSK_STOP:
-			switch(last_afsk_bit) {
+			/* The stop bit is afsk_stop_halves half-bits long */
+			switch(last) {
 				case AFSK_UNKNOWN:
-					send_afsk_buf(&zero_to_mark);
-					send_afsk_buf(&mark_to_mark);
-					send_afsk_buf(&mark_to_mark);
+					out[n++] = &zero_to_mark;
+					out[n++] = &mark_to_mark;
 					break;
 				case AFSK_SPACE:
-					send_afsk_buf(&space_to_zero);
-					send_afsk_buf(&zero_to_mark);
-					send_afsk_buf(&mark_to_mark);
+					out[n++] = &space_to_zero;
+					out[n++] = &zero_to_mark;
 					break;
 				case AFSK_MARK:
-					send_afsk_buf(&mark_to_mark);
-					send_afsk_buf(&mark_to_mark);
-					send_afsk_buf(&mark_to_mark);
-					break;
 				case AFSK_STOP:
-					send_afsk_buf(&mark_to_mark);
-					send_afsk_buf(&mark_to_mark);
-					send_afsk_buf(&mark_to_mark);
+					out[n++] = &mark_to_mark;
+					out[n++] = &mark_to_mark;
+					break;
 			}
+			for (i = 2; i < afsk_stop_halves; i++)
+				out[n++] = &mark_to_mark;
 			break;
 		case AFSK_UNKNOWN:
 			printf_errno("sending unknown bit");
 			break;
 	}
+	assert(n <= AFSK_MAX_HALVES);
+	return n;
+}
+
+static void
+send_afsk_bit(enum afsk_bit bit)
+{
+	struct afsk_buf *bufs[AFSK_MAX_HALVES];
+	int i, n;
+
+	if (afsk_nco) {
+		send_nco_bit(bit);
+		last_afsk_bit = bit;
+		return;
+	}
+	n = afsk_bit_bufs(bit, last_afsk_bit, bufs);
+	for (i = 0; i < n; i++)
+		send_afsk_buf(bufs[i]);
 	last_afsk_bit = bit;
 }
 
+/*
+ * Blocks until the duplex ring has room free, or there's an abort.
+ * Only the AFSK thread calls this.
+ */
 static void
-write_afsk_buf(struct afsk_buf *buf)
+wait_duplex_room(size_t room)
+{
+	while (DUPLEX_RING_LEN - (atomic_load(&dhead) - atomic_load(&dtail)) < room) {
+		atomic_store(&dspace_wanted, true);
+		// The capture thread may have made room before seeing the flag
+		if (DUPLEX_RING_LEN - (atomic_load(&dhead) - atomic_load(&dtail)) >= room ||
+		    atomic_load(&afsk_abort))
+			break;
+		sem_wait(&dspace);
+	}
+}
+
+static void
+push_duplex(const int16_t *buf, size_t size)
+{
+	size_t h, n, i;
+
+	while (size && !atomic_load(&afsk_abort)) {
+		h = atomic_load_explicit(&dhead, memory_order_relaxed);
+		n = DUPLEX_RING_LEN - (h - atomic_load(&dtail));
+		if (n == 0) {
+			wait_duplex_room(RX_BLOCK);
+			continue;
+		}
+		if (n > size)
+			n = size;
+		for (i = 0; i < n; i++)
+			duplex_ring[(h + i) & (DUPLEX_RING_LEN - 1)] = buf[i];
+		atomic_store_explicit(&dhead, h + n, memory_order_release);
+		atomic_store(&duplex_tx, true);
+		buf += n;
+		size -= n;
+	}
+}
+
+/*
+ * Called by the capture thread in full duplex mode to get the next
+ * frames samples to play.  If there aren't enough, the rest is
+ * silence, which is an underrun while transmitting.
+ */
+size_t
+afsk_duplex_read(int16_t *out, size_t frames)
+{
+	size_t t = atomic_load(&dtail);
+	size_t h, n, i;
+
+	// abort_afsk() can move the tail too
+	do {
+		h = atomic_load_explicit(&dhead, memory_order_acquire);
+		n = h - t < frames ? h - t : frames;
+		for (i = 0; i < n; i++)
+			out[i] = duplex_ring[(t + i) & (DUPLEX_RING_LEN - 1)];
+	} while (!atomic_compare_exchange_weak(&dtail, &t, t + n));
+	atomic_fetch_add(&afsk_samples_out, n);
+	if (n < frames) {
+		memset(out + n, 0, (frames - n) * sizeof(out[0]));
+		if (atomic_load(&duplex_tx))
+			count_xruns(XRUN_TX, 1);
+	}
+	if (n && atomic_exchange(&dspace_wanted, false))
+		sem_post(&dspace);
+	return n;
+}
+
+static void
+write_afsk_samples(const int16_t *buf, size_t size)
 {
 	size_t sent = 0;
 	int ret;
 	int fd;
+	bool no_reader = false;
 
+	afsk_rendered += size;
+	if (duplex_dsp != -1) {
+		push_duplex(buf, size);
+		return;
+	}
 	AFSK_LOCK();
 	fd = dsp_afsk;
-	if (fd == -1) {
+	if (fd == -1 && !afsk_file_gone) {
 		open_afsk_dev();
 		fd = dsp_afsk;
-		assert(fd != -1);
+		// Only a pipe with nothing reading it fails to open
+		if (fd == -1) {
+			afsk_file_gone = true;
+			no_reader = true;
+		}
 	}
 	AFSK_UNLOCK();
-	while (sent < buf->size) {
-		ret = write(fd, buf->buf + sent, (buf->size - sent) * sizeof(buf->buf[0]));
+	if (no_reader)
+		write_rx_str("\r\n[AFSK output: nothing is reading the pipe, discarding audio]\r\n");
+	if (afsk_file[0] == 0)
+		count_xruns(XRUN_TX, check_output_xrun(fd, dsp_afsk_started));
+	dsp_afsk_started = true;
+	TRACE_BEGIN_ARG("AFSK write", size);
+	while (sent < size && !atomic_load(&afsk_abort) && !afsk_file_gone) {
+		ret = write(fd, buf + sent, (size - sent) * sizeof(buf[0]));
+		if (ret == -1 && errno == EPIPE && afsk_file[0]) {
+			afsk_file_gone = true;
+			write_rx_str("\r\n[AFSK output: reader closed the pipe, discarding audio]\r\n");
+			break;
+		}
 		if (ret == -1)
 			printf_errno("writing AFSK buffer");
-		ret /= sizeof(buf->buf[0]);
+		// An abort can stop this part way, so only count what's written
+		if (afsk_wav)
+			afsk_wav_bytes += ret;
+		ret /= sizeof(buf[0]);
 		sent += ret;
+		atomic_fetch_add(&afsk_samples_out, ret);
 	}
+	// Nobody is listening, so it's as good as played
+	if (afsk_file_gone)
+		atomic_fetch_add(&afsk_samples_out, size - sent);
+	TRACE_END("AFSK write");
+}
+
+/*
+ * Adds a buffer to the queue.  The AFSK lock must be held, and
+ * wait_afsk_space() must have been called for this batch.  The AFSK
+ * thread isn't woken until the batch is done.
+ */
+static void
+send_afsk_seg(const struct afsk_seg *seg)
+{
+	size_t h = atomic_load_explicit(&qhead, memory_order_relaxed);
+
+	assert(h - atomic_load(&qtail) < AFSK_QUEUE_LEN);
+	afsk_queue[h & (AFSK_QUEUE_LEN - 1)] = *seg;
+	atomic_store_explicit(&qhead, h + 1, memory_order_release);
 }
 
 static void
 send_afsk_buf(struct afsk_buf *buf)
 {
-	struct afsk_queue *new;
-
-	new = malloc(sizeof(*new));
-	if (new == NULL)
-		printf_errno("allocating afsk queue entry");
-	new->buf = buf;
-	new->next = NULL;
-	AQ_LOCK();
-	if (qtail != NULL)
-		qtail->next = new;
-	qtail = new;
-	if (qhead == NULL)
-		qhead = new;
-	AQ_UNLOCK();
-	sem_post(&qsem);
+	struct afsk_seg seg = {.buf = buf};
+
+	send_afsk_seg(&seg);
 }
 
+/*
+ * Queues a bit for the NCO.  The first bit after silence fades in over
+ * its first half.  AFSK lock must be held.
+ */
 static void
-send_afsk_char(char ch)
+send_nco_bit(enum afsk_bit bit)
+{
+	struct afsk_seg seg = {
+		.inc = bit == AFSK_SPACE ? nco_space_inc : nco_mark_inc,
+		.halves = bit == AFSK_STOP ? afsk_stop_halves : 2,
+		.env = NCO_FLAT
+	};
+
+	if (afsk_silent) {
+		struct afsk_seg rise = seg;
+
+		rise.halves = 1;
+		rise.env = NCO_RISE;
+		send_afsk_seg(&rise);
+		seg.halves--;
+		afsk_silent = false;
+	}
+	send_afsk_seg(&seg);
+}
+
+/*
+ * Blocks until there's room for a batch.  Must not be called with the
+ * AFSK lock held, or by the AFSK thread.
+ */
+static void
+wait_afsk_space(void)
+{
+	while (AFSK_QUEUE_LEN - (atomic_load(&qhead) - atomic_load(&qtail)) < AFSK_MAX_BATCH) {
+		atomic_store(&qspace_wanted, true);
+		// The AFSK thread may have made room before seeing the flag
+		if (AFSK_QUEUE_LEN - (atomic_load(&qhead) - atomic_load(&qtail)) >= AFSK_MAX_BATCH)
+			break;
+		sem_wait(&qspace);
+	}
+}
+
+/*
+ * Takes the next segment off the queue, or returns false if it's empty.
+ * emptied is set if that was the last one.
+ */
+static bool
+next_afsk_seg(struct afsk_seg *seg, bool *emptied)
+{
+	size_t t = atomic_load(&qtail);
+	size_t h;
+
+	do {
+		h = atomic_load_explicit(&qhead, memory_order_acquire);
+		if (t == h)
+			return false;
+		*seg = afsk_queue[t & (AFSK_QUEUE_LEN - 1)];
+	} while (!atomic_compare_exchange_weak(&qtail, &t, t + 1));
+	*emptied = (t + 1 == h);
+	if (atomic_exchange(&qspace_wanted, false))
+		sem_post(&qspace);
+	return true;
+}
+
+/*
+ * Synthesizes an NCO segment into out, and returns the number of
+ * samples.  Only the AFSK thread calls this.
+ */
+static size_t
+render_nco(const struct afsk_seg *seg, int16_t *out)
+{
+	size_t n, i;
+
+	nco_clock += nco_half_len * seg->halves;
+	n = nco_clock / nco_clock_den;
+	nco_clock %= nco_clock_den;
+	for (i = 0; i < n; i++) {
+		out[i] = nco_table[nco_phase >> (32 - NCO_TABLE_BITS)];
+		nco_phase += seg->inc;
+	}
+	switch (seg->env) {
+		case NCO_RISE:
+			for (i = 0; i < n; i++)
+				out[i] *= (1 - cos(M_PI * i / n)) / 2;
+			break;
+		case NCO_FALL:
+			for (i = 0; i < n; i++)
+				out[i] *= (1 + cos(M_PI * i / n)) / 2;
+			break;
+	}
+	return n;
+}
+
+/*
+ * AFSK lock must be held.
+ */
+static void
+queue_afsk_char(char ch)
 {
 	int i;
+	unsigned bits = (unsigned char)ch;
 
-	AFSK_LOCK();
+	if (afsk_chars_valid && !afsk_nco) {
+		send_afsk_bit(AFSK_SPACE);
+		send_afsk_buf(&afsk_chars[afsk_reversed][bits & ((1U << afsk_data_bits) - 1)]);
+		last_afsk_bit = AFSK_STOP;
+		return;
+	}
 	send_afsk_bit(AFSK_SPACE);
-	for (i = 0; i < 5; i++) {
-		send_afsk_bit(ch & 1 ? AFSK_MARK : AFSK_SPACE);
-		ch >>= 1;
+	for (i = 0; i < afsk_data_bits; i++) {
+		send_afsk_bit(bits & 1 ? AFSK_MARK : AFSK_SPACE);
+		bits >>= 1;
 	}
+	if (afsk_parity != PARITY_NONE)
+		send_afsk_bit(parity_bit((unsigned char)ch, afsk_data_bits, afsk_parity) ? AFSK_MARK : AFSK_SPACE);
 	send_afsk_bit(AFSK_STOP);
+}
+
+static void
+send_afsk_char(char ch)
+{
+	struct afsk_seg end = {.ends_char = true};
+
+	wait_afsk_space();
+	AFSK_LOCK();
+	if (!afsk_aborting) {
+		queue_afsk_char(ch);
+		send_afsk_seg(&end);
+		AFSK_ECHO_LOCK();
+		afsk_queued_chars++;
+		AFSK_ECHO_UNLOCK();
+		sem_post(&qsem);
+	}
 	AFSK_UNLOCK();
 }
 
+/*
+ * Called by the AFSK thread for an ends_char segment, with the sample
+ * count including what's staged.  If too many are waiting to be
+ * played, it's counted as played now.
+ */
+static void
+note_char_end(uint64_t end)
+{
+	AFSK_ECHO_LOCK();
+	if (ends_head - ends_tail < AFSK_CHAR_ENDS)
+		afsk_char_ends[ends_head++ % AFSK_CHAR_ENDS] = end;
+	else if (afsk_aired_chars < afsk_queued_chars)
+		afsk_aired_chars++;
+	AFSK_ECHO_UNLOCK();
+}
+
+/*
+ * Forgets the characters in flight, counting them all as played.
+ */
+static void
+clear_char_ends(void)
+{
+	AFSK_ECHO_LOCK();
+	ends_tail = ends_head;
+	afsk_aired_chars = afsk_queued_chars;
+	AFSK_ECHO_UNLOCK();
+}
+
+static size_t
+afsk_unsent(void)
+{
+	uint64_t played = atomic_load(&afsk_samples_out);
+	size_t ret;
+	int delay;
+	int fd = duplex_dsp != -1 ? duplex_dsp : dsp_afsk;
+
+	// A file has "played" as soon as it's written
+	if (afsk_file[0] == 0 && fd != -1 &&
+	    ioctl(fd, SNDCTL_DSP_GETODELAY, &delay) == 0 && delay > 0) {
+		delay /= sizeof(int16_t);
+		played = (uint64_t)delay < played ? played - delay : 0;
+	}
+	AFSK_ECHO_LOCK();
+	while (ends_tail != ends_head &&
+	    afsk_char_ends[ends_tail % AFSK_CHAR_ENDS] <= played) {
+		ends_tail++;
+		if (afsk_aired_chars < afsk_queued_chars)
+			afsk_aired_chars++;
+	}
+	ret = afsk_queued_chars - afsk_aired_chars;
+	AFSK_ECHO_UNLOCK();
+	return ret;
+}
+
 static void
 end_afsk_tx(void)
 {
+	struct timespec now;
+	double late;
+
+	wait_afsk_space();
 	AFSK_LOCK();
 
-	switch(last_afsk_bit) {
+	// After an abort, there's nothing to fade out
+	switch(afsk_aborting ? AFSK_UNKNOWN : last_afsk_bit) {
 		case AFSK_UNKNOWN:
-			printf_errno("ending after unknown bit");
+			if (!afsk_aborting)
+				printf_errno("ending after unknown bit");
+			last_afsk_bit = AFSK_UNKNOWN;
 			break;
 		case AFSK_SPACE:
 			printf_errno("ending after space");
 			break;
 		case AFSK_STOP:
 		case AFSK_MARK:
-			send_afsk_buf(&mark_to_zero);
+			if (afsk_nco) {
+				struct afsk_seg seg = {.inc = nco_mark_inc,
+				    .halves = 1, .env = NCO_FALL};
+
+				send_afsk_seg(&seg);
+			}
+			else
+				send_afsk_buf(&mark_to_zero);
 			break;
 	}
+	afsk_silent = true;
 	afsk_end = true;
-	assert(pthread_cond_wait(&afsk_ended, & afsk_mutex) == 0);
+	sem_post(&qsem);
+	while (afsk_end)
+		assert(pthread_cond_wait(&afsk_ended, & afsk_mutex) == 0);
+	if (afsk_played_valid) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		late = (now.tv_sec - afsk_played.tv_sec) * 1000.0 +
+		    (now.tv_nsec - afsk_played.tv_nsec) / 1000000.0;
+		turnaround.count++;
+		turnaround.drain_ms = afsk_drain_ms;
+		turnaround.late_total_ms += late;
+		if (late > turnaround.late_max_ms)
+			turnaround.late_max_ms = late;
+	}
+	AFSK_UNLOCK();
+}
+
+void
+get_tx_turnaround(struct tx_turnaround *t)
+{
+	AFSK_LOCK();
+	*t = turnaround;
 	AFSK_UNLOCK();
 }
 
@@ -320,32 +911,209 @@ setup_afsk(void)
 {
 	AFSK_LOCK();
 	SETTING_RLOCK();
-	// We open it here just in case there's an error
-	generate_afsk_samples();
+	free(afsk_file);
+	afsk_file = strdup(settings.afsk_file);
+	if (afsk_file == NULL)
+		printf_errno("allocating AFSK output name");
+	afsk_file_fresh = true;
+	SETTING_UNLOCK();
+	// We open it here just in case there's an error, and for the rate
 	open_afsk_dev();
+	SETTING_RLOCK();
+	generate_afsk_samples();
+	build_afsk_cache();
+	setup_nco();
 	SETTING_UNLOCK();
+	setup_afsk_stage();
 	if (qsem_initialized) {
 		sem_destroy(&qsem);
+		sem_destroy(&qspace);
+		sem_destroy(&dspace);
 		qsem_initialized = false;
 	}
+	atomic_store(&dspace_wanted, false);
 	if (sem_init(&qsem, 0, 0) == -1)
 		printf_errno("initializing semaphore");
+	if (sem_init(&qspace, 0, 0) == -1)
+		printf_errno("initializing semaphore");
+	if (sem_init(&dspace, 0, 0) == -1)
+		printf_errno("initializing semaphore");
 	qsem_initialized = true;
+	atomic_store(&qhead, 0);
+	atomic_store(&qtail, 0);
+	atomic_store(&qspace_wanted, false);
+	// The capture thread may already be reading it
+	atomic_store(&duplex_tx, false);
+	atomic_store(&dtail, atomic_load(&dhead));
+	afsk_rendered = 0;
+	atomic_store(&afsk_samples_out, 0);
+	clear_char_ends();
 	if (pthread_create(&afsk_threadid, NULL, afsk_thread, NULL) != 0)
 		printf_errno("Creating AFSK thread");
+	AFSK_UNLOCK();
+}
+
+/*
+ * Fills in the sizes in the WAV header at the start of the file.
+ * AFSK lock must be held.
+ */
+static void
+update_wav_header(void)
+{
+	uint8_t h[WAV_HEADER_LEN];
+	uint32_t v[] = {
+		afsk_wav_bytes + WAV_HEADER_LEN - 8,	// RIFF size
+		16,					// fmt size
+		1 | (dsp_afsk_channels << 16),		// PCM, channels
+		afsk_dsp_rate,
+		afsk_dsp_rate * dsp_afsk_channels * sizeof(int16_t),
+		(dsp_afsk_channels * sizeof(int16_t)) | (16 << 16),
+		afsk_wav_bytes				// data size
+	};
+	// Where each of the above goes
+	int off[] = {4, 16, 20, 24, 28, 32, 40};
+	size_t i;
+	int j;
+
+	memcpy(h, "RIFF....WAVEfmt ", 16);
+	memcpy(h + 36, "data", 4);
+	for (i = 0; i < sizeof(v) / sizeof(v[0]); i++) {
+		for (j = 0; j < 4; j++)
+			h[off[i] + j] = v[i] >> (j * 8);
+	}
+	if (pwrite(dsp_afsk, h, sizeof(h), 0) != sizeof(h))
+		printf_errno("writing WAV header");
+}
+
+/*
+ * Waits until everything written has been played, and notes when that
+ * was.  Only the AFSK thread calls this, at the end of a transmission.
+ */
+static void
+drain_afsk_dev(void)
+{
+	int delay;
+	uint64_t ns;
+	int fd = dsp_afsk;
+
+	afsk_played_valid = false;
+	dsp_afsk_started = false;
+	if (afsk_file[0]) {
+		AFSK_LOCK();
+		if (afsk_wav)
+			update_wav_header();
+		// Try the pipe again next time, there may be a reader by then
+		if (afsk_file_gone) {
+			close_afsk_dev();
+			afsk_file_gone = false;
+		}
+		AFSK_UNLOCK();
+		return;
+	}
+	if (duplex_dsp != -1) {
+		// The silence after it isn't an underrun
+		atomic_store(&duplex_tx, false);
+		wait_duplex_room(DUPLEX_RING_LEN);
+		fd = duplex_dsp;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &afsk_played);
+	if (ioctl(fd, SNDCTL_DSP_GETODELAY, &delay) == -1) {
+		// No way to tell when it'll be done, so just wait for it
+		if (duplex_dsp == -1)
+			ioctl(fd, SNDCTL_DSP_SYNC, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &afsk_played);
+		afsk_drain_ms = 0;
+	}
+	else {
+		ns = (uint64_t)delay / (sizeof(int16_t) * dsp_afsk_channels) *
+		    1000000000 / afsk_dsp_rate;
+		afsk_drain_ms = ns / 1000000.0;
+		ns += afsk_played.tv_nsec;
+		afsk_played.tv_sec += ns / 1000000000;
+		afsk_played.tv_nsec = ns % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		    &afsk_played, NULL) == EINTR)
+			;
+	}
+	afsk_played_valid = true;
+}
+
+/*
+ * AFSK lock must be held.
+ */
+static void
+close_afsk_dev(void)
+{
+	if (dsp_afsk == -1)
+		return;
+	if (afsk_wav)
+		update_wav_header();
 	close(dsp_afsk);
 	dsp_afsk = -1;
-	AFSK_UNLOCK();
 }
 
+/*
+ * Opens the sound device or output file.  AFSK lock must be held, and
+ * the settings lock must not be.  A named pipe with no reader is
+ * left closed rather than waiting for one.
+ */
 static void
 open_afsk_dev(void)
 {
+	struct stat st;
+	char *name;
 	int i;
 
-	if (dsp_afsk != -1)
-		close(dsp_afsk);
-	dsp_afsk = open(settings.dsp_name, O_WRONLY);
+	close_afsk_dev();
+	duplex_dsp = -1;
+	afsk_wav = false;
+	afsk_file_gone = false;
+	if (afsk_file[0]) {
+		dsp_afsk = open(afsk_file, O_WRONLY | O_CREAT | O_NONBLOCK |
+		    (afsk_file_fresh ? O_TRUNC : 0), 0644);
+		if (dsp_afsk == -1 && errno == ENXIO) {
+			afsk_frag_bytes = 0;
+			dsp_afsk_started = false;
+			return;
+		}
+		if (dsp_afsk == -1)
+			printf_errno("unable to open AFSK output %s", afsk_file);
+		i = fcntl(dsp_afsk, F_GETFL);
+		if (i == -1 || fcntl(dsp_afsk, F_SETFL, i & ~O_NONBLOCK) == -1)
+			printf_errno("setting AFSK output blocking");
+		// The header is patched in place, which a pipe can't do
+		afsk_wav = strlen(afsk_file) > 4 &&
+		    strcasecmp(afsk_file + strlen(afsk_file) - 4, ".wav") == 0 &&
+		    fstat(dsp_afsk, &st) == 0 && S_ISREG(st.st_mode);
+		if (afsk_file_fresh) {
+			afsk_wav_bytes = 0;
+			if (afsk_wav)
+				update_wav_header();
+			afsk_file_fresh = false;
+		}
+		// Pipes can't seek, and that's fine
+		lseek(dsp_afsk, 0, SEEK_END);
+		afsk_frag_bytes = 0;
+		dsp_afsk_started = false;
+		return;
+	}
+	// The capture thread already has it open for both
+	duplex_dsp = get_duplex_dsp();
+	if (duplex_dsp != -1) {
+		SETTING_RLOCK();
+		afsk_dsp_rate = settings.dsp_rate;
+		SETTING_UNLOCK();
+		afsk_frag_bytes = RX_BLOCK * sizeof(int16_t);
+		dsp_afsk_started = false;
+		return;
+	}
+	SETTING_RLOCK();
+	name = strdup(settings.dsp_name);
+	SETTING_UNLOCK();
+	if (name == NULL)
+		printf_errno("allocating AFSK device name");
+	dsp_afsk = open(name, O_WRONLY);
+	free(name);
 	if (dsp_afsk == -1)
 		printf_errno("unable to open AFSK sound device");
 	i = AFMT_S16_NE;
@@ -357,6 +1125,71 @@ open_afsk_dev(void)
 		printf_errno("setting afsk channels");
 	if (ioctl(dsp_afsk, SNDCTL_DSP_SPEED, &afsk_dsp_rate) == -1)
 		printf_errno("setting sample rate");
+	if (ioctl(dsp_afsk, SNDCTL_DSP_GETBLKSIZE, &afsk_frag_bytes) == -1)
+		afsk_frag_bytes = 0;
+	dsp_afsk_started = false;
+}
+
+/*
+ * Works out the NCO tones and bit clock for the rate the device gave
+ * us.  AFSK lock and settings lock must be held, and the AFSK thread
+ * not running.
+ */
+static void
+setup_nco(void)
+{
+	size_t i;
+
+	if (!nco_table_ready) {
+		for (i = 0; i < sizeof(nco_table) / sizeof(nco_table[0]); i++)
+			nco_table[i] = INT16_MAX * sin(2 * M_PI * i / (sizeof(nco_table) / sizeof(nco_table[0])));
+		nco_table_ready = true;
+	}
+	afsk_nco = settings.afsk_nco;
+	nco_mark_inc = llround(settings.mark_freq / afsk_dsp_rate * 4294967296.0);
+	nco_space_inc = llround(settings.space_freq / afsk_dsp_rate * 4294967296.0);
+	// Half a bit is rate * den / (2 * num) samples
+	nco_half_len = (uint64_t)afsk_dsp_rate * settings.baud_denominator;
+	nco_clock_den = 2 * (uint64_t)settings.baud_numerator;
+	nco_phase = 0;
+	nco_clock = 0;
+	afsk_silent = true;
+}
+
+/*
+ * Sizes the staging buffer for a device fragment plus the longest
+ * queued buffer, since a buffer is only split when it's written.
+ * AFSK lock must be held, and the AFSK thread not running.
+ */
+static void
+setup_afsk_stage(void)
+{
+	struct afsk_buf *bufs[] = {&zero_to_mark, &zero_to_space,
+	    &mark_to_zero, &space_to_zero, &mark_to_mark, &space_to_space};
+	size_t longest = 0;
+	size_t i;
+	int r;
+
+	for (i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++) {
+		if (bufs[i]->size > longest)
+			longest = bufs[i]->size;
+	}
+	for (r = 0; afsk_chars_valid && r < 2; r++) {
+		for (i = 0; i < 1U << afsk_data_bits; i++) {
+			if (afsk_chars[r][i].size > longest)
+				longest = afsk_chars[r][i].size;
+		}
+	}
+	// An NCO stop bit can be four halves, plus one for the fraction
+	if (afsk_nco && 4 * nco_half_len / nco_clock_den + 1 > longest)
+		longest = 4 * nco_half_len / nco_clock_den + 1;
+	afsk_chunk = afsk_frag_bytes / sizeof(afsk_stage[0]);
+	if (afsk_chunk == 0)
+		afsk_chunk = longest;
+	free(afsk_stage);
+	afsk_stage = malloc((afsk_chunk + longest) * sizeof(afsk_stage[0]));
+	if (afsk_stage == NULL)
+		printf_errno("allocating AFSK staging buffer");
 }
 
 static void
@@ -372,6 +1205,7 @@ static void
 afsk_toggle_reverse(void)
 {
 	int16_t *tbuf;
+	uint32_t tinc;
 
 	AFSK_LOCK();
 	/*
@@ -380,34 +1214,79 @@ afsk_toggle_reverse(void)
 	swap_afsk_bufs(&zero_to_mark, &zero_to_space);
 	swap_afsk_bufs(&mark_to_zero, &space_to_zero);
 	swap_afsk_bufs(&mark_to_mark, &space_to_space);
+	afsk_reversed = !afsk_reversed;
+	tinc = nco_mark_inc;
+	nco_mark_inc = nco_space_inc;
+	nco_space_inc = tinc;
 	AFSK_UNLOCK();
 }
 
 static void
 send_afsk_preamble(void)
 {
+	wait_afsk_space();
 	AFSK_LOCK();
+	afsk_aborting = false;
 	send_afsk_bit(AFSK_STOP);
 	send_afsk_bit(AFSK_STOP);
 	send_afsk_bit(AFSK_STOP);
 	send_afsk_bit(AFSK_STOP);
 	send_afsk_bit(AFSK_STOP);
+	sem_post(&qsem);
 	AFSK_UNLOCK();
 }
 
+/*
+ * Called by the AFSK thread when it has played the last buffer.  If
+ * something was queued meanwhile, there's no need to idle.  Since the
+ * queue is empty, there's room without waiting.  A file isn't played
+ * in real time, so it would fill up with idles.
+ */
 static void
 diddle_afsk(void)
 {
-	send_afsk_char(0x1f);
+	AFSK_LOCK();
+	if (afsk_file[0] == 0 && !afsk_aborting &&
+	    atomic_load(&qhead) == atomic_load(&qtail)) {
+		/* ASCII has no idle character, just hold mark */
+		if (afsk_data_bits > 5)
+			send_afsk_bit(AFSK_STOP);
+		else
+			queue_afsk_char(0x1f);
+		sem_post(&qsem);
+	}
+	AFSK_UNLOCK();
+}
+
+/*
+ * If abort_afsk() has been called, drops the staged audio and stops
+ * the device again, in case a write was in progress.  Only the AFSK
+ * thread calls this.
+ */
+static void
+check_afsk_abort(size_t *staged)
+{
+	if (!atomic_exchange(&afsk_abort, false))
+		return;
+	*staged = 0;
+	// Only what was actually written counts now
+	afsk_rendered = atomic_load(&afsk_samples_out);
+	clear_char_ends();
+	if (afsk_file[0] == 0)
+		ioctl(dsp_afsk, AFSK_HALT, NULL);
 }
 
 static void *
 afsk_thread(void *arg)
 {
-	struct afsk_queue *ent;
+	struct afsk_seg seg;
+	struct afsk_buf *buf;
 	sigset_t blk;
 	(void)arg;
-	bool diddle = false;
+	bool emptied = false;
+	bool got;
+	size_t staged = 0;
+	size_t whole;
 
 	memset(&blk, 0xff, sizeof(blk));
 	assert(pthread_sigmask(SIG_BLOCK, &blk, NULL) == 0);
@@ -417,56 +1296,100 @@ afsk_thread(void *arg)
 #else
 	pthread_set_name_np(pthread_self(), "AFSK");
 #endif
+	rt_thread_setup(RT_AFSK, 0, "AFSK");
 
 	for (;;) {
-		sem_wait(&qsem);
-		AQ_LOCK();
-		if (qhead == NULL) {
-			AQ_UNLOCK();
+		check_afsk_abort(&staged);
+		got = next_afsk_seg(&seg, &emptied);
+		if (got) {
+			buf = seg.buf;
+			if (seg.ends_char) {
+				note_char_end(afsk_rendered + staged);
+				if (emptied)
+					goto dry;
+				continue;
+			}
+			if (buf == NULL)
+				staged += render_nco(&seg, afsk_stage + staged);
+			// Nothing to join it to, so play it from where it is
+			else if (staged == 0 && emptied) {
+				write_afsk_samples(buf->buf, buf->size);
+				goto dry;
+			}
+			else {
+				memcpy(afsk_stage + staged, buf->buf, buf->size * sizeof(afsk_stage[0]));
+				staged += buf->size;
+			}
+			if (emptied)
+				goto dry;
+			// Write whole fragments, and keep the rest for next time
+			if (staged >= afsk_chunk) {
+				whole = staged - staged % afsk_chunk;
+				write_afsk_samples(afsk_stage, whole);
+				staged -= whole;
+				memmove(afsk_stage, afsk_stage + whole, staged * sizeof(afsk_stage[0]));
+			}
 			continue;
 		}
-		ent = qhead;
-		qhead = qhead->next;
-		if (qhead == NULL) {
-			qtail = NULL;
-			if (!afsk_end)
-				diddle = true;
+dry:
+		check_afsk_abort(&staged);
+		// The queue is empty, play whatever is left
+		if (staged) {
+			write_afsk_samples(afsk_stage, staged);
+			staged = 0;
 		}
-		AQ_UNLOCK();
-		write_afsk_buf(ent->buf);
-		free(ent);
-		if (diddle) {
+		if (got && !afsk_end)
 			diddle_afsk();
-			diddle = false;
-		}
 		AFSK_LOCK();
-		AQ_LOCK();
-		if (qhead == NULL && afsk_end) {
+		if (afsk_end && atomic_load(&qhead) == atomic_load(&qtail)) {
+			// Nothing else is queued until end_afsk_tx() returns
+			AFSK_UNLOCK();
+			drain_afsk_dev();
+			AFSK_LOCK();
 			afsk_end = false;
-			close(dsp_afsk);
-			dsp_afsk = -1;
 			pthread_cond_broadcast(&afsk_ended);
 		}
-		AQ_UNLOCK();
 		AFSK_UNLOCK();
+		// Wakeups can outnumber batches after a flush
+		if (!got)
+			sem_wait(&qsem);
 	}
 }
 
+/*
+ * Throws away everything queued.  Only the sending side and
+ * end_afsk_thread() call this.
+ */
 static void
 flush_queue(void)
 {
-	struct afsk_queue *ent;
+	atomic_store(&qtail, atomic_load(&qhead));
+}
 
-	AQ_LOCK();
-	for (ent = qhead; ent != NULL; ent = qhead) {
-		qhead = ent->next;
-		free(ent);
-		AQ_UNLOCK();
-		assert(sem_trywait(&qsem) == 0);
-		AQ_LOCK();
-	}
-	qhead = qtail = NULL;
-	AQ_UNLOCK();
+/*
+ * Drops everything queued, staged, and in the device, so PTT can be
+ * released right away.
+ */
+static void
+abort_afsk(void)
+{
+	AFSK_LOCK();
+	afsk_aborting = true;
+	flush_queue();
+	clear_char_ends();
+	atomic_store(&afsk_abort, true);
+	if (dsp_afsk != -1 && afsk_file[0] == 0)
+		ioctl(dsp_afsk, AFSK_HALT, NULL);
+	// In full duplex, the output only holds a block or two
+	atomic_store(&duplex_tx, false);
+	atomic_store(&dtail, atomic_load(&dhead));
+	// Let a blocked sender see that it's been aborted
+	if (atomic_exchange(&qspace_wanted, false))
+		sem_post(&qspace);
+	if (atomic_exchange(&dspace_wanted, false))
+		sem_post(&dspace);
+	sem_post(&qsem);
+	AFSK_UNLOCK();
 }
 
 static void
@@ -475,6 +1398,9 @@ end_afsk_thread(void)
 	pthread_cancel(afsk_threadid);
 	pthread_join(afsk_threadid, NULL);
 	flush_queue();
+	AFSK_LOCK();
+	close_afsk_dev();
+	AFSK_UNLOCK();
 }
 
 struct send_fsk_api afsk_api = {
@@ -484,5 +1410,6 @@ struct send_fsk_api afsk_api = {
 	.send_char = send_afsk_char,
 	.setup = setup_afsk,
 	.end_fsk = end_afsk_thread,
-	.flush = flush_queue
+	.abort = abort_afsk,
+	.unsent = afsk_unsent
 };
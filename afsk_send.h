@@ -5,4 +5,13 @@
 
 extern struct send_fsk_api afsk_api;
 
+struct tx_turnaround {
+	uint64_t	count;
+	double		drain_ms;	// Audio left in the device, last time
+	double		late_total_ms;	// From the last sample playing to unkeying
+	double		late_max_ms;
+};
+void get_tx_turnaround(struct tx_turnaround *t);
+size_t afsk_duplex_read(int16_t *out, size_t frames);
+
 #endif
@@ -0,0 +1,389 @@
+/*-
+ * Copyright (c) 2018 Stephen Hurd, W8BSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Baud rate and shift auto-detection.  A bank of demodulators, one for
+ * each common configuration, is run on spare cores against the same
+ * audio as the main receiver.  Once one of them is decoding cleanly,
+ * the main receiver is switched to it.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+
+#include "autodetect.h"
+#include "bsdtty.h"
+#include "fsk_demod.h"
+#include "ui.h"
+
+struct candidate {
+	int		baud_numerator;
+	int		baud_denominator;
+	double		space_freq;
+	struct fsk_demod *demod;
+	uint64_t	last_frames;
+	uint64_t	last_sync;
+	uint64_t	last_errors;
+	// Decaying totals, protected by ad_mutex
+	double		frames;
+	double		sync;
+	double		errors;
+};
+
+static const struct {
+	int	numerator;
+	int	denominator;
+} bauds[] = {
+	{1000, 22},
+	{50, 1},
+	{75, 1},
+	{100, 1},
+};
+static const double shifts[] = {170, 425, 850};
+
+/*
+ * Once a candidate has this many back-to-back frames with an error
+ * rate at or below AD_MAX_ERRORS, it wins.  Only counting frames that
+ * follow directly after the previous one stops a candidate that's a
+ * multiple of the real speed from winning on isolated false frames.
+ */
+#define AD_MIN_FRAMES	16
+#define AD_MAX_ERRORS	0.2
+// Totals are halved when they pass this so old noise is forgotten
+#define AD_DECAY	128
+#define AD_RING		16
+
+static struct candidate *cand;
+static size_t ncand;
+static pthread_t *workers;
+static size_t nworkers;
+static atomic_bool running = ATOMIC_VAR_INIT(false);
+static bool stopping;
+static double ring[AD_RING][RX_BLOCK];
+static size_t ring_len[AD_RING];
+// The block was preceded by a dropped one
+static bool ring_gap[AD_RING];
+static bool dropped;
+static uint64_t ring_head;
+static uint64_t *ring_tail;
+static pthread_mutex_t ad_mutex = PTHREAD_MUTEX_INITIALIZER;
+STATIC_LOCK_PROF(ad_prof, "autodetect");
+static pthread_cond_t ad_cond = PTHREAD_COND_INITIALIZER;
+#define AD_LOCK()	assert(PROF_MUTEX_LOCK(&ad_mutex, ad_prof) == 0)
+#define AD_UNLOCK()	assert(pthread_mutex_unlock(&ad_mutex) == 0)
+// Serializes starting and stopping
+static pthread_mutex_t ad_ctl_mutex = PTHREAD_MUTEX_INITIALIZER;
+STATIC_LOCK_PROF(ad_ctl_prof, "autodetect_ctl");
+#define AD_CTL_LOCK()	assert(PROF_MUTEX_LOCK(&ad_ctl_mutex, ad_ctl_prof) == 0)
+#define AD_CTL_UNLOCK()	assert(pthread_mutex_unlock(&ad_ctl_mutex) == 0)
+
+static void reap_autodetect(void);
+static void * autodetect_thread(void *arg);
+
+void
+setup_autodetect(void)
+{
+	bool enable;
+
+	stop_autodetect();
+	SETTING_RLOCK();
+	enable = settings.autodetect;
+	SETTING_UNLOCK();
+	if (enable)
+		start_autodetect();
+}
+
+bool
+autodetect_running(void)
+{
+	return atomic_load(&running);
+}
+
+void
+start_autodetect(void)
+{
+	long ncpu;
+	size_t b, s, i;
+	double mark, space;
+	int rate;
+
+	AD_CTL_LOCK();
+	reap_autodetect();
+
+	SETTING_RLOCK();
+	mark = settings.mark_freq;
+	space = settings.space_freq;
+	rate = settings.dsp_rate / settings.rx_decimation;
+	SETTING_UNLOCK();
+
+	cand = calloc(sizeof(*cand), sizeof(bauds) / sizeof(bauds[0]) * sizeof(shifts) / sizeof(shifts[0]));
+	if (cand == NULL)
+		printf_errno("allocating auto-detect candidates");
+	ncand = 0;
+	for (b = 0; b < sizeof(bauds) / sizeof(bauds[0]); b++) {
+		for (s = 0; s < sizeof(shifts) / sizeof(shifts[0]); s++) {
+			/* Keep the mark where it is, and the shift direction */
+			cand[ncand].space_freq = mark + (space < mark ? -shifts[s] : shifts[s]);
+			if (cand[ncand].space_freq <= 0 || cand[ncand].space_freq >= rate / 2)
+				continue;
+			cand[ncand].baud_numerator = bauds[b].numerator;
+			cand[ncand].baud_denominator = bauds[b].denominator;
+			cand[ncand].demod = fsk_demod_new(mark, cand[ncand].space_freq,
+			    bauds[b].numerator, bauds[b].denominator, rate, NULL, NULL);
+			ncand++;
+		}
+	}
+
+	/* Leave a core for the main receiver. */
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 2)
+		nworkers = 1;
+	else
+		nworkers = ncpu - 1;
+	if (nworkers > ncand)
+		nworkers = ncand;
+	workers = calloc(sizeof(*workers), nworkers);
+	if (workers == NULL)
+		printf_errno("allocating auto-detect workers");
+	ring_tail = calloc(sizeof(*ring_tail), nworkers);
+	if (ring_tail == NULL)
+		printf_errno("allocating auto-detect ring");
+
+	AD_LOCK();
+	ring_head = 0;
+	dropped = false;
+	stopping = false;
+	AD_UNLOCK();
+	for (i = 0; i < nworkers; i++)
+		pthread_create(&workers[i], NULL, autodetect_thread, (void *)i);
+	atomic_store(&running, true);
+	show_rx_title("RX [AUTO]");
+	AD_CTL_UNLOCK();
+}
+
+void
+stop_autodetect(void)
+{
+	AD_CTL_LOCK();
+	if (atomic_load(&running)) {
+		atomic_store(&running, false);
+		show_rx_title(NULL);
+	}
+	reap_autodetect();
+	AD_CTL_UNLOCK();
+}
+
+void
+toggle_autodetect(void)
+{
+	if (atomic_load(&running))
+		stop_autodetect();
+	else
+		start_autodetect();
+}
+
+/*
+ * Tells the workers to exit, waits for them, and frees everything.
+ * ad_ctl_mutex must be held.
+ */
+static void
+reap_autodetect(void)
+{
+	size_t i;
+
+	if (workers == NULL)
+		return;
+	AD_LOCK();
+	stopping = true;
+	assert(pthread_cond_broadcast(&ad_cond) == 0);
+	AD_UNLOCK();
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+	free(ring_tail);
+	ring_tail = NULL;
+	for (i = 0; i < ncand; i++)
+		fsk_demod_free(cand[i].demod);
+	free(cand);
+	cand = NULL;
+	ncand = 0;
+}
+
+/*
+ * Called from the RX thread with each block of audio.  If a candidate
+ * has won, the main receiver is switched to it here.
+ */
+void
+autodetect_feed(const double *buf, size_t count)
+{
+	size_t i;
+	size_t best = SIZE_MAX;
+	double score;
+	double best_score = 0;
+	uint64_t oldest;
+	char title[32];
+
+	if (!atomic_load(&running))
+		return;
+	AD_LOCK();
+	if (stopping) {
+		AD_UNLOCK();
+		return;
+	}
+
+	/* Pick the winner, if there is one */
+	for (i = 0; i < ncand; i++) {
+		if (cand[i].sync < AD_MIN_FRAMES)
+			continue;
+		if (cand[i].errors / (cand[i].frames + cand[i].errors) > AD_MAX_ERRORS)
+			continue;
+		score = cand[i].sync * (1.0 - cand[i].errors / (cand[i].frames + cand[i].errors));
+		if (score > best_score) {
+			best_score = score;
+			best = i;
+		}
+	}
+	if (best != SIZE_MAX) {
+		/*
+		 * The workers are reaped by the next stop_autodetect(),
+		 * we can't wait for them in the RX thread.
+		 */
+		stopping = true;
+		assert(pthread_cond_broadcast(&ad_cond) == 0);
+		atomic_store(&running, false);
+		SETTING_WLOCK();
+		settings.space_freq = cand[best].space_freq;
+		settings.baud_numerator = cand[best].baud_numerator;
+		settings.baud_denominator = cand[best].baud_denominator;
+		publish_settings();
+		retune_rx(settings.mark_freq, settings.space_freq,
+		    settings.baud_numerator, settings.baud_denominator);
+		snprintf(title, sizeof(title), "RX %.2fbd %.0fHz",
+		    (double)cand[best].baud_numerator / cand[best].baud_denominator,
+		    fabs(cand[best].space_freq - settings.mark_freq));
+		SETTING_UNLOCK();
+		AD_UNLOCK();
+		show_rx_title(title);
+		return;
+	}
+
+	/* If the slowest worker is a full ring behind, drop the block. */
+	oldest = ring_head;
+	for (i = 0; i < nworkers; i++) {
+		if (ring_tail[i] < oldest)
+			oldest = ring_tail[i];
+	}
+	if (ring_head - oldest < AD_RING) {
+		if (count > RX_BLOCK)
+			count = RX_BLOCK;
+		memcpy(ring[ring_head % AD_RING], buf, count * sizeof(*buf));
+		ring_len[ring_head % AD_RING] = count;
+		ring_gap[ring_head % AD_RING] = dropped;
+		dropped = false;
+		ring_head++;
+		assert(pthread_cond_broadcast(&ad_cond) == 0);
+	}
+	else
+		dropped = true;
+	AD_UNLOCK();
+}
+
+static void *
+autodetect_thread(void *arg)
+{
+	size_t id = (size_t)arg;
+	double buf[RX_BLOCK];
+	size_t len;
+	size_t i;
+	bool gap;
+	uint64_t frames, sync, errors;
+	sigset_t blk;
+	char name[16];
+
+	memset(&blk, 0xff, sizeof(blk));
+	assert(pthread_sigmask(SIG_BLOCK, &blk, NULL) == 0);
+
+	snprintf(name, sizeof(name), "Autodetect %zu", id);
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), name);
+#else
+	pthread_set_name_np(pthread_self(), name);
+#endif
+
+	AD_LOCK();
+	for (;;) {
+		while (!stopping && ring_tail[id] == ring_head)
+			assert(pthread_cond_wait(&ad_cond, &ad_mutex) == 0);
+		if (stopping)
+			break;
+		len = ring_len[ring_tail[id] % AD_RING];
+		gap = ring_gap[ring_tail[id] % AD_RING];
+		memcpy(buf, ring[ring_tail[id] % AD_RING], len * sizeof(*buf));
+		ring_tail[id]++;
+		AD_UNLOCK();
+
+		/* Candidates are dealt out to the workers round-robin */
+		for (i = id; i < ncand; i += nworkers) {
+			if (gap)
+				fsk_demod_reset(cand[i].demod);
+			fsk_demod_feed(cand[i].demod, buf, len);
+		}
+
+		AD_LOCK();
+		for (i = id; i < ncand; i += nworkers) {
+			frames = fsk_demod_frames(cand[i].demod);
+			sync = fsk_demod_sync_frames(cand[i].demod);
+			errors = fsk_demod_framing_errors(cand[i].demod);
+			cand[i].frames += frames - cand[i].last_frames;
+			cand[i].sync += sync - cand[i].last_sync;
+			cand[i].errors += errors - cand[i].last_errors;
+			cand[i].last_frames = frames;
+			cand[i].last_sync = sync;
+			cand[i].last_errors = errors;
+			if (cand[i].frames + cand[i].errors > AD_DECAY) {
+				cand[i].frames /= 2;
+				cand[i].sync /= 2;
+				cand[i].errors /= 2;
+			}
+		}
+	}
+	AD_UNLOCK();
+
+	return NULL;
+}
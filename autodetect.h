@@ -0,0 +1,15 @@
+#ifndef AUTODETECT_H
+#define AUTODETECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+void setup_autodetect(void);
+void start_autodetect(void);
+void stop_autodetect(void);
+void toggle_autodetect(void);
+bool autodetect_running(void);
+void autodetect_feed(const double *buf, size_t count);
+
+#endif
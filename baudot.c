@@ -89,18 +89,17 @@ const int charset_count = sizeof(charsets) / sizeof(charsets[0]);
 char
 asc2baudot(int asc, bool figs)
 {
+	const char *chars = charsets[SETTINGS_SNAPSHOT()->charset].chars;
 	char ret = 0;
 	char *ch = NULL;
 
-	SETTING_RLOCK();
 	asc = toupper(asc);
 	if (figs)
-		ch = memchr(charsets[settings.charset].chars + 0x20, asc, 0x20);
+		ch = memchr(chars + 0x20, asc, 0x20);
 	if (ch == NULL)
-		ch = memchr(charsets[settings.charset].chars, asc, 0x40);
+		ch = memchr(chars, asc, 0x40);
 	if (ch != NULL)
-		ret = ch - charsets[settings.charset].chars;
-	SETTING_UNLOCK();
+		ret = ch - chars;
 
 	return ret;
 }
@@ -108,23 +107,13 @@ asc2baudot(int asc, bool figs)
 char
 baudot2asc(int baudot, bool figs)
 {
-	char ret;
-
 	if (baudot < 0 || baudot > 0x1f)
 		return 0;
-	SETTING_RLOCK();
-	ret = charsets[settings.charset].chars[baudot + figs * 0x20];
-	SETTING_UNLOCK();
-	return ret;
+	return charsets[SETTINGS_SNAPSHOT()->charset].chars[baudot + figs * 0x20];
 }
 
 const char *
 charset_name(void)
 {
-	const char *ret;
-
-	SETTING_RLOCK();
-	ret = charsets[settings.charset].name;
-	SETTING_UNLOCK();
-	return ret;
+	return charsets[SETTINGS_SNAPSHOT()->charset].name;
 }
@@ -0,0 +1,201 @@
+/*-
+ * Copyright (c) 2018 Stephen Hurd, W8BSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Checks that the AFC shift moves a tone rather than mixing it.  A
+ * tone at 2125 Hz + offset shifted down by the offset has to come out
+ * at 2125 Hz, with the image at 2125 Hz + twice the offset at least
+ * 30 dB down.  It runs afc_shift() from fsk_demod.c directly, and exits
+ * with a failure status if any offset or rate falls short.
+ *
+ * Build with "make afc_bench".
+ */
+
+#include "../fsk_demod.c"
+
+#define AFC_BENCH_LEN	8192
+#define AFC_MIN_DB	30
+
+struct bt_settings settings;
+pthread_rwlock_t settings_lock = PTHREAD_RWLOCK_INITIALIZER;
+LOCK_PROF(settings_lock_prof, "settings");
+_Atomic(const struct settings_snapshot *) current_settings;
+bool reverse;
+char *their_callsign;
+unsigned serial;
+struct send_fsk_api *send_fsk;
+pthread_mutex_t bsdtty_lock = PTHREAD_MUTEX_INITIALIZER;
+LOCK_PROF(bsdtty_lock_prof, "bsdtty");
+bool rts;
+pthread_rwlock_t rts_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+LOCK_PROF(rts_rwlock_prof, "rts");
+
+int
+strtoi(const char *nptr, char **endptr, int base)
+{
+	return strtol(nptr, endptr, base);
+}
+
+unsigned int
+strtoui(const char *nptr, char **endptr, int base)
+{
+	return strtoul(nptr, endptr, base);
+}
+
+void
+publish_settings(void)
+{
+}
+
+double
+frame_bits(void)
+{
+	return 7.5;
+}
+
+bool
+ascii_framing(void)
+{
+	return false;
+}
+
+bool
+parity_bit(unsigned ch, int data_bits, int parity)
+{
+	(void)ch;
+	(void)data_bits;
+	(void)parity;
+	return false;
+}
+
+void
+captured_callsign(const char *str)
+{
+	(void)str;
+}
+
+const char *
+format_freq(uint64_t freq)
+{
+	(void)freq;
+	return "";
+}
+
+void
+reinit(void)
+{
+}
+
+void
+send_string(char *str)
+{
+	(void)str;
+}
+
+bool
+do_macro(int fkey)
+{
+	(void)fkey;
+	return false;
+}
+
+void
+abort_tx(void)
+{
+}
+
+void
+get_tx_abort_stats(struct tx_abort_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+}
+
+/*
+ * Goertzel power of freq in buf.
+ */
+static double
+tone_power(const double *buf, size_t n, double freq, int rate)
+{
+	double c = 2 * cos(2 * M_PI * freq / rate);
+	double s0, s1 = 0, s2 = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		s0 = buf[i] + c * s1 - s2;
+		s2 = s1;
+		s1 = s0;
+	}
+	return s1 * s1 + s2 * s2 - c * s1 * s2;
+}
+
+/*
+ * Returns how far the image is below the wanted tone in dB.  The output
+ * is Hann windowed so leakage from the wanted tone doesn't show up as
+ * image.
+ */
+static double
+image_rejection(int rate, double offset)
+{
+	struct fsk_demod d = {.rate = rate, .afc_limit = 1000, .nco_re = 1.0};
+	static double out[AFC_BENCH_LEN];
+	double freq = 2125 + offset;
+	double want, image;
+	size_t i;
+
+	d.hilbert = create_hilbert_filter(AFC_HILBERT_LEN);
+	afc_set_offset(&d, offset);
+	for (i = 0; i < AFC_HILBERT_LEN; i++)
+		afc_shift(&d, sin(2 * M_PI * freq * i / rate));
+	for (i = 0; i < AFC_BENCH_LEN; i++)
+		out[i] = afc_shift(&d, sin(2 * M_PI * freq * (i + AFC_HILBERT_LEN) / rate)) *
+		    (0.5 - 0.5 * cos(2 * M_PI * i / (AFC_BENCH_LEN - 1)));
+	free_fir_filter(d.hilbert);
+	want = tone_power(out, AFC_BENCH_LEN, 2125, rate);
+	image = tone_power(out, AFC_BENCH_LEN, 2125 + 2 * offset, rate);
+	return 10 * log10(want / image);
+}
+
+int
+main(void)
+{
+	int rates[] = {8000, 11025, 16000};
+	double offsets[] = {-85, -60, -30, 30, 60, 85};
+	size_t r, o;
+	double db;
+	int ret = EXIT_SUCCESS;
+
+	printf("%6s %8s %10s\n", "rate", "offset", "image dB");
+	for (r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+		for (o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+			db = image_rejection(rates[r], offsets[o]);
+			printf("%6d %+8.0f %10.1f%s\n", rates[r], offsets[o],
+			    -db, db < AFC_MIN_DB ? " FAIL" : "");
+			if (db < AFC_MIN_DB)
+				ret = EXIT_FAILURE;
+		}
+	}
+	return ret;
+}
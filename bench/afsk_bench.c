@@ -0,0 +1,222 @@
+/*-
+ * Copyright (c) 2018 Stephen Hurd, W8BSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Compares the AFSK NCO with the precomputed half-bit buffers: how many
+ * samples a transmission comes out to against the exact number for the
+ * baud rate, the largest sample to sample step (a phase discontinuity
+ * would be bigger than the space tone's slope allows), and how long it
+ * takes to produce a second of audio.  It runs the real queueing and
+ * rendering code without the AFSK thread or a sound card.
+ *
+ * Build with "make afsk_bench", and run as
+ * afsk_bench [characters] [repetitions]
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "../afsk_send.c"
+
+struct bt_settings settings = {
+	.baud_numerator = 1000,
+	.baud_denominator = 22,
+	.mark_freq = 2125,
+	.space_freq = 2295,
+	.data_bits = 5,
+	.stop_bits = 1.5,
+	.parity = PARITY_NONE,
+	.afsk_file = "",
+};
+pthread_rwlock_t settings_lock = PTHREAD_RWLOCK_INITIALIZER;
+LOCK_PROF(settings_lock_prof, "settings");
+_Atomic(const struct settings_snapshot *) current_settings;
+
+void
+printf_errno(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+void
+write_rx_str(const char *str)
+{
+	fputs(str, stderr);
+}
+
+bool
+parity_bit(unsigned ch, int data_bits, int parity)
+{
+	int n = __builtin_popcount(ch & ((1U << data_bits) - 1));
+
+	return parity == PARITY_EVEN ? n & 1 : !(n & 1);
+}
+
+int
+get_duplex_dsp(void)
+{
+	return -1;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Takes everything off the queue, rendering it into out the way the
+ * AFSK thread would, and returns the number of samples.  Also tracks
+ * the largest step between samples.
+ */
+static size_t
+drain_bench_queue(int16_t *out, int *max_step, int16_t *last)
+{
+	struct afsk_seg seg;
+	bool emptied;
+	size_t total = 0;
+	size_t n, i;
+	const int16_t *s;
+
+	while (next_afsk_seg(&seg, &emptied)) {
+		if (seg.ends_char)
+			continue;
+		if (seg.buf == NULL) {
+			n = render_nco(&seg, out);
+			s = out;
+		}
+		else {
+			n = seg.buf->size;
+			s = seg.buf->buf;
+		}
+		for (i = 0; i < n; i++) {
+			if (abs(s[i] - *last) > *max_step)
+				*max_step = abs(s[i] - *last);
+			*last = s[i];
+		}
+		total += n;
+	}
+	return total;
+}
+
+static void
+bench_rate(int rate, bool nco, int chars, int reps)
+{
+	int16_t *out;
+	size_t got, total;
+	uint64_t want;
+	uint64_t halves;
+	int max_step = 0;
+	int16_t last = 0;
+	double t0, us;
+	int i, r;
+
+	afsk_dsp_rate = rate;
+	settings.afsk_nco = nco;
+	generate_afsk_samples();
+	build_afsk_cache();
+	setup_nco();
+	setup_afsk_stage();
+	out = malloc((rate + afsk_chunk) * sizeof(*out));
+	if (out == NULL)
+		printf_errno("allocating output");
+	atomic_store(&qhead, 0);
+	atomic_store(&qtail, 0);
+
+	// A preamble of five stop bits, then the characters
+	AFSK_LOCK();
+	for (i = 0; i < 5; i++)
+		send_afsk_bit(AFSK_STOP);
+	AFSK_UNLOCK();
+	total = drain_bench_queue(out, &max_step, &last);
+	for (i = 0; i < chars; i++) {
+		AFSK_LOCK();
+		queue_afsk_char((i * 7) & 0x1f);
+		AFSK_UNLOCK();
+		total += drain_bench_queue(out, &max_step, &last);
+	}
+	halves = 5 * afsk_stop_halves + (uint64_t)chars *
+	    (2 + 2 * afsk_data_bits + afsk_stop_halves);
+	want = halves * rate * settings.baud_denominator /
+	    (2 * settings.baud_numerator);
+
+	// One second of alternating mark and space, a bit at a time
+	t0 = now();
+	for (r = 0; r < reps; r++) {
+		for (got = 0; got < (size_t)rate;) {
+			if (nco) {
+				struct afsk_seg seg = {.halves = 2,
+				    .inc = (got & 64) ? nco_mark_inc : nco_space_inc};
+
+				got += render_nco(&seg, out + got);
+			}
+			else {
+				struct afsk_buf *b = (got & 64) ? &mark_to_mark : &space_to_space;
+
+				memcpy(out + got, b->buf, b->size * sizeof(*out));
+				got += b->size;
+				memcpy(out + got, b->buf, b->size * sizeof(*out));
+				got += b->size;
+			}
+		}
+	}
+	us = (now() - t0) / reps * 1e6;
+
+	printf("%6d %-7s %10zu %10" PRIu64 " %+8.3f%% %9d %9.0f %9.1f\n", rate,
+	    nco ? "NCO" : "buffers", total, want,
+	    (total - (double)want) * 100 / want, max_step,
+	    INT16_MAX * 2 * M_PI * settings.space_freq / rate, us);
+	free(out);
+}
+
+int
+main(int argc, char **argv)
+{
+	int rates[] = {8000, 11025, 44100, 48000};
+	int chars = argc > 1 ? atoi(argv[1]) : 140;
+	int reps = argc > 2 ? atoi(argv[2]) : 200;
+	size_t i;
+
+	if (sem_init(&qspace, 0, 0) == -1)
+		printf_errno("initializing semaphore");
+	printf("45.45 baud 5N1.5, preamble and %d characters\n", chars);
+	printf("%6s %-7s %10s %10s %9s %9s %9s %9s\n", "rate", "method",
+	    "samples", "exact", "error", "max step", "bound", "us/sec");
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		bench_rate(rates[i], true, chars, reps);
+		bench_rate(rates[i], false, chars, reps);
+	}
+	return 0;
+}
@@ -44,20 +44,27 @@
 #include <unistd.h>
 
 #include "afsk_send.h"
+#include "autodetect.h"
 #include "fsk_send.h"
 #include "baudot.h"
 #include "bsdtty.h"
 #include "fldigi_xmlrpc.h"
 #include "fsk_demod.h"
 #include "rigctl.h"
+#include "rtsched.h"
+#include "trace.h"
 #include "ui.h"
 
 static bool do_tx(int *rxstate);
 static void done(void);
 static void handle_rx_char(char ch);
 static void input_loop(void);
-static void send_char(const char ch);
-static void send_rtty_char(char ch);
+static void send_ascii_char(const char ch, unsigned aborts);
+static void send_char(const char ch, unsigned aborts);
+static void send_aborts_string(char *str, unsigned aborts);
+static void send_rtty_char(char ch, char echo);
+static void drop_tx_echo(void);
+static void flush_tx_echo(void);
 static void set_rts(bool newval, bool force);
 static void setup_log(void);
 noreturn static void usage(const char *cmd);
@@ -75,10 +82,15 @@ struct bt_settings settings = {
 	.space_freq = 2295,
 	.charset = 0,
 	.afsk = false,
+	.afsk_nco = false,
+	.full_duplex = false,
 	.ctl_ptt = false,
 	.freq_offset = 170,
 	.rigctld_port = 4532,
-	.xmlrpc_port = 7362
+	.xmlrpc_port = 7362,
+	.turnaround_blank = 50,
+	.rx_cpu = -1,
+	.afsk_cpu = -1
 };
 
 /* RX in reverse mode */
@@ -92,25 +104,57 @@ static bool send_start_crlf = true;
 static bool send_end_space = true;
 static pthread_t xmlrpc_thread;
 static pthread_t rx_thread;
+static pthread_t main_thread;
+/*
+ * Bumped by abort_tx() so strings being sent by other threads stop.
+ * The stats are protected by the RTS lock.
+ */
+static atomic_uint tx_aborts;
+static struct tx_abort_stats abort_stats;
+/*
+ * Text for the TX window and log waits here until the character it
+ * goes with has left the sound card or UART.  tx_seq counts the
+ * characters given to the sender, so everything before
+ * tx_seq - send_fsk->unsent() has been sent.
+ */
+#define TX_ECHO_LEN	1024
+struct tx_echo {
+	uint64_t	seq;
+	char		ch;
+};
+static struct tx_echo tx_echo[TX_ECHO_LEN];
+static size_t echo_head;
+static size_t echo_tail;
+static uint64_t tx_seq;
+static pthread_mutex_t echo_mutex = PTHREAD_MUTEX_INITIALIZER;
+STATIC_LOCK_PROF(echo_prof, "echo");
+#define ECHO_LOCK()	assert(PROF_MUTEX_LOCK(&echo_mutex, echo_prof) == 0)
+#define ECHO_UNLOCK()	assert(pthread_mutex_unlock(&echo_mutex) == 0)
 bool rts;
 // The mutex is to allow downgrading.
 pthread_mutex_t rts_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_rwlock_t rts_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+LOCK_PROF(rts_rwlock_prof, "rts");
 
 char *their_callsign;
 unsigned serial;
 pthread_rwlock_t settings_lock = PTHREAD_RWLOCK_INITIALIZER;
+LOCK_PROF(settings_lock_prof, "settings");
+_Atomic(const struct settings_snapshot *) current_settings;
 pthread_mutex_t bsdtty_lock = PTHREAD_MUTEX_INITIALIZER;
+LOCK_PROF(bsdtty_lock_prof, "bsdtty");
 
 int main(int argc, char **argv)
 {
+	const char *parities = "noems";
 	char *c;
 	int ch;
 
+	main_thread = pthread_self();
 	load_config();
 
 	SETTING_WLOCK();
-	while ((ch = getopt(argc, argv, "ac:C:d:f:hl:i:I:m:n:N:p:P:q:Q:r:s:t:T1:x:2:3:4:5:6:7:8:9:0:")) != -1) {
+	while ((ch = getopt(argc, argv, "aAb:c:C:d:Ef:g:G:hl:Li:I:m:n:N:o:p:P:q:Q:r:R:s:S:t:Ty:1:x:2:3:4:5:6:7:8:9:0:")) != -1) {
 		while (optarg && isspace(*optarg))
 			optarg++;
 		switch (ch) {
@@ -131,6 +175,15 @@ int main(int argc, char **argv)
 			case 'a':
 				settings.afsk = true;
 				break;
+			case 'A':
+				settings.afc = true;
+				break;
+			case 'E':
+				settings.early_chars = true;
+				break;
+			case 'b':
+				settings.data_bits = strtoi(optarg, NULL, 10);
+				break;
 			case 'c':
 				settings.charset = strtoi(optarg, NULL, 10);
 				if (settings.charset < 0 || settings.charset >= charset_count)
@@ -148,6 +201,12 @@ int main(int argc, char **argv)
 			case 'F':
 				settings.freq_offset = strtoi(optarg, NULL, 10);
 				break;
+			case 'g':
+				settings.iq_name = strdup(optarg);
+				break;
+			case 'G':
+				settings.iq_rate = strtoi(optarg, NULL, 10);
+				break;
 			case 'h':
 				SETTING_UNLOCK();
 				usage(argv[0]);
@@ -178,6 +237,9 @@ int main(int argc, char **argv)
 					}
 				}
 				break;
+			case 'o':
+				settings.afsk_file = strdup(optarg);
+				break;
 			case 'p':	// dsp_name
 				settings.dsp_name = strdup(optarg);
 				break;
@@ -196,15 +258,32 @@ int main(int argc, char **argv)
 			case 's':	// space_freq
 				settings.space_freq = strtod(optarg, NULL);
 				break;
+			case 'S':
+				settings.stop_bits = strtod(optarg, NULL);
+				break;
 			case 't':	// tty_name
 				settings.tty_name = strdup(optarg);
 				break;
 			case 'T':
 				settings.ctl_ptt = true;
 				break;
+			case 'R':
+				settings.rt_priority = strtoi(optarg, NULL, 10);
+				break;
+			case 'L':
+				settings.lock_memory = true;
+				break;
 			case 'x':
 				settings.xmlrpc_host = strdup(optarg);
 				break;
+			case 'y':
+				c = strchr(parities, tolower((unsigned char)*optarg));
+				if (*optarg == 0 || c == NULL) {
+					SETTING_UNLOCK();
+					usage(argv[0]);
+				}
+				settings.parity = c - parities;
+				break;
 			default:
 				SETTING_UNLOCK();
 				usage(argv[0]);
@@ -213,6 +292,7 @@ int main(int argc, char **argv)
 
 	setup_defaults();
 	fix_config();
+	publish_settings();
 	SETTING_UNLOCK();
 
 	setlocale(LC_ALL, "");
@@ -223,9 +303,16 @@ int main(int argc, char **argv)
 	 */
 	setup_xmlrpc(&xmlrpc_thread);
 
+	// Before curses, so it's printed after the screen is restored
+	atexit(print_lock_report);
+	setup_trace();
+
 	// Now set up curses
 	setup_curses();
 
+	// Before any audio threads so their stacks are locked too
+	setup_rt_memory();
+
 	// Do our cleanup handler here so the curses one is last.
 	atexit(done);
 
@@ -257,8 +344,12 @@ int main(int argc, char **argv)
 void
 reinit(void)
 {
+	SETTING_WLOCK();
 	load_config();
 	fix_config();
+	publish_settings();
+	SETTING_UNLOCK();
+	setup_rt_memory();
 
 	// Set up the FSK stuff.
 	send_fsk->end_fsk();
@@ -306,6 +397,18 @@ setup_defaults(void)
 		settings.callsign = strdup("W8BSD");
 	if (settings.rigctld_host == NULL)
 		settings.rigctld_host = strdup("localhost");
+	if (settings.rt_priority < 0)
+		settings.rt_priority = 0;
+	if (settings.rt_priority > 99)
+		settings.rt_priority = 99;
+	if (settings.rx_cpu < -1)
+		settings.rx_cpu = -1;
+	if (settings.afsk_cpu < -1)
+		settings.afsk_cpu = -1;
+	if (settings.iq_name == NULL)
+		settings.iq_name = strdup("");
+	if (settings.afsk_file == NULL)
+		settings.afsk_file = strdup("");
 }
 
 static void
@@ -338,9 +441,9 @@ handle_rx_char(char ch)
 		case 0x0e:	// FIGS
 			return;
 	}
+	/* The RX thread has already sent it to XML-RPC clients */
 	if (log_file != NULL)
 		fwrite(&ch, 1, 1, log_file);
-	fldigi_add_rx(ch);
 }
 
 static void
@@ -349,6 +452,9 @@ input_loop(void)
 	int rxstate = -1;
 
 	while (1) {
+		show_xruns(false);
+		check_trace_dump();
+		flush_tx_echo();
 		RTS_RLOCK();
 		if (rts) {	// TX Mode
 			RTS_UNLOCK();
@@ -358,6 +464,7 @@ input_loop(void)
 		}
 		else {
 			RTS_UNLOCK();
+			show_timing(false);
 			if (check_input()) {
 				if (!do_tx(&rxstate))
 					return;
@@ -379,16 +486,16 @@ do_tx(int *rxstate)
 	switch (ch) {
 		case -1:
 			break;
+		case 1:
+			set_afc(!get_afc());
+			break;
+		case 2:
+			toggle_autodetect();
+			break;
 		case 3:
 			return false;
 		case 4:
-			RTS_WLOCK();
-			if (rts) {
-				set_rts(false, true);
-				RTS_UNLOCK();
-			}
-			else
-				RTS_UNLOCK();
+			abort_tx();
 			break;
 		case RTTY_FKEY(1):
 			do_macro(1);
@@ -440,6 +547,9 @@ do_tx(int *rxstate)
 			update_captured_call(their_callsign);
 			update_serial(serial);
 			BSDTTY_UNLOCK();
+			show_afc(get_afc(), get_afc_offset());
+			show_xruns(true);
+			show_timing(true);
 			break;
 		case '`':
 			BSDTTY_LOCK();
@@ -453,6 +563,7 @@ do_tx(int *rxstate)
 			settings.charset--;
 			if (settings.charset < 0)
 				settings.charset = charset_count - 1;
+			publish_settings();
 			SETTING_UNLOCK();
 			display_charset(charset_name());
 			break;
@@ -461,12 +572,22 @@ do_tx(int *rxstate)
 			settings.charset++;
 			if (settings.charset == charset_count)
 				settings.charset = 0;
+			publish_settings();
 			SETTING_UNLOCK();
 			display_charset(charset_name());
 			break;
 		case '\\':
 			reset_tuning_aid();
 			break;
+		case 20:
+			RTS_RLOCK();
+			if (!rts) {
+				RTS_UNLOCK();
+				toggle_timing_display();
+			}
+			else
+				RTS_UNLOCK();
+			break;
 		case 23:
 			RTS_RLOCK();
 			if (!rts) {
@@ -488,7 +609,7 @@ do_tx(int *rxstate)
 				RTS_UNLOCK();
 			break;
 		default:
-			send_char(ch);
+			send_char(ch, atomic_load(&tx_aborts));
 			break;
 	}
 	return true;
@@ -496,17 +617,73 @@ do_tx(int *rxstate)
 
 void
 send_string(char *str)
+{
+	send_aborts_string(str, atomic_load(&tx_aborts));
+}
+
+/*
+ * Sends str unless there has been an abort since tx_aborts was aborts.
+ */
+static void
+send_aborts_string(char *str, unsigned aborts)
 {
 	char *ch;
 
 	if (str == NULL)
 		return;
 
-	for (ch = str; *ch; ch++)
-		send_char(*ch);
+	for (ch = str; *ch; ch++) {
+		// The input loop can't see CTRL-D while we're in here
+		if (pthread_equal(pthread_self(), main_thread) && check_abort_key())
+			abort_tx();
+		if (atomic_load(&tx_aborts) != aborts)
+			break;
+		send_char(*ch, aborts);
+		flush_tx_echo();
+	}
 	free(str);
 }
 
+/*
+ * Stops a transmission right away, throwing away anything that hasn't
+ * been sent yet, including whatever the sound card or UART has
+ * buffered, and releases PTT.
+ */
+void
+abort_tx(void)
+{
+	struct timespec start, end;
+	double ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	atomic_fetch_add(&tx_aborts, 1);
+	// Show what made it out before it's all counted as gone
+	flush_tx_echo();
+	// Wake up a sender that's waiting for room before taking the lock
+	send_fsk->abort();
+	drop_tx_echo();
+	RTS_WLOCK();
+	if (rts) {
+		set_rts(false, true);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		ms = (end.tv_sec - start.tv_sec) * 1000.0 +
+		    (end.tv_nsec - start.tv_nsec) / 1000000.0;
+		abort_stats.count++;
+		abort_stats.last_ms = ms;
+		if (ms > abort_stats.max_ms)
+			abort_stats.max_ms = ms;
+	}
+	RTS_UNLOCK();
+}
+
+void
+get_tx_abort_stats(struct tx_abort_stats *st)
+{
+	RTS_RLOCK();
+	*st = abort_stats;
+	RTS_UNLOCK();
+}
+
 bool
 do_macro(int fkey)
 {
@@ -516,6 +693,7 @@ do_macro(int fkey)
 	char *str;
 	bool clear = false;
 	bool upd_ser = false;
+	unsigned aborts = atomic_load(&tx_aborts);
 
 	m = fkey - 1;
 	SETTING_RLOCK();
@@ -526,23 +704,23 @@ do_macro(int fkey)
 	if (strncasecmp(settings.macros[m], "CQ CQ", 5) == 0)
 		clear = true;
 	len = strlen(settings.macros[m]);
-	for (i = 0; i < len; i++) {
+	for (i = 0; i < len && atomic_load(&tx_aborts) == aborts; i++) {
 		switch (settings.macros[m][i]) {
 			case '\\':
-				send_string(strdup(settings.callsign));
+				send_aborts_string(strdup(settings.callsign), aborts);
 				break;
 			case '`':
 				BSDTTY_LOCK();
 				str = strdup(their_callsign ? their_callsign : "");
 				BSDTTY_UNLOCK();
-				send_string(str);
+				send_aborts_string(str, aborts);
 				break;
 			case '[':
-				send_char('\r');
+				send_char('\r', aborts);
 				break;
 			case ']':
 				// TODO: CR is expanded to CRLF...
-				send_char('\n');
+				send_char('\n', aborts);
 				break;
 			case '^':
 				BSDTTY_LOCK();
@@ -554,10 +732,10 @@ do_macro(int fkey)
 				BSDTTY_LOCK();
 				asprintf(&str, "%d", serial);
 				BSDTTY_UNLOCK();
-				send_string(str);
+				send_aborts_string(str, aborts);
 				break;
 			default:
-				send_char(settings.macros[m][i]);
+				send_char(settings.macros[m][i], aborts);
 				break;
 		}
 	}
@@ -585,22 +763,24 @@ set_rts(bool newval, bool force)
 	static uint64_t freq = 0;
 	static char mode[16];
 
+	TRACE_BEGIN("set_rts", newval ? "key" : "unkey");
 	rts = newval;
 	if (!rts) {
 		if (force)
-			send_fsk->flush();
+			send_fsk->abort();
 		if (send_end_space && !force)
-			send_rtty_char(4);
+			send_rtty_char(ascii_framing() ? ' ' : 4, 0);
 		send_fsk->end_tx();
+		if (force)
+			drop_tx_echo();
+		else
+			flush_tx_echo();
 		RX_UNLOCK();
 	}
 	if (rts) {
 		get_rig_freq_mode(&freq, mode, sizeof(mode));
-		if (freq) {
-			SETTING_RLOCK();
-			freq += settings.freq_offset;
-			SETTING_UNLOCK();
-		}
+		if (freq)
+			freq += SETTINGS_SNAPSHOT()->freq_offset;
 	}
 	now = time(NULL);
 	if (log_file != NULL) {
@@ -621,8 +801,11 @@ set_rts(bool newval, bool force)
 		 * This also covers the RX -> TX switching time
 		 * due to the relay.
 		 */
-		if (!force)
+		if (!force) {
+			TRACE_BEGIN("preamble", NULL);
 			send_fsk->send_preamble();
+			TRACE_END("preamble");
+		}
 		txfigs = false;
 		/*
 		 * Per ITU-T S.1, the FIRST symbol should be a
@@ -631,25 +814,48 @@ set_rts(bool newval, bool force)
 		 * repeated after the CRLF.
 		 */
 		if (!force) {
-			send_rtty_char(0x1f);
-			if (send_start_crlf) {
-				send_rtty_char(8);
-				send_rtty_char(2);
+			if (ascii_framing()) {
+				if (send_start_crlf) {
+					send_rtty_char('\r', 0);
+					send_rtty_char('\n', 0);
+				}
+			}
+			else {
+				send_rtty_char(0x1f, 0);
+				if (send_start_crlf) {
+					send_rtty_char(8, 0);
+					send_rtty_char(2, 0);
+				}
 			}
 		}
 	}
+	TRACE_END("set_rts");
 }
 
+/*
+ * Nothing is sent if there has been an abort since tx_aborts was
+ * aborts.  Checking under the RTS lock means a sender that was already
+ * in here when abort_tx() ran can't key up again afterwards.
+ */
 static void
-send_char(const char ch)
+send_char(const char ch, unsigned aborts)
 {
 	const char fstr[] = "\x1f\x1b"; // LTRS, FIGS
 	char bch;
 	char ach;
+	char echo = 0;
 
+	if (ascii_framing()) {
+		send_ascii_char(ch, aborts);
+		return;
+	}
 	bch = asc2baudot(ch, txfigs);
 
 	RTS_WLOCK();
+	if (atomic_load(&tx_aborts) != aborts) {
+		RTS_UNLOCK();
+		return;
+	}
 	if (ch == '\t' || (!rts && bch != 0)) {
 		rts = !rts;
 		set_rts(rts, false);
@@ -661,7 +867,7 @@ send_char(const char ch)
 		// Send FIGS/LTRS as needed
 		if ((!!(bch & 0x20)) != txfigs) {
 			txfigs = !!(bch & 0x20);
-			send_rtty_char(fstr[txfigs]);
+			send_rtty_char(fstr[txfigs], 0);
 		}
 		/* We do this to ensure it's valid baudot */
 		ach = baudot2asc(bch & 0x1f, bch & 0x20);
@@ -674,26 +880,47 @@ send_char(const char ch)
 			case 0x0f:
 				txfigs = true;
 				break;
-			case '\r':
-				write_tx('\r');
-				if (log_file != NULL)
-					fwrite("\r\n", 2, 1, log_file);
-				break;
 			default:
-				write_tx(ach);
-				if (log_file != NULL)
-					fwrite(&ach, 1, 1, log_file);
+				echo = ach;
 				break;
 		}
 		if (ach == ' ')
 			txfigs = false;	// USOS
 		bch &= 0x1f;
-		send_rtty_char(bch);
+		send_rtty_char(bch, echo);
 		if (bch == 0x08)
-			send_rtty_char(2);
+			send_rtty_char(2, 0);
 	}
 }
 
+/*
+ * Like send_char(), but for ASCII framing, there are no shifts and
+ * nothing needs to be translated.
+ */
+static void
+send_ascii_char(const char ch, unsigned aborts)
+{
+	bool valid;
+
+	valid = (ch >= ' ' && ch < 0x7f) || ch == '\r' || ch == '\n' ||
+	    ch == '\a';
+	RTS_WLOCK();
+	if (atomic_load(&tx_aborts) != aborts) {
+		RTS_UNLOCK();
+		return;
+	}
+	if (ch == '\t' || (!rts && valid)) {
+		rts = !rts;
+		set_rts(rts, false);
+	}
+	RTS_UNLOCK();
+	if (!valid)
+		return;
+	send_rtty_char(ch, ch);
+	if (ch == '\r')
+		send_rtty_char('\n', 0);
+}
+
 static void
 done(void)
 {
@@ -768,6 +995,103 @@ strtoui(const char *nptr, char **endptr, int base)
 	return ret;
 }
 
+/*
+ * The parity bit to send after the low data_bits of ch.
+ */
+bool
+parity_bit(unsigned ch, int data_bits, int parity)
+{
+	int i;
+	bool odd = false;
+
+	for (i = 0; i < data_bits; i++)
+		odd ^= (ch >> i) & 1;
+	switch (parity) {
+		case PARITY_ODD:
+			return !odd;
+		case PARITY_EVEN:
+			return odd;
+		case PARITY_MARK:
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Settings snapshots are interned rather than freed, so switching back
+ * to an earlier character set or configuration reuses its snapshot.
+ */
+struct snapshot_entry {
+	struct settings_snapshot	snap;
+	struct snapshot_entry		*next;
+};
+static struct snapshot_entry *snapshots;
+
+/*
+ * Publishes the current settings to lock-free readers.  Call it after
+ * changing any of them.
+ *
+ * Settings write lock must be held.
+ */
+void
+publish_settings(void)
+{
+	struct settings_snapshot snap;
+	struct snapshot_entry *e;
+
+	// Zeroed so the padding compares equal too
+	memset(&snap, 0, sizeof(snap));
+	snap.charset = settings.charset;
+	snap.baud_numerator = settings.baud_numerator;
+	snap.baud_denominator = settings.baud_denominator;
+	snap.data_bits = settings.data_bits;
+	snap.parity = settings.parity;
+	snap.stop_bits = settings.stop_bits;
+	snap.freq_offset = settings.freq_offset;
+	snap.mark_freq = settings.mark_freq;
+	snap.space_freq = settings.space_freq;
+	snap.dsp_rate = settings.dsp_rate;
+	snap.rx_decimation = settings.rx_decimation;
+	if (settings.callsign)
+		strncpy(snap.callsign_prefix, settings.callsign, sizeof(snap.callsign_prefix) - 1);
+
+	for (e = snapshots; e != NULL; e = e->next) {
+		if (memcmp(&e->snap, &snap, sizeof(snap)) == 0)
+			break;
+	}
+	if (e == NULL) {
+		e = malloc(sizeof(*e));
+		if (e == NULL)
+			printf_errno("allocating settings snapshot");
+		memcpy(&e->snap, &snap, sizeof(snap));
+		e->next = snapshots;
+		snapshots = e;
+	}
+	atomic_store_explicit(&current_settings, &e->snap, memory_order_release);
+}
+
+/*
+ * Length of a character in bit times, including the start, parity,
+ * and stop bits.
+ */
+double
+frame_bits(void)
+{
+	const struct settings_snapshot *s = SETTINGS_SNAPSHOT();
+
+	return 1 + s->data_bits + (s->parity != PARITY_NONE) + s->stop_bits;
+}
+
+/*
+ * With more than five data bits, characters are sent as ASCII rather
+ * than Baudot.
+ */
+bool
+ascii_framing(void)
+{
+	return SETTINGS_SNAPSHOT()->data_bits > 5;
+}
+
 noreturn static void
 usage(const char *cmd)
 {
@@ -797,8 +1121,18 @@ usage(const char *cmd)
 	       "-0  F10 Macro                    <empty>\n"
 	       "-c  Charset to use               0\n"
 	       "-a  Use AFSK (no argument)\n"
+	       "-A  Enable AFC (no argument)\n"
+	       "-E  Show characters before the stop bit (no argument)\n"
+	       "-b  Data bits (5 is Baudot)      5\n"
+	       "-y  Parity (n, o, e, m, or s)    n\n"
+	       "-S  Stop bits                    1.5\n"
+	       "-g  I/Q input file or pipe       <empty>\n"
+	       "-G  I/Q sample rate              96000\n"
+	       "-o  AFSK output file or pipe     <empty>\n"
 	       "-C  Callsign                     \"W8BSD\"\n"
 	       "-T  Use rig control PTT (no argument)\n"
+	       "-R  Real-time priority (0 off)   0\n"
+	       "-L  Lock memory (no argument)\n"
 	       "-f  VFO frequency offset         170\n"
 	       "-x  XML-RPC host name            \"localhost\"\n"
 	       "-P  XML-RPC port                 7362\n"
@@ -812,10 +1146,67 @@ usage(const char *cmd)
 	exit(EXIT_FAILURE);
 }
 
+/*
+ * echo is what goes in the TX window and log once ch has been sent,
+ * or 0 for nothing.
+ */
 static void
-send_rtty_char(char ch)
+send_rtty_char(char ch, char echo)
 {
 	send_fsk->send_char(ch);
+	ECHO_LOCK();
+	// It can't fill up unless the sender is badly stuck
+	if (echo && echo_head - echo_tail < TX_ECHO_LEN)
+		tx_echo[echo_head++ % TX_ECHO_LEN] = (struct tx_echo){tx_seq, echo};
+	tx_seq++;
+	ECHO_UNLOCK();
+}
+
+/*
+ * Shows and logs the echo for everything that has been sent.  The
+ * whole batch goes to the TX window in one refresh.
+ */
+static void
+flush_tx_echo(void)
+{
+	char buf[TX_ECHO_LEN + 1];
+	size_t n = 0;
+	size_t i;
+	uint64_t sent;
+	size_t unsent;
+
+	ECHO_LOCK();
+	if (echo_head != echo_tail) {
+		// The one being sent now may not be counted in tx_seq yet
+		unsent = send_fsk->unsent();
+		sent = unsent < tx_seq ? tx_seq - unsent : 0;
+		while (echo_tail != echo_head && tx_echo[echo_tail % TX_ECHO_LEN].seq < sent)
+			buf[n++] = tx_echo[echo_tail++ % TX_ECHO_LEN].ch;
+	}
+	ECHO_UNLOCK();
+	if (n == 0)
+		return;
+	buf[n] = 0;
+	write_tx_str(buf);
+	if (log_file != NULL) {
+		for (i = 0; i < n; i++) {
+			if (buf[i] == '\r')
+				fwrite("\r\n", 2, 1, log_file);
+			else
+				fwrite(&buf[i], 1, 1, log_file);
+		}
+	}
+}
+
+/*
+ * After an abort, what's left was never sent.
+ */
+static void
+drop_tx_echo(void)
+{
+	ECHO_LOCK();
+	echo_tail = echo_head;
+	ECHO_UNLOCK();
 }
 
 void
@@ -839,14 +1230,20 @@ fix_config(void)
 {
 	if (settings.dsp_name == NULL)
 		settings.dsp_name = strdup("/dev/dsp");
+	if (settings.rx_decimation < 1)
+		settings.rx_decimation = 1;
+	// The demodulators need at least 8kHz
+	while (settings.rx_decimation > 1 &&
+	    settings.dsp_rate / settings.rx_decimation < 8000)
+		settings.rx_decimation--;
 	if (settings.mark_freq < 1)
 		settings.mark_freq = 2125;
-	if (settings.mark_freq > (double)settings.dsp_rate / 2)
-		settings.mark_freq = (double)settings.dsp_rate / 2 - 170;
+	if (settings.mark_freq > (double)settings.dsp_rate / settings.rx_decimation / 2)
+		settings.mark_freq = (double)settings.dsp_rate / settings.rx_decimation / 2 - 170;
 	if (settings.space_freq < 1)
 		settings.space_freq = 2295;
-	if (settings.space_freq > (double)settings.dsp_rate / 2)
-		settings.space_freq = (double)settings.dsp_rate / 2;
+	if (settings.space_freq > (double)settings.dsp_rate / settings.rx_decimation / 2)
+		settings.space_freq = (double)settings.dsp_rate / settings.rx_decimation / 2;
 	if (settings.dsp_rate < 8000)
 		settings.dsp_rate = 8000;
 	if (settings.baud_denominator < 1)
@@ -859,6 +1256,37 @@ fix_config(void)
 		settings.charset = 0;
 	if (settings.rigctld_host == NULL || settings.rigctld_host[0] == 0 || settings.rigctld_port == 0)
 		settings.ctl_ptt = false;
+	if (settings.data_bits < 5)
+		settings.data_bits = 5;
+	if (settings.data_bits > 8)
+		settings.data_bits = 8;
+	if (settings.parity < 0 || settings.parity > PARITY_LAST)
+		settings.parity = PARITY_NONE;
+	if (settings.stop_bits < 1)
+		settings.stop_bits = 1.5;
+	if (settings.stop_bits > 2)
+		settings.stop_bits = 2;
+	if (settings.stereo < 0 || settings.stereo > STEREO_LAST)
+		settings.stereo = STEREO_MONO;
+	if (settings.noise_blanker < 0)
+		settings.noise_blanker = 0;
+	if (settings.turnaround_blank < 0)
+		settings.turnaround_blank = 0;
+	if (settings.turnaround_blank > 1000)
+		settings.turnaround_blank = 1000;
+	if (settings.iq_name == NULL)
+		settings.iq_name = strdup("");
+	if (settings.afsk_file == NULL)
+		settings.afsk_file = strdup("");
+	if (settings.iq_rate < 8000)
+		settings.iq_rate = 96000;
+	// The channelizer FFT needs a power of two
+	if (settings.iq_channels < 16)
+		settings.iq_channels = 1024;
+	if (settings.iq_channels > 8192)
+		settings.iq_channels = 8192;
+	while (settings.iq_channels & (settings.iq_channels - 1))
+		settings.iq_channels &= settings.iq_channels - 1;
 }
 
 const char *
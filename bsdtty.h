@@ -6,6 +6,8 @@
 #include <pthread.h>
 #include <stdatomic.h>
 
+#include "lockprof.h"
+
 struct bt_settings {
 	char		*log_name;
 	char		*tty_name;
@@ -20,6 +22,9 @@ struct bt_settings {
 	char		*macros[10];
 	int		charset;
 	bool		afsk;
+	bool		afsk_nco;
+	char		*afsk_file;
+	bool		full_duplex;
 	char		*callsign;
 	bool		ctl_ptt;
 	bool		rigctld;
@@ -28,7 +33,66 @@ struct bt_settings {
 	int		freq_offset;
 	char		*xmlrpc_host;
 	uint16_t	xmlrpc_port;
+	bool		afc;
+	bool		autodetect;
+	int		data_bits;
+	int		parity;
+	double		stop_bits;
+	int		stereo;
+	char		*iq_name;
+	int		iq_rate;
+	int		iq_channels;
+	int		rx_decimation;
+	double		noise_blanker;
+	bool		agc;
+	bool		noise_correct;
+	bool		matched_waterfall;
+	bool		early_chars;
+	int		turnaround_blank;
+	int		rt_priority;
+	bool		rt_round_robin;
+	int		rx_cpu;
+	int		afsk_cpu;
+	bool		lock_memory;
+};
+
+/*
+ * The settings that are read for every character or block.  Each time
+ * the settings change, a new snapshot is published, and published
+ * snapshots are never modified or freed, so readers don't need the
+ * settings lock.  Use SETTINGS_SNAPSHOT() once and read everything from
+ * the same snapshot.
+ */
+struct settings_snapshot {
+	int		charset;
+	int		baud_numerator;
+	int		baud_denominator;
+	int		data_bits;
+	int		parity;
+	double		stop_bits;
+	int		freq_offset;
+	double		mark_freq;
+	double		space_freq;
+	int		dsp_rate;
+	int		rx_decimation;
+	char		callsign_prefix[3];
+};
+
+enum bt_parity {
+	PARITY_NONE,
+	PARITY_ODD,
+	PARITY_EVEN,
+	PARITY_MARK,
+	PARITY_SPACE
 };
+#define PARITY_LAST PARITY_SPACE
+
+enum bt_stereo {
+	STEREO_MONO,
+	STEREO_DUAL,
+	STEREO_DIVERSITY
+};
+#define STEREO_LAST STEREO_DIVERSITY
 
 struct send_fsk_api {
 	void (*toggle_reverse)(void);
@@ -37,36 +101,63 @@ struct send_fsk_api {
 	void (*send_char)(char ch);
 	void (*setup)(void);
 	void (*end_fsk)(void);
-	void (*flush)(void);
+	/*
+	 * Throws away everything queued or buffered in the device.
+	 * Nothing more is sent until the next preamble, and the next
+	 * end_tx() returns without waiting for anything to play.
+	 */
+	void (*abort)(void);
+	/*
+	 * Returns how many characters given to send_char() haven't left
+	 * the device yet.  Aborted ones count as gone.
+	 */
+	size_t (*unsent)(void);
 };
 
 extern struct bt_settings settings;
 extern pthread_rwlock_t settings_lock;
-#define SETTING_RLOCK()		assert(pthread_rwlock_rdlock(&settings_lock) == 0)
-#define SETTING_WLOCK()		assert(pthread_rwlock_wrlock(&settings_lock) == 0)
+LOCK_PROF_EXTERN(settings_lock_prof);
+#define SETTING_RLOCK()		assert(PROF_RDLOCK(&settings_lock, settings_lock_prof) == 0)
+#define SETTING_WLOCK()		assert(PROF_WRLOCK(&settings_lock, settings_lock_prof) == 0)
 #define SETTING_UNLOCK()	assert(pthread_rwlock_unlock(&settings_lock) == 0)
+extern _Atomic(const struct settings_snapshot *) current_settings;
+#define SETTINGS_SNAPSHOT()	atomic_load_explicit(&current_settings, memory_order_acquire)
 
 extern bool reverse;
 extern char *their_callsign;
 extern unsigned serial;
 extern struct send_fsk_api *send_fsk;
 extern pthread_mutex_t bsdtty_lock;
-#define BSDTTY_LOCK()		assert(pthread_mutex_lock(&bsdtty_lock) == 0)
+LOCK_PROF_EXTERN(bsdtty_lock_prof);
+#define BSDTTY_LOCK()		assert(PROF_MUTEX_LOCK(&bsdtty_lock, bsdtty_lock_prof) == 0)
 #define BSDTTY_UNLOCK()		assert(pthread_mutex_unlock(&bsdtty_lock) == 0)
 
 extern bool rts;
 extern pthread_mutex_t rts_lock;
 extern pthread_rwlock_t rts_rwlock;
-#define RTS_RLOCK()	assert(pthread_rwlock_rdlock(&rts_rwlock) == 0)
-#define RTS_WLOCK()	assert(pthread_rwlock_wrlock(&rts_rwlock) == 0)
+LOCK_PROF_EXTERN(rts_rwlock_prof);
+#define RTS_RLOCK()	assert(PROF_RDLOCK(&rts_rwlock, rts_rwlock_prof) == 0)
+#define RTS_WLOCK()	assert(PROF_WRLOCK(&rts_rwlock, rts_rwlock_prof) == 0)
 #define RTS_UNLOCK()	assert(pthread_rwlock_unlock(&rts_rwlock) == 0)
 
 int strtoi(const char *, char **endptr, int base);
+bool parity_bit(unsigned ch, int data_bits, int parity);
+void publish_settings(void);
+double frame_bits(void);
+bool ascii_framing(void);
 unsigned int strtoui(const char *nptr, char **endptr, int base);
 void captured_callsign(const char *str);
 const char *format_freq(uint64_t freq);
 void reinit(void);
 void send_string(char *str);
 bool do_macro(int fkey);
+void abort_tx(void);
+
+struct tx_abort_stats {
+	uint64_t	count;
+	double		last_ms;	// From abort_tx() to PTT released
+	double		max_ms;
+};
+void get_tx_abort_stats(struct tx_abort_stats *st);
 
 #endif
@@ -0,0 +1,740 @@
+/*-
+ * Copyright (c) 2018 Stephen Hurd, W8BSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Wideband I/Q input.  Complex baseband from an SDR (interleaved signed
+ * 16-bit native endian I then Q) is read from a file or pipe and split
+ * into evenly spaced channels by an oversampled polyphase filter bank.
+ * Each channel is shifted up to a quarter of its sample rate, the real
+ * part is taken, and the result is fed to its own demodulator.
+ *
+ * The filter bank runs in the I/Q thread, and the demodulators are
+ * split between worker threads on the remaining cores.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+
+#include "baudot.h"
+#include "bsdtty.h"
+#include "channelizer.h"
+#include "fsk_demod.h"
+#include "rtsched.h"
+#include "ui.h"
+
+// Prototype filter taps per polyphase branch
+#define IQ_TAPS		8
+// Output samples per channel in each block
+#define IQ_BLOCK	64
+#define IQ_RING		4
+// Longest line shown for a channel
+#define IQ_LINE		64
+// A partial line is shown after this many blocks without a character
+#define IQ_IDLE_BLOCKS	32
+// Back-to-back characters in one line before a channel is shown
+#define IQ_LOCK_FRAMES	12
+
+struct iq_channel {
+	struct fsk_demod *demod;
+	// Offset of the channel centre from the I/Q centre frequency
+	double		freq;
+	bool		figs;
+	bool		locked;
+	char		line[IQ_LINE + 1];
+	size_t		len;
+	// Demodulator statistics at the start of the line
+	uint64_t	line_frames;
+	uint64_t	line_sync;
+	uint64_t	line_errors;
+	uint64_t	last_frames;
+	unsigned	idle_blocks;
+};
+
+struct iq_block {
+	double		*samples;	// IQ_BLOCK per channel, channel-major
+	bool		gap;
+};
+
+static int iq_fd = -1;
+static size_t nbins;		// FFT size, number of filter bank bins
+static size_t decimation;
+static size_t oversample;	// nbins / decimation
+static double spacing;
+static int chan_rate;
+static bool ascii;
+
+// Prototype lowpass, nbins * IQ_TAPS long
+static double *proto;
+// Input history, twice the prototype length so it never wraps
+static double *hist_re;
+static double *hist_im;
+static size_t hist_pos;
+// Polyphase sums, transformed in place
+static double *bin_re;
+static double *bin_im;
+static double *tw_re;
+static double *tw_im;
+static size_t *bitrev;
+// Phase correction for the decimation, oversample entries
+static double *rot_re;
+static double *rot_im;
+static uint64_t frame;
+
+static struct iq_channel *chan;
+static size_t *chan_bin;
+static size_t nchan;
+
+static pthread_t *workers;
+static size_t nworkers;
+static struct iq_block ring[IQ_RING];
+static uint64_t ring_head;
+static uint64_t *ring_tail;
+static bool stopping;
+static bool draining;
+static pthread_mutex_t iq_mutex = PTHREAD_MUTEX_INITIALIZER;
+STATIC_LOCK_PROF(iq_prof, "iq");
+static pthread_cond_t iq_cond = PTHREAD_COND_INITIALIZER;
+#define IQ_LOCK()	assert(PROF_MUTEX_LOCK(&iq_mutex, iq_prof) == 0)
+#define IQ_UNLOCK()	assert(pthread_mutex_unlock(&iq_mutex) == 0)
+
+static void channelize(int16_t *in);
+static void create_prototype(double cutoff, int rate);
+static void fft(double *re, double *im);
+static void flush_line(struct iq_channel *c);
+static void free_channelizer(void *arg);
+static void iq_char(struct fsk_demod *d, int ch);
+static void * iq_thread(void *arg);
+static void * iq_worker(void *arg);
+static size_t read_iq(int16_t *buf, size_t frames);
+static void reap_workers(bool drain);
+
+/*
+ * Called in place of starting the RX thread.  The I/Q thread is
+ * returned in tid so it's cancelled the same way.
+ */
+void
+setup_channelizer(pthread_t *tid)
+{
+	double mark, space;
+	double shift, baud, cutoff, transition;
+	int baud_numerator, baud_denominator;
+	int rate;
+	size_t i, b;
+	long ncpu;
+	char title[32];
+
+	SETTING_RLOCK();
+	iq_fd = open(settings.iq_name, O_RDONLY);
+	if (iq_fd == -1)
+		printf_errno("unable to open I/Q input %s", settings.iq_name);
+	rate = settings.iq_rate;
+	nbins = settings.iq_channels;
+	mark = settings.mark_freq;
+	space = settings.space_freq;
+	baud_numerator = settings.baud_numerator;
+	baud_denominator = settings.baud_denominator;
+	SETTING_UNLOCK();
+	ascii = ascii_framing();
+
+	/*
+	 * A signal can be anywhere in a channel, so the channel filter
+	 * has to pass half the spacing plus half the signal bandwidth.
+	 * The channels overlap, and each one gets enough oversampling
+	 * that its passband stays below a quarter of the output rate,
+	 * where it ends up after the shift.
+	 */
+	spacing = (double)rate / nbins;
+	shift = fabs(space - mark);
+	baud = (double)baud_numerator / baud_denominator;
+	cutoff = spacing / 2 + shift / 2 + baud;
+	transition = 3.0 * rate / (nbins * IQ_TAPS);
+	for (oversample = 1; oversample < nbins; oversample *= 2) {
+		if ((double)rate * oversample / nbins >= 4 * (cutoff + transition) &&
+		    (double)rate * oversample / nbins >= 16 * baud)
+			break;
+	}
+	decimation = nbins / oversample;
+	chan_rate = lround((double)rate / decimation);
+
+	create_prototype(cutoff, rate);
+	hist_re = calloc(sizeof(*hist_re), nbins * IQ_TAPS * 2);
+	hist_im = calloc(sizeof(*hist_im), nbins * IQ_TAPS * 2);
+	bin_re = calloc(sizeof(*bin_re), nbins);
+	bin_im = calloc(sizeof(*bin_im), nbins);
+	tw_re = calloc(sizeof(*tw_re), nbins / 2);
+	tw_im = calloc(sizeof(*tw_im), nbins / 2);
+	bitrev = calloc(sizeof(*bitrev), nbins);
+	rot_re = calloc(sizeof(*rot_re), oversample);
+	rot_im = calloc(sizeof(*rot_im), oversample);
+	if (hist_re == NULL || hist_im == NULL || bin_re == NULL ||
+	    bin_im == NULL || tw_re == NULL || tw_im == NULL ||
+	    bitrev == NULL || rot_re == NULL || rot_im == NULL)
+		printf_errno("allocating channelizer");
+	hist_pos = 0;
+	frame = 0;
+	for (i = 0; i < nbins / 2; i++) {
+		tw_re[i] = cos(2.0 * M_PI * i / nbins);
+		tw_im[i] = sin(2.0 * M_PI * i / nbins);
+	}
+	for (i = 0; i < nbins; i++) {
+		for (b = 1; b < nbins; b <<= 1) {
+			bitrev[i] <<= 1;
+			if (i & b)
+				bitrev[i] |= 1;
+		}
+	}
+	for (i = 0; i < oversample; i++) {
+		rot_re[i] = cos(-2.0 * M_PI * i / oversample);
+		rot_im[i] = sin(-2.0 * M_PI * i / oversample);
+	}
+
+	/*
+	 * Skip the channels near the band edges, they're in the SDR's
+	 * anti-alias filter.
+	 */
+	chan = calloc(sizeof(*chan), nbins);
+	chan_bin = calloc(sizeof(*chan_bin), nbins);
+	if (chan == NULL || chan_bin == NULL)
+		printf_errno("allocating channels");
+	nchan = 0;
+	for (i = 0; i < nbins; i++) {
+		chan[nchan].freq = (i < nbins / 2 ? (double)i : (double)i - nbins) * spacing;
+		if (fabs(chan[nchan].freq) > (double)rate / 2 - cutoff)
+			continue;
+		chan_bin[nchan] = i;
+		/* Keep the shift direction, centred on the channel */
+		if (space > mark)
+			chan[nchan].demod = fsk_demod_new(chan_rate / 4.0 - shift / 2,
+			    chan_rate / 4.0 + shift / 2, baud_numerator,
+			    baud_denominator, chan_rate, iq_char, &chan[nchan]);
+		else
+			chan[nchan].demod = fsk_demod_new(chan_rate / 4.0 + shift / 2,
+			    chan_rate / 4.0 - shift / 2, baud_numerator,
+			    baud_denominator, chan_rate, iq_char, &chan[nchan]);
+		/*
+		 * The grid is coarser than the demodulator tolerates, so
+		 * AFC is always on to pull signals in.
+		 */
+		fsk_demod_set_afc(chan[nchan].demod, true);
+		nchan++;
+	}
+	if (nchan == 0)
+		printf_errno("no usable I/Q channels");
+
+	for (i = 0; i < IQ_RING; i++) {
+		ring[i].samples = malloc(sizeof(*ring[i].samples) * nchan * IQ_BLOCK);
+		if (ring[i].samples == NULL)
+			printf_errno("allocating I/Q ring");
+	}
+
+	/* Leave a core for the filter bank. */
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 2)
+		nworkers = 1;
+	else
+		nworkers = ncpu - 1;
+	if (nworkers > nchan)
+		nworkers = nchan;
+	workers = calloc(sizeof(*workers), nworkers);
+	ring_tail = calloc(sizeof(*ring_tail), nworkers);
+	if (workers == NULL || ring_tail == NULL)
+		printf_errno("allocating I/Q workers");
+	ring_head = 0;
+	stopping = false;
+	draining = false;
+	for (i = 0; i < nworkers; i++)
+		pthread_create(&workers[i], NULL, iq_worker, (void *)i);
+
+	snprintf(title, sizeof(title), "RX I/Q %zu x %.0fHz", nchan, spacing);
+	show_rx_title(title);
+	pthread_create(tid, NULL, iq_thread, NULL);
+}
+
+/*
+ * Windowed sinc, normalized for unity gain at DC.
+ */
+static void
+create_prototype(double cutoff, int rate)
+{
+	size_t len = nbins * IQ_TAPS;
+	size_t i;
+	double fc = cutoff / rate;
+	double x, sum = 0;
+
+	free(proto);
+	proto = malloc(sizeof(*proto) * len);
+	if (proto == NULL)
+		printf_errno("allocating channel filter");
+	for (i = 0; i < len; i++) {
+		x = i - (len - 1) / 2.0;
+		if (x == 0)
+			proto[i] = 2 * fc;
+		else
+			proto[i] = sin(2 * M_PI * fc * x) / (M_PI * x);
+		// Blackman window
+		proto[i] *= 0.42 - 0.5 * cos(2 * M_PI * i / (len - 1)) +
+		    0.08 * cos(4 * M_PI * i / (len - 1));
+		sum += proto[i];
+	}
+	for (i = 0; i < len; i++)
+		proto[i] /= sum;
+}
+
+/*
+ * In-place radix-2 FFT with a positive exponent, so bin k of the result
+ * is the polyphase sum downconverted from k * spacing Hz.
+ */
+static void
+fft(double *re, double *im)
+{
+	size_t i, j, k;
+	size_t len, half, step;
+	double tr, ti;
+
+	for (i = 0; i < nbins; i++) {
+		j = bitrev[i];
+		if (j > i) {
+			tr = re[i];
+			re[i] = re[j];
+			re[j] = tr;
+			ti = im[i];
+			im[i] = im[j];
+			im[j] = ti;
+		}
+	}
+	for (len = 2; len <= nbins; len <<= 1) {
+		half = len / 2;
+		step = nbins / len;
+		for (i = 0; i < nbins; i += len) {
+			for (k = 0; k < half; k++) {
+				j = i + k + half;
+				tr = re[j] * tw_re[k * step] - im[j] * tw_im[k * step];
+				ti = re[j] * tw_im[k * step] + im[j] * tw_re[k * step];
+				re[j] = re[i + k] - tr;
+				im[j] = im[i + k] - ti;
+				re[i + k] += tr;
+				im[i + k] += ti;
+			}
+		}
+	}
+}
+
+/*
+ * Reads exactly frames complex samples, or returns fewer at EOF.
+ */
+static size_t
+read_iq(int16_t *buf, size_t frames)
+{
+	size_t got = 0;
+	ssize_t ret;
+	size_t want = sizeof(*buf) * 2 * frames;
+
+	while (got < want) {
+		ret = read(iq_fd, (char *)buf + got, want - got);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			printf_errno("reading I/Q input");
+		}
+		if (ret == 0)
+			break;
+		got += ret;
+	}
+	return got / (sizeof(*buf) * 2);
+}
+
+/*
+ * Runs a block of input through the filter bank.  in has decimation *
+ * IQ_BLOCK complex samples, and out gets IQ_BLOCK samples per channel.
+ */
+static void
+channelize(int16_t *in)
+{
+	size_t len = nbins * IQ_TAPS;
+	size_t i, n, p, r, c;
+	const double *xr, *xi;
+	double vr, vi;
+	double yr, yi;
+	double v;
+	size_t rot;
+	double *out;
+
+	out = ring[ring_head % IQ_RING].samples;
+	for (i = 0; i < IQ_BLOCK; i++) {
+		for (n = 0; n < decimation; n++) {
+			hist_re[hist_pos] = hist_re[hist_pos + len] = in[0];
+			hist_im[hist_pos] = hist_im[hist_pos + len] = in[1];
+			in += 2;
+			hist_pos++;
+			if (hist_pos == len)
+				hist_pos = 0;
+		}
+		/* xr[-n] is the input from n samples ago */
+		xr = &hist_re[hist_pos + len - 1];
+		xi = &hist_im[hist_pos + len - 1];
+		for (p = 0; p < nbins; p++) {
+			vr = vi = 0;
+			for (r = p; r < len; r += nbins) {
+				vr += proto[r] * xr[-(ptrdiff_t)r];
+				vi += proto[r] * xi[-(ptrdiff_t)r];
+			}
+			bin_re[p] = vr;
+			bin_im[p] = vi;
+		}
+		fft(bin_re, bin_im);
+
+		/*
+		 * Undo the phase rotation from decimating by less than the
+		 * number of bins, then shift up by a quarter of the output
+		 * rate (multiply by j^frame) and keep the real part.
+		 */
+		for (c = 0; c < nchan; c++) {
+			rot = (chan_bin[c] * (frame % oversample)) % oversample;
+			yr = bin_re[chan_bin[c]] * rot_re[rot] - bin_im[chan_bin[c]] * rot_im[rot];
+			yi = bin_re[chan_bin[c]] * rot_im[rot] + bin_im[chan_bin[c]] * rot_re[rot];
+			switch (frame % 4) {
+				case 0:
+					v = yr;
+					break;
+				case 1:
+					v = -yi;
+					break;
+				case 2:
+					v = -yr;
+					break;
+				default:
+					v = yi;
+					break;
+			}
+			out[c * IQ_BLOCK + i] = v;
+		}
+		frame++;
+	}
+}
+
+static void *
+iq_thread(void *arg)
+{
+	int16_t *buf;
+	// pthread_cleanup_push() can be setjmp()
+	volatile bool gap = false;
+	sigset_t blk;
+	int ostate;
+	uint64_t oldest;
+	size_t i;
+	(void)arg;
+
+	memset(&blk, 0xff, sizeof(blk));
+	assert(pthread_sigmask(SIG_BLOCK, &blk, NULL) == 0);
+
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), "I/Q");
+#else
+	pthread_set_name_np(pthread_self(), "I/Q");
+#endif
+	rt_thread_setup(RT_RX, 0, "I/Q");
+
+	buf = malloc(sizeof(*buf) * 2 * decimation * IQ_BLOCK);
+	if (buf == NULL)
+		printf_errno("allocating I/Q buffer");
+	pthread_cleanup_push(free, buf);
+	pthread_cleanup_push(free_channelizer, NULL);
+
+	for (;;) {
+		if (read_iq(buf, decimation * IQ_BLOCK) < decimation * IQ_BLOCK)
+			break;
+		if (pthread_mutex_trylock(&rx_lock) != 0) {
+			/*
+			 * We were transmitting, throw away anything
+			 * from before the transmission.
+			 */
+			RX_LOCK();
+			RX_UNLOCK();
+			gap = true;
+			pthread_testcancel();
+			continue;
+		}
+		RX_UNLOCK();
+
+		/* Wait for the slowest worker to finish with the oldest block */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &ostate);
+		IQ_LOCK();
+		for (;;) {
+			oldest = ring_head;
+			for (i = 0; i < nworkers; i++) {
+				if (ring_tail[i] < oldest)
+					oldest = ring_tail[i];
+			}
+			if (ring_head - oldest < IQ_RING)
+				break;
+			assert(pthread_cond_wait(&iq_cond, &iq_mutex) == 0);
+		}
+		IQ_UNLOCK();
+		/* Nobody reads the head block until it's published */
+		channelize(buf);
+		IQ_LOCK();
+		ring[ring_head % IQ_RING].gap = gap;
+		gap = false;
+		ring_head++;
+		assert(pthread_cond_broadcast(&iq_cond) == 0);
+		IQ_UNLOCK();
+		pthread_setcancelstate(ostate, NULL);
+		pthread_testcancel();
+	}
+
+	/* End of input, let the workers finish up. */
+	reap_workers(true);
+	show_rx_title("RX I/Q EOF");
+	for (;;)
+		pause();
+
+	pthread_cleanup_pop(true);
+	pthread_cleanup_pop(true);
+	return NULL;
+}
+
+/*
+ * Stops the workers.  If drain is set, they finish the queued blocks
+ * and show any partial lines first.
+ */
+static void
+reap_workers(bool drain)
+{
+	size_t i;
+
+	if (workers == NULL)
+		return;
+	IQ_LOCK();
+	if (drain)
+		draining = true;
+	else
+		stopping = true;
+	assert(pthread_cond_broadcast(&iq_cond) == 0);
+	IQ_UNLOCK();
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+	free(ring_tail);
+	ring_tail = NULL;
+}
+
+static void
+free_channelizer(void *arg)
+{
+	size_t i;
+	(void)arg;
+
+	reap_workers(false);
+	for (i = 0; i < nchan; i++)
+		fsk_demod_free(chan[i].demod);
+	free(chan);
+	chan = NULL;
+	free(chan_bin);
+	chan_bin = NULL;
+	nchan = 0;
+	for (i = 0; i < IQ_RING; i++) {
+		free(ring[i].samples);
+		ring[i].samples = NULL;
+	}
+	free(proto);
+	proto = NULL;
+	free(hist_re);
+	free(hist_im);
+	free(bin_re);
+	free(bin_im);
+	free(tw_re);
+	free(tw_im);
+	free(bitrev);
+	free(rot_re);
+	free(rot_im);
+	hist_re = hist_im = bin_re = bin_im = NULL;
+	tw_re = tw_im = rot_re = rot_im = NULL;
+	bitrev = NULL;
+	if (iq_fd != -1)
+		close(iq_fd);
+	iq_fd = -1;
+	show_rx_title(NULL);
+}
+
+static void *
+iq_worker(void *arg)
+{
+	size_t id = (size_t)arg;
+	size_t first, last;
+	size_t c;
+	struct iq_block *blk;
+	uint64_t frames;
+	char name[16];
+	sigset_t sigs;
+
+	memset(&sigs, 0xff, sizeof(sigs));
+	assert(pthread_sigmask(SIG_BLOCK, &sigs, NULL) == 0);
+
+	snprintf(name, sizeof(name), "I/Q %zu", id);
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), name);
+#else
+	pthread_set_name_np(pthread_self(), name);
+#endif
+
+	/* Adjacent channels stay together */
+	first = nchan * id / nworkers;
+	last = nchan * (id + 1) / nworkers;
+
+	IQ_LOCK();
+	for (;;) {
+		while (!stopping && !draining && ring_tail[id] == ring_head)
+			assert(pthread_cond_wait(&iq_cond, &iq_mutex) == 0);
+		if (stopping || ring_tail[id] == ring_head)
+			break;
+		blk = &ring[ring_tail[id] % IQ_RING];
+		IQ_UNLOCK();
+
+		for (c = first; c < last; c++) {
+			if (blk->gap) {
+				fsk_demod_reset(chan[c].demod);
+				chan[c].len = 0;
+				chan[c].locked = false;
+				chan[c].line_frames = fsk_demod_frames(chan[c].demod);
+				chan[c].line_sync = fsk_demod_sync_frames(chan[c].demod);
+				chan[c].line_errors = fsk_demod_framing_errors(chan[c].demod);
+			}
+			fsk_demod_feed(chan[c].demod, &blk->samples[c * IQ_BLOCK], IQ_BLOCK);
+			frames = fsk_demod_frames(chan[c].demod);
+			if (frames != chan[c].last_frames) {
+				chan[c].last_frames = frames;
+				chan[c].idle_blocks = 0;
+			}
+			else if (chan[c].len && ++chan[c].idle_blocks >= IQ_IDLE_BLOCKS) {
+				/* The signal went away */
+				flush_line(&chan[c]);
+				chan[c].locked = false;
+			}
+		}
+
+		IQ_LOCK();
+		ring_tail[id]++;
+		assert(pthread_cond_broadcast(&iq_cond) == 0);
+	}
+	IQ_UNLOCK();
+
+	if (draining && !stopping) {
+		for (c = first; c < last; c++)
+			flush_line(&chan[c]);
+	}
+
+	return NULL;
+}
+
+static void
+iq_char(struct fsk_demod *d, int ret)
+{
+	struct iq_channel *c = fsk_demod_arg(d);
+	char ch;
+
+	if (ascii) {
+		ch = ret & 0x7f;
+		if (ch == '\r' || ch == '\n') {
+			flush_line(c);
+			return;
+		}
+		if (ch < ' ' || ch == 0x7f)
+			return;
+	}
+	else {
+		ch = baudot2asc(ret, c->figs);
+		switch (ch) {
+			case 0x0e:
+				c->figs = true;
+				return;
+			case 0x0f:
+				c->figs = false;
+				return;
+			case ' ':	// USOS
+				c->figs = false;
+				break;
+			case '\r':
+			case '\n':
+				flush_line(c);
+				return;
+		}
+		if (ch < ' ')
+			return;
+	}
+	c->line[c->len++] = ch;
+	if (c->len == IQ_LINE)
+		flush_line(c);
+}
+
+/*
+ * Shows a channel's line if it looks like real traffic.  Noise decodes
+ * as short bursts of characters with framing errors, a signal as a
+ * long run of characters back to back.  Once a channel has had such a
+ * run, its lines are shown until one doesn't look right.  Adjacent
+ * channels overlap, so lines are only shown by the channel the signal
+ * is closest to.
+ */
+static void
+flush_line(struct iq_channel *c)
+{
+	uint64_t frames, sync, errors;
+	double afc;
+	char str[IQ_LINE + 32];
+
+	frames = fsk_demod_frames(c->demod) - c->line_frames;
+	sync = fsk_demod_sync_frames(c->demod) - c->line_sync;
+	errors = fsk_demod_framing_errors(c->demod) - c->line_errors;
+	afc = fsk_demod_afc_offset(c->demod);
+	if (sync * 2 < frames || errors * 4 > frames || fabs(afc) > spacing / 2)
+		c->locked = false;
+	else if (sync >= IQ_LOCK_FRAMES)
+		c->locked = true;
+	if (c->locked && c->len) {
+		c->line[c->len] = 0;
+		snprintf(str, sizeof(str), "%+9.1f %s\r\n", c->freq + afc, c->line);
+		rx_string(str);
+	}
+	c->len = 0;
+	c->line_frames += frames;
+	c->line_sync += sync;
+	c->line_errors += errors;
+	c->idle_blocks = 0;
+}
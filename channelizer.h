@@ -0,0 +1,8 @@
+#ifndef CHANNELIZER_H
+#define CHANNELIZER_H
+
+#include <pthread.h>
+
+void setup_channelizer(pthread_t *tid);
+
+#endif
@@ -50,12 +50,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "afsk_send.h"
 #include "bsdtty.h"
 #include "fsk_demod.h"
 #include "rigctl.h"
+#include "timing.h"
+#include "trace.h"
 #include "ui.h"
+#include "xrun.h"
 
 static int *lsocks;
 static size_t nlsocks;
@@ -90,7 +95,8 @@ static void handle_xmlrpc(void);
 static void close_sockets(void *arg);
 
 static pthread_mutex_t rxbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define RXBUF_LOCK()	assert(pthread_mutex_lock(&rxbuf_mutex) == 0)
+STATIC_LOCK_PROF(rxbuf_prof, "xmlrpc_rxbuf");
+#define RXBUF_LOCK()	assert(PROF_MUTEX_LOCK(&rxbuf_mutex, rxbuf_prof) == 0)
 #define RXBUF_UNLOCK()	assert(pthread_mutex_unlock(&rxbuf_mutex) == 0)
 
 void
@@ -261,6 +267,26 @@ handle_request(int si)
 	int ret;
 	unsigned int uret;
 	size_t bytes;
+	struct rx_latency early;
+	struct rx_latency late;
+	uint64_t retracted;
+	struct rx_ring_stats capture;
+	struct rx_ring_stats ui;
+	struct xrun_stats xr;
+	struct tx_turnaround ta;
+	struct tx_abort_stats as;
+	struct tm tm;
+	const struct settings_snapshot *snap;
+	const char *name;
+	int i;
+	char tbuf[4096];
+	struct stage_summary stages[STAGE_COUNT];
+	size_t nstages;
+	size_t s;
+	struct lock_stats locks[64];
+	size_t nlocks;
+	size_t l;
+	char *lbuf;
 
 	for (bytes = 0; bytes < content_len;) {
 		if (headers) {
@@ -324,6 +350,7 @@ handle_request(int si)
 	}
 
 	/* Now handle the command */
+	TRACE_BEGIN("XML-RPC", cmd);
 	if (strcmp(cmd, "main.rx") == 0) {
 		RTS_RLOCK();
 		if (rts) {
@@ -334,6 +361,10 @@ handle_request(int si)
 			RTS_UNLOCK();
 		send_xmlrpc_response(csocks[si], NULL, NULL);
 	}
+	else if (strcmp(cmd, "main.abort") == 0) {
+		abort_tx();
+		send_xmlrpc_response(csocks[si], NULL, NULL);
+	}
 	else if (strcmp(cmd, "main.get_trx_state") == 0) {
 		RTS_RLOCK();
 		if (rts) {
@@ -396,10 +427,117 @@ handle_request(int si)
 			printf_errno("invalid rxbuf request offset (%ld:%ld from %zu:%zu)", start, len, rx_offset, rx_offset + rx_buflen);
 		RXBUF_UNLOCK();
 	}
+	else if (strcmp(cmd, "rx.get_latency") == 0) {
+		get_rx_latency(&early, &late, &retracted);
+		snprintf(buf, sizeof(buf),
+		    "<member><name>early</name><value><i4>%" PRIu64 "</i4></value></member>"
+		    "<member><name>early_avg_ms</name><value><double>%.3f</double></value></member>"
+		    "<member><name>early_max_ms</name><value><double>%.3f</double></value></member>"
+		    "<member><name>late</name><value><i4>%" PRIu64 "</i4></value></member>"
+		    "<member><name>late_avg_ms</name><value><double>%.3f</double></value></member>"
+		    "<member><name>late_max_ms</name><value><double>%.3f</double></value></member>"
+		    "<member><name>retracted</name><value><i4>%" PRIu64 "</i4></value></member>",
+		    early.count, early.count ? early.total_ms / early.count : 0.0, early.max_ms,
+		    late.count, late.count ? late.total_ms / late.count : 0.0, late.max_ms,
+		    retracted);
+		send_xmlrpc_response(csocks[si], "struct", buf);
+	}
+	else if (strcmp(cmd, "rx.get_buffers") == 0) {
+		get_rx_rings(&capture, &ui);
+		snprintf(buf, sizeof(buf),
+		    "<member><name>capture_blocks</name><value><i4>%zu</i4></value></member>"
+		    "<member><name>capture_fill</name><value><i4>%zu</i4></value></member>"
+		    "<member><name>capture_high_water</name><value><i4>%zu</i4></value></member>"
+		    "<member><name>capture_dropped</name><value><i4>%" PRIu64 "</i4></value></member>"
+		    "<member><name>ui_blocks</name><value><i4>%zu</i4></value></member>"
+		    "<member><name>ui_fill</name><value><i4>%zu</i4></value></member>"
+		    "<member><name>ui_high_water</name><value><i4>%zu</i4></value></member>"
+		    "<member><name>ui_dropped</name><value><i4>%" PRIu64 "</i4></value></member>"
+		    "<member><name>block_ms</name><value><double>%.3f</double></value></member>",
+		    capture.blocks, capture.fill, capture.high_water, capture.dropped,
+		    ui.blocks, ui.fill, ui.high_water, ui.dropped, capture.block_ms);
+		send_xmlrpc_response(csocks[si], "struct", buf);
+	}
+	else if (strcmp(cmd, "main.get_xruns") == 0) {
+		p = buf;
+		for (i = XRUN_RX; i <= XRUN_TX; i++) {
+			get_xruns(i, &xr);
+			name = i == XRUN_RX ? "rx_overruns" : "tx_underruns";
+			p += sprintf(p, "<member><name>%s</name><value><i4>%" PRIu64 "</i4></value></member>", name, xr.count);
+			if (xr.count == 0)
+				continue;
+			// Only the time of the first and last are kept
+			p += sprintf(p, "<member><name>%.2s_first</name><value><dateTime.iso8601>", name);
+			p += strftime(p, buf + sizeof(buf) - p, "%Y%m%dT%H:%M:%S", gmtime_r(&xr.first, &tm));
+			p += sprintf(p, "</dateTime.iso8601></value></member>");
+			p += sprintf(p, "<member><name>%.2s_last</name><value><dateTime.iso8601>", name);
+			p += strftime(p, buf + sizeof(buf) - p, "%Y%m%dT%H:%M:%S", gmtime_r(&xr.last, &tm));
+			p += sprintf(p, "</dateTime.iso8601></value></member>");
+		}
+		send_xmlrpc_response(csocks[si], "struct", buf);
+	}
+	else if (strcmp(cmd, "tx.get_turnaround") == 0) {
+		get_tx_turnaround(&ta);
+		get_tx_abort_stats(&as);
+		snprintf(buf, sizeof(buf),
+		    "<member><name>count</name><value><i4>%" PRIu64 "</i4></value></member>"
+		    "<member><name>drain_ms</name><value><double>%.3f</double></value></member>"
+		    "<member><name>late_avg_ms</name><value><double>%.3f</double></value></member>"
+		    "<member><name>late_max_ms</name><value><double>%.3f</double></value></member>"
+		    "<member><name>aborts</name><value><i4>%" PRIu64 "</i4></value></member>"
+		    "<member><name>abort_last_ms</name><value><double>%.3f</double></value></member>"
+		    "<member><name>abort_max_ms</name><value><double>%.3f</double></value></member>",
+		    ta.count, ta.drain_ms, ta.count ? ta.late_total_ms / ta.count : 0.0,
+		    ta.late_max_ms, as.count, as.last_ms, as.max_ms);
+		send_xmlrpc_response(csocks[si], "struct", buf);
+	}
+	else if (strcmp(cmd, "stats.get_timing") == 0) {
+		nstages = get_stage_timing(stages);
+		p = tbuf;
+		*p = 0;
+		for (s = 0; s < nstages; s++) {
+			p += sprintf(p, "<member><name>%s</name><value><struct>"
+			    "<member><name>blocks</name><value><i4>%" PRIu64 "</i4></value></member>"
+			    "<member><name>p50_us</name><value><double>%.3f</double></value></member>"
+			    "<member><name>p99_us</name><value><double>%.3f</double></value></member>"
+			    "<member><name>max_us</name><value><double>%.3f</double></value></member>"
+			    "</struct></value></member>",
+			    stages[s].name, stages[s].blocks, stages[s].p50_ns / 1000.0,
+			    stages[s].p99_ns / 1000.0, stages[s].max_ns / 1000.0);
+		}
+		send_xmlrpc_response(csocks[si], "struct", tbuf);
+	}
+	else if (strcmp(cmd, "stats.get_locks") == 0) {
+		nlocks = get_lock_stats(locks, sizeof(locks) / sizeof(locks[0]));
+		lbuf = malloc(nlocks * 640 + 16);
+		if (lbuf == NULL)
+			printf_errno("allocating lock stats");
+		p = lbuf;
+		p += sprintf(p, "<data>");
+		for (l = 0; l < nlocks; l++) {
+			p += sprintf(p, "<value><struct>"
+			    "<member><name>name</name><value><string>%s</string></value></member>"
+			    "<member><name>acquired</name><value><i4>%" PRIu64 "</i4></value></member>"
+			    "<member><name>contended</name><value><i4>%" PRIu64 "</i4></value></member>"
+			    "<member><name>wait_ms</name><value><double>%.3f</double></value></member>"
+			    "<member><name>p99_wait_us</name><value><double>%.1f</double></value></member>"
+			    "<member><name>max_wait_us</name><value><double>%.1f</double></value></member>"
+			    "<member><name>longest_wait_on</name><value><string>%s</string></value></member>"
+			    "</struct></value>",
+			    locks[l].name, locks[l].acquired, locks[l].contended, locks[l].wait_ms,
+			    locks[l].p99_wait_us, locks[l].max_wait_us, locks[l].blocker);
+		}
+		sprintf(p, "</data>");
+		send_xmlrpc_response(csocks[si], "array", lbuf);
+		free(lbuf);
+	}
+	else if (strcmp(cmd, "stats.reset_timing") == 0) {
+		reset_stage_timing();
+		send_xmlrpc_response(csocks[si], NULL, NULL);
+	}
 	else if (strcmp(cmd, "modem.get_carrier") == 0) {
-		SETTING_RLOCK();
-		sprintf(buf, "%d", (int)((settings.mark_freq + settings.space_freq) / 2));
-		SETTING_UNLOCK();
+		snap = SETTINGS_SNAPSHOT();
+		sprintf(buf, "%d", (int)((snap->mark_freq + snap->space_freq) / 2) + get_afc_offset());
 		send_xmlrpc_response(csocks[si], "int", buf);
 	}
 	else if (strcmp(cmd, "modem.set_carrier") == 0) {
@@ -461,6 +599,20 @@ handle_request(int si)
 		BSDTTY_UNLOCK();
 		send_xmlrpc_response(csocks[si], "boolean", buf);
 	}
+	else if (strcmp(cmd, "main.get_afc") == 0) {
+		sprintf(buf, "%d", get_afc());
+		send_xmlrpc_response(csocks[si], "boolean", buf);
+	}
+	else if (strcmp(cmd, "main.set_afc") == 0) {
+		sprintf(buf, "%d", get_afc());
+		set_afc(atoi(req_buffer));
+		send_xmlrpc_response(csocks[si], "boolean", buf);
+	}
+	else if (strcmp(cmd, "main.toggle_afc") == 0) {
+		set_afc(!get_afc());
+		sprintf(buf, "%d", get_afc());
+		send_xmlrpc_response(csocks[si], "boolean", buf);
+	}
 	else if (strcmp(cmd, "modem.run_macro") == 0) {
 		uret = strtoui(req_buffer, NULL, 10);
 		SETTING_RLOCK();
@@ -524,6 +676,12 @@ handle_request(int si)
 		                       "<value>main.rx</value></member>"
 		                   "<member><name>signature</name>"
 		                       "<value>n:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Aborts a transmission, discarding everything not yet sent, and releases PTT</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>main.abort</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>n:n</value></member></struct></value>"
 		    "<value><struct><member><name>help</name>"
 		                       "<value>Returns \"RX\" in RX mode, \"TX\" in TX mode</value></member>"
 		                   "<member><name>name</name>"
@@ -561,7 +719,49 @@ handle_request(int si)
 		                   "<member><name>signature</name>"
 		                       "<value>6:ii</value></member></struct></value>"
 		    "<value><struct><member><name>help</name>"
-		                       "<value>Returns the average of the mark and space frequencies</value></member>"
+		                       "<value>Returns the number of characters delivered early (before the stop bit) and late, the average and maximum milliseconds from the middle of their last data bit to delivery, and how many early ones were retracted</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>rx.get_latency</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>S:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Returns the size, current fill, high-water mark, and dropped blocks of the audio capture and UI feed rings, and the length of a block in milliseconds</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>rx.get_buffers</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>S:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Returns the number of sound card overruns while receiving and underruns while sending AFSK, with the UTC times of the first and last of each</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>main.get_xruns</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>S:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Returns the number of AFSK transmissions ended, the milliseconds of audio still in the sound card when the last one was written, the average and maximum milliseconds from the last sample playing to PTT being released, and the number of aborts with the last and maximum milliseconds from the abort to PTT being released</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>tx.get_turnaround</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>S:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Returns the median, 99th percentile, and maximum time per block in microseconds of each receive stage, empty unless built with STAGE_TIMING</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>stats.get_timing</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>S:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Clears the receive stage timing histograms</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>stats.reset_timing</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>n:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Returns the acquisitions, contended acquisitions, and wait times of each lock, and the thread holding it during the longest wait, empty unless built with LOCK_PROFILING</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>stats.get_locks</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>A:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Returns the average of the mark and space frequencies, including any AFC correction</value></member>"
 		                   "<member><name>name</name>"
 		                       "<value>modem.get_carrier</value></member>"
 		                   "<member><name>signature</name>"
@@ -632,6 +832,24 @@ handle_request(int si)
 		                       "<value>modem.toggle_reverse</value></member>"
 		                   "<member><name>signature</name>"
 		                       "<value>b:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Returns 1 if AFC is enabled, 0 otherwise</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>main.get_afc</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>b:n</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Sets the AFC state, returns old state</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>main.set_afc</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>b:b</value></member></struct></value>"
+		    "<value><struct><member><name>help</name>"
+		                       "<value>Toggles the AFC state, returns new state</value></member>"
+		                   "<member><name>name</name>"
+		                       "<value>main.toggle_afc</value></member>"
+		                   "<member><name>signature</name>"
+		                       "<value>b:n</value></member></struct></value>"
 		    "<value><struct><member><name>help</name>"
 		                       "<value>Runs the specified macro (0-9)</value></member>"
 		                   "<member><name>name</name>"
@@ -660,6 +878,7 @@ handle_request(int si)
 	}
 	else
 		send_xmlrpc_fault(csocks[si]);
+	TRACE_END("XML-RPC");
 
 	if (bytes != content_len || csocks[si] == -1)
 		return false;
@@ -24,9 +24,6 @@
  *
  */
 
-//#define NOISE_CORRECT
-//#define MATCHED_BUCKETS
-
 #include <sys/ioctl.h>
 #include <sys/soundcard.h>
 #include <sys/types.h>
@@ -41,18 +38,29 @@
 #ifdef __FreeBSD__
 #include <pthread_np.h>
 #endif
+#include <semaphore.h>
 #include <signal.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "afsk_send.h"
+#include "autodetect.h"
 #include "baudot.h"
 #include "bsdtty.h"
+#include "channelizer.h"
+#include "fldigi_xmlrpc.h"
 #include "fsk_demod.h"
+#include "rtsched.h"
+#include "timing.h"
+#include "trace.h"
 #include "ui.h"
+#include "xrun.h"
+
 
 struct fir_filter {
 	size_t		len;
@@ -65,495 +73,1160 @@ struct bq_filter {
 	double		buf[4];
 };
 
+struct afc_track {
+	double	last_value;
+	double	last_crossing;
+	bool	valid;
+};
+
+/*
+ * A single demodulator... it is fed samples and calls emit() with each
+ * baudot character it finds.
+ */
+struct fsk_demod {
+	double		mark_freq;
+	double		space_freq;
+	int		baud_numerator;
+	int		baud_denominator;
+	int		rate;
+	double		lp_filter_q;
+	int		data_bits;
+	int		parity;
+	double		stop_bits;
+	void		(*emit)(struct fsk_demod *d, int ch);
+	void		*arg;
+
+	// Mark filter
+	struct fir_filter *mfilt;
+	struct bq_filter *mlpfilt;
+	// Space filter
+	struct fir_filter *sfilt;
+	struct bq_filter *slpfilt;
+	// Mark phase filter
+	struct bq_filter *mapfilt;
+	// Space phase filter
+	struct bq_filter *sapfilt;
+	// Subtract the mark/space noise level before slicing
+	bool		noise_correct;
+	float		mnoise;
+	float		snoise;
+	float		mnsamp;
+	float		snsamp;
+	// Filter outputs for the last block (for the tuning aid)
+	double		mvbuf[RX_BLOCK];
+	double		svbuf[RX_BLOCK];
+
+	/*
+	 * AFC... the input is made analytic with a Hilbert FIR, then
+	 * shifted by an NCO so the fixed mark/space filters never need
+	 * to be rebuilt.
+	 */
+	struct fir_filter *hilbert;
+	atomic_bool	afc;
+	atomic_int	afc_hz;
+	double		afc_offset;
+	double		afc_limit;
+	double		nco_re;
+	double		nco_im;
+	double		nco_step_re;
+	double		nco_step_im;
+	unsigned	nco_renorm;
+	// Nominal centre frequencies of mfilt and sfilt
+	double		mfreq;
+	double		sfreq;
+	struct afc_track mtrack;
+	struct afc_track strack;
+	uint64_t	afc_sample;
+
+	/*
+	 * Hunt for Start... this holds a character worth of demodulated
+	 * values and looks for a whole character rather than parsing as
+	 * it goes.
+	 */
+	atomic_bool	hfs;
+	bool		figs;
+	double		*hfs_buf;
+	size_t		hfs_len;
+	size_t		hfs_head;
+	size_t		hfs_fill;
+	size_t		hfs_start;
+	size_t		hfs_bit[8];
+	size_t		hfs_parity;
+	size_t		hfs_stop;
+	// Samples the slicer takes as mark while the input is blanked
+	size_t		mark_hold;
+	// Idle detection after a character
+	bool		idle_watch;
+	size_t		idle;
+	size_t		idle_max;
+
+	/*
+	 * Early emission... the character is emitted with
+	 * FSK_DEMOD_EARLY as soon as the last data bit is decided, then
+	 * emitted again when the stop bit confirms it, or retracted.
+	 */
+	bool		early;
+	bool		early_pending;
+	uint64_t	early_edge;
+	// Sample number of the centre of the last data bit
+	uint64_t	last_bit;
+	// The early character the consumer displayed (rx_char() only)
+	char		early_ch;
+
+	/* Statistics */
+	uint64_t	samples;
+	uint64_t	last_frame;
+	size_t		sync_max;
+	uint64_t	frames;
+	uint64_t	sync_frames;
+	uint64_t	framing_errors;
+	// Only the main receivers record stage timing and trace events
+	bool		instrumented;
+};
+#define AFC_HILBERT_LEN	65
+#define AFC_GAIN	0.001
+#define AFC_DOMINANCE	4.0
+
+/*
+ * Conditioning stages between the sound card and the demodulators.
+ * Each one processes a whole block in place and returns the new number
+ * of samples, so no intermediate buffers are needed.  Only the enabled
+ * stages are in the chain, so a stage that's turned off costs nothing.
+ */
+struct rx_stage {
+	size_t		(*run)(void *state, double *buf, size_t n);
+	void		(*destroy)(void *state);
+	void		*state;
+	// Discards history at a TX/RX turnaround, NULL if there's none
+	void		(*flush)(void *state);
+};
+#define RX_MAX_STAGES	3
+
+struct blanker {
+	double		threshold;
+	double		avg;
+	double		alpha;
+	size_t		hold;
+	size_t		blank;
+};
+#define BLANKER_AVG_TIME	0.02
+#define BLANKER_HOLD_TIME	0.0005
+
+struct resampler {
+	size_t		factor;
+	size_t		phase;
+	size_t		len;
+	double		*coef;
+	// Twice len long so the taps are always contiguous
+	double		*hist;
+	size_t		pos;
+};
+#define RESAMPLER_TAPS	16
+
+struct agc {
+	double		peak;
+	double		attack;
+	double		decay;
+};
+#define AGC_TARGET	8192.0
+#define AGC_ATTACK_TIME	0.002
+#define AGC_DECAY_TIME	0.5
+
+/*
+ * A single producer, single consumer ring of fixed size blocks.  The
+ * producer never waits; if the ring is full, the block is dropped and
+ * counted.  The consumer sleeps on the semaphore.
+ */
+struct block_ring {
+	char		*blocks;
+	size_t		size;
+	size_t		count;
+	atomic_size_t	head;
+	atomic_size_t	tail;
+	atomic_size_t	high_water;
+	atomic_uint_fast64_t dropped;
+	sem_t		ready;
+};
+
+/*
+ * The capture thread reads the sound card into these, so a stall in the
+ * RX thread doesn't overrun the device.
+ */
+struct capture_block {
+	size_t		n;
+	struct timespec	time;
+	bool		xrun;		// Samples were lost before this block
+	double		buf[RX_BLOCK];
+	double		buf2[RX_BLOCK];
+};
+#define CAPTURE_SECONDS	4
+
+/*
+ * The RX thread passes these to the UI feed thread, which does the
+ * meter, waterfall, and tuning aid.  If the UI falls behind, it misses
+ * blocks rather than holding up decoding.
+ */
+struct ui_block {
+	size_t		raw_n;
+	size_t		n;
+	double		raw[RX_BLOCK];
+	double		buf[RX_BLOCK];
+	double		mv[RX_BLOCK];
+	double		sv[RX_BLOCK];
+};
+#define UI_RING		16
+
+/*
+ * The detector and slicer are fused into one loop per block, with a
+ * specialized copy for each combination of options.
+ */
+typedef void (*demod_block_fn)(struct fsk_demod *d, const double *buf, size_t n);
+typedef void (*diversity_block_fn)(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n);
+
 /* RX Stuff */
-static double phase_rate;
-static double phase = 0.0;
-// Mark filter
-static struct fir_filter *mfilt;
-static struct bq_filter *mlpfilt;
-// Space filter
-static struct fir_filter *sfilt;
-static struct bq_filter *slpfilt;
-// Mark phase filter
-static struct bq_filter *mapfilt;
-// Space phase filter
-static struct bq_filter *sapfilt;
-#ifdef NOISE_CORRECT
-// Mark/Space noise level
-static float mnoise;
-static float snoise;
-static float mnsamp;
-static float snsamp;
-#endif
+static struct fsk_demod rx;
+/*
+ * The second channel... a separate receiver in STEREO_DUAL, and only
+ * the filters are used in STEREO_DIVERSITY.
+ */
+static struct fsk_demod rx2;
+static enum bt_stereo stereo;
 // Audio meter filter
 static struct bq_filter *afilt;
-// Hunt for Start
-static atomic_bool hfs = ATOMIC_VAR_INIT(false);
-static double *hfs_buf;
-static size_t hfs_bufmax;
-static size_t hfs_head;
-static size_t hfs_tail;
-static size_t hfs_start;
-static size_t hfs_b0;
-static size_t hfs_b1;
-static size_t hfs_b2;
-static size_t hfs_b3;
-static size_t hfs_b4;
-static size_t hfs_stop1;
-static size_t hfs_stop2;
+// Conditioning stages for each channel
+static struct rx_stage chain[2][RX_MAX_STAGES];
+static size_t nstages;
 
 /* Audio variables */
 static int dsp = -1;
+// The capture thread also writes AFSK to dsp
+static bool duplex;
 static int dsp_channels = 1;
-#ifdef MATCHED_BUCKETS
-static struct fir_filter **waterfall_bp;
-#else
+static int dsp_rate;
+// Sample rate after the resampler
+static int rx_rate;
+// Samples left to blank after a transmission
+static size_t turnaround_blank;
+static struct block_ring capture_ring;
+static struct block_ring ui_ring;
+static pthread_t capture_tid;
+static pthread_t ui_tid;
+/*
+ * Protects helpers_running, so get_rx_rings() can't read the rings
+ * while stop_rx_helpers() is destroying them.
+ */
+static bool helpers_running;
+static pthread_mutex_t helpers_mutex = PTHREAD_MUTEX_INITIALIZER;
+STATIC_LOCK_PROF(helpers_prof, "rx helpers");
+#define HELPERS_LOCK()	assert(PROF_MUTEX_LOCK(&helpers_mutex, helpers_prof) == 0)
+#define HELPERS_UNLOCK()	assert(pthread_mutex_unlock(&helpers_mutex) == 0)
+// One of these is used, depending on the matched waterfall setting
+static struct fir_filter **waterfall_mf;
 static struct bq_filter **waterfall_bp;
-#endif
 static struct bq_filter **waterfall_lp;
 size_t waterfall_width;
 static pthread_mutex_t waterfall_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define WF_LOCK()	assert(pthread_mutex_lock(&waterfall_mutex) == 0)
+STATIC_LOCK_PROF(waterfall_prof, "waterfall");
+#define WF_LOCK()	assert(PROF_MUTEX_LOCK(&waterfall_mutex, waterfall_prof) == 0)
 #define WF_UNLOCK()	assert(pthread_mutex_unlock(&waterfall_mutex) == 0)
 
 #if 0 // suppress warning
 static int avail(int head, int tail, int max);
 #endif
 static double bq_filter(double value, struct bq_filter *filter);
-static struct bq_filter * calc_apf_coef(double f0, double q);
-static struct bq_filter * calc_bpf_coef(double f0, double q);
-static struct bq_filter * calc_lpf_coef(double f0, double q);
-static void create_filters(void);
-static double current_value(void);
+static struct bq_filter * calc_apf_coef(double f0, double q, int rate);
+static struct bq_filter * calc_bpf_coef(double f0, double q, int rate);
+static struct bq_filter * calc_lpf_coef(double f0, double q, int rate);
+static void afc_measure(struct fsk_demod *d, struct afc_track *t, double value, double nominal, bool dominant);
+static double afc_shift(struct fsk_demod *d, double sample);
+static size_t agc_block(void *state, double *buf, size_t n);
+static size_t blank_block(void *state, double *buf, size_t n);
+static void afc_set_offset(struct fsk_demod *d, double offset);
+static struct fir_filter * create_hilbert_filter(size_t len);
+static void create_filters(struct fsk_demod *d);
+static inline double current_value(struct fsk_demod *d, double emv, double esv, const bool noise_correct);
+static void demod_afc(struct fsk_demod *d, const double *buf, size_t n);
+static void demod_nc(struct fsk_demod *d, const double *buf, size_t n);
+static void demod_nc_afc(struct fsk_demod *d, const double *buf, size_t n);
+static void demod_plain(struct fsk_demod *d, const double *buf, size_t n);
+static void diversity_afc(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n);
+static void diversity_nc(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n);
+static void diversity_nc_afc(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n);
+static void diversity_plain(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n);
+static inline void envelopes(struct fsk_demod *d, double sample, double *emvp, double *esvp, double *mvp, double *svp, const bool afc);
+static void feed_meter(const double *buf, size_t n);
+static void feed_tuning_aid(const double *mv, const double *sv, size_t n);
 static void free_bq_filter(struct bq_filter *f);
+static void free_chain(void);
 static void free_fir_filter(struct fir_filter *f);
-static bool get_bit(void);
-static bool get_stop_bit(void);
+static void fsk_demod_block(struct fsk_demod *d, const double *buf, size_t n);
+static void fsk_demod_destroy(struct fsk_demod *d);
+static void fsk_demod_diversity_block(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n);
+static void fsk_demod_init(struct fsk_demod *d, double mark, double space, int baud_numerator, int baud_denominator, int rate, double lp_filter_q, int data_bits, int parity, double stop_bits, bool noise_correct);
+static void *capture_thread(void *arg);
+static void flush_demod(struct fsk_demod *d);
+static inline double held_value(struct fsk_demod *d, double cv);
+static void hunt_for_start(struct fsk_demod *d, double cv);
+static size_t hfs_index(struct fsk_demod *d, size_t pos);
 static size_t next(int val, int max);
 #if 0 // suppress warning
 static int prev(int val, int max);
 #endif
-static int16_t read_audio(void);
+static void close_audio(void);
+static struct rx_stage new_agc(int rate);
+static struct rx_stage new_blanker(double threshold, int rate);
+static struct rx_stage new_resampler(size_t factor);
+static size_t read_audio(double *buf, double *buf2, size_t frames);
+static size_t resample_block(void *state, double *buf, size_t n);
+static void flush_resampler(void *state);
+static void free_resampler(void *state);
+static size_t run_chain(struct rx_stage *stages, double *buf, size_t n);
+static size_t unblanked_chain(struct rx_stage *stages, double *buf, size_t n, size_t blank);
 static void setup_audio(void);
-static struct fir_filter * create_matched_filter(double frequency);
-static double fir_filter(int16_t value, struct fir_filter *f);
-static void feed_waterfall(int16_t value);
-static int read_rtty_ch(int state);
+static void write_duplex(size_t frames);
+static void setup_chain(void);
+static struct fir_filter * create_matched_filter(double frequency, int rate, double baud);
+static double fir_filter(double value, struct fir_filter *f);
+static void feed_waterfall(const double *buf, size_t n);
+static void early_char(struct fsk_demod *d);
+static void early_retract(struct fsk_demod *d);
+static void rx_char(struct fsk_demod *d, int ch);
+static void rx_deliver(struct fsk_demod *d, char ch);
+static void rx_latency(struct fsk_demod *d, bool early);
+static void swap_filters(struct fsk_demod *d);
 static void * rx_thread(void *arg);
+static void ring_destroy(struct block_ring *r);
+static size_t ring_drain(struct block_ring *r);
+static void ring_init(struct block_ring *r, size_t size, size_t count);
+static void *ring_read(struct block_ring *r);
+static void ring_read_done(struct block_ring *r);
+static void ring_stats(struct block_ring *r, struct rx_ring_stats *st);
+static void *ring_write(struct block_ring *r);
+static void ring_write_done(struct block_ring *r);
+static void rx_turnaround(void);
 static void rx_unlock(void *arg);
+static void stop_rx_helpers(void *arg);
+static void *ui_feed_thread(void *arg);
 
-static char chbuf[256];
+static char chbuf[4096];
 static size_t chh;
 static size_t cht;
 pthread_mutex_t chbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define CH_LOCK()	assert(pthread_mutex_lock(&chbuf_mutex) == 0)
+STATIC_LOCK_PROF(chbuf_prof, "chbuf");
+#define CH_LOCK()	assert(PROF_MUTEX_LOCK(&chbuf_mutex, chbuf_prof) == 0)
 #define CH_UNLOCK()	assert(pthread_mutex_unlock(&chbuf_mutex) == 0)
-static bool rxfigs;
 pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+LOCK_PROF(rx_lock_prof, "rx");
+
+/* Decode latency of the main receiver */
+static struct timespec block_time;
+static uint64_t block_end;
+static struct rx_latency latency_early;
+static struct rx_latency latency_late;
+static uint64_t latency_retracted;
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+STATIC_LOCK_PROF(latency_prof, "latency");
+#define LATENCY_LOCK()		assert(PROF_MUTEX_LOCK(&latency_mutex, latency_prof) == 0)
+#define LATENCY_UNLOCK()	assert(pthread_mutex_unlock(&latency_mutex) == 0)
 
 void
 setup_rx(pthread_t *tid)
 {
-	int hfs_buflen;
+	bool iq;
 
-	setup_audio();
+	SETTING_RLOCK();
+	iq = settings.iq_name[0] != 0;
+	SETTING_UNLOCK();
+	if (iq)
+		close_audio();
+	else
+		setup_audio();
 
+	fsk_demod_destroy(&rx);
 	SETTING_RLOCK();
-	phase_rate = 1/((double)settings.dsp_rate/((double)settings.baud_numerator / settings.baud_denominator));
-	hfs_buflen = ((double)settings.dsp_rate/((double)settings.baud_numerator / settings.baud_denominator)) * 7.1 + 1;
-	hfs_tail = 0;
-	hfs_head = 0;
-	hfs_start = ((1/phase_rate)*.5);
-	hfs_b0 = ((1/phase_rate)*1.5);
-	hfs_b1 = ((1/phase_rate)*2.5);
-	hfs_b2 = ((1/phase_rate)*3.5);
-	hfs_b3 = ((1/phase_rate)*4.5);
-	hfs_b4 = ((1/phase_rate)*5.5);
-	hfs_stop1 = ((1/phase_rate)*6.5);
-	hfs_stop2 = hfs_bufmax;
+	rx_rate = dsp_rate / settings.rx_decimation;
+	fsk_demod_init(&rx, settings.mark_freq, settings.space_freq,
+	    settings.baud_numerator, settings.baud_denominator,
+	    rx_rate, settings.lp_filter_q, settings.data_bits,
+	    settings.parity, settings.stop_bits, settings.noise_correct);
+	atomic_store(&rx.afc, settings.afc);
+	rx.early = settings.early_chars;
+	rx.instrumented = true;
+	fsk_demod_destroy(&rx2);
+	if (stereo != STEREO_MONO) {
+		fsk_demod_init(&rx2, settings.mark_freq, settings.space_freq,
+		    settings.baud_numerator, settings.baud_denominator,
+		    rx_rate, settings.lp_filter_q, settings.data_bits,
+		    settings.parity, settings.stop_bits, settings.noise_correct);
+		atomic_store(&rx2.afc, settings.afc);
+		rx2.early = settings.early_chars && stereo == STEREO_DUAL;
+		rx2.instrumented = true;
+	}
 	SETTING_UNLOCK();
-	if (hfs_buf)
-		free(hfs_buf);
-	hfs_buf = malloc(hfs_buflen*sizeof(double));
-	if (hfs_buf == NULL)
-		printf_errno("allocating dsp buffer");
-	hfs_bufmax = hfs_buflen - 1;
-	create_filters();
+	setup_chain();
+	rx.emit = rx_char;
+	rx2.emit = stereo == STEREO_DUAL ? rx_char : NULL;
+	set_rx_split(stereo == STEREO_DUAL);
+
+	/* For the audio level meter */
+	free_bq_filter(afilt);
+	afilt = calc_lpf_coef(10, 0.5, dsp_rate);
+
+	show_afc(atomic_load(&rx.afc), 0);
+	if (iq) {
+		/* The channelizer thread replaces the RX thread */
+		stop_autodetect();
+		setup_channelizer(tid);
+		return;
+	}
+	setup_autodetect();
 	pthread_create(tid, NULL, rx_thread, NULL);
 }
 
-static int
-read_rtty_ch(int state)
+/*
+ * Creates a demodulator for the specified configuration.  Character
+ * framing comes from the settings.
+ */
+struct fsk_demod *
+fsk_demod_new(double mark, double space, int baud_numerator, int baud_denominator, int rate, void (*emit)(struct fsk_demod *d, int ch), void *arg)
+{
+	struct fsk_demod *ret;
+
+	ret = calloc(1, sizeof(*ret));
+	if (ret == NULL)
+		printf_errno("allocating demodulator");
+	SETTING_RLOCK();
+	fsk_demod_init(ret, mark, space, baud_numerator, baud_denominator,
+	    rate, settings.lp_filter_q, settings.data_bits, settings.parity,
+	    settings.stop_bits, settings.noise_correct);
+	SETTING_UNLOCK();
+	ret->emit = emit;
+	ret->arg = arg;
+	return ret;
+}
+
+void
+fsk_demod_free(struct fsk_demod *d)
 {
-	bool b;
+	if (d == NULL)
+		return;
+	fsk_demod_destroy(d);
+	free(d);
+}
+
+static void
+fsk_demod_init(struct fsk_demod *d, double mark, double space, int baud_numerator, int baud_denominator, int rate, double lp_filter_q, int data_bits, int parity, double stop_bits, bool noise_correct)
+{
+	double spb;
+	double bits;
 	int i;
-	int ret = 0;
+
+	d->mark_freq = mark;
+	d->space_freq = space;
+	d->baud_numerator = baud_numerator;
+	d->baud_denominator = baud_denominator;
+	d->rate = rate;
+	d->lp_filter_q = lp_filter_q;
+	d->data_bits = data_bits;
+	d->parity = parity;
+	d->stop_bits = stop_bits;
+	d->noise_correct = noise_correct;
+	d->mnoise = d->snoise = 0;
+	d->mnsamp = d->snsamp = 0;
 
 	/*
-	 * Synchronize with the beginning of the start bit.
+	 * Sample offsets of the centres of each bit from the last mark
+	 * sample before the start bit.
 	 */
-	if (state >= 0) {
-		/*
-		 * We got a stop bit last time, assume we're
-		 * synchronized, and wait for up to 1.1 bit times for
-		 * space to start.
-		 * 
-		 * If it doesn't start, go to "hunt for start" mode.
-		 */
-		for (phase = 0;;) {
-			if (current_value() < 0.0 || hfs_head == hfs_tail)
-				break;
-			phase += phase_rate;
-			if (phase >= 1.6) {
-				state = -1;
-				rxfigs = false;
-				atomic_store(&hfs, true);
-				break;
-			}
-		}
-	}
-	if (hfs_head == hfs_tail)
-		state = -1;
-	if (state < 0) {
-		/*
-		 * Start of "Hunt for Start" mode... this one is fun
-		 * since it looks for a whole character rather than
-		 * parsing as it goes.  This works by having a charlen
-		 * buffer of cv, and any time we cross from mark to
-		 * space, we look back and see if we have a stop bit
-		 * at the end along with a start bit at the start.
-		 * If we do, we return THAT character, and assume
-		 * synchronization.
-		 */
-
-		/*
-		 * Now we're in HfS mode
-		 * First, check the existing buffer.
-		 */
-#ifdef NOISE_CORRECT
-		mnoise = snoise = 0.0;	// No noise if no signal...
-#endif
-		for (;;) {
-			// Fill up the ring buffer...
-			while (next(hfs_head, hfs_bufmax) != hfs_tail)
-				current_value();
-			if (hfs_buf[hfs_tail] >= 0.0 && hfs_buf[next(hfs_tail, hfs_bufmax)] < 0.0) {
-				/* If there's a valid character in there, return it. */
-				if (hfs_buf[hfs_start] < 0.0 &&
-				    hfs_buf[hfs_stop1] >= 0.0 &&
-				    hfs_buf[hfs_stop2] >= 0.0) {
-					phase = phase_rate;
-					/*
-					 * With NOISE_CORRECT, it would be nice to have initial
-					 * noise levels here for the second character.
-					 */
-					hfs_tail = hfs_head;
-					atomic_store(&hfs, false);
-					return (hfs_buf[hfs_b0] > 0.0) |
-						((hfs_buf[hfs_b1] > 0.0) << 1) |
-						((hfs_buf[hfs_b2] > 0.0) << 2) |
-						((hfs_buf[hfs_b3] > 0.0) << 3) |
-						((hfs_buf[hfs_b4] > 0.0) << 4);
-				}
-			}
-			current_value();
-		}
-	}
+	spb = (double)rate / ((double)baud_numerator / baud_denominator);
+	bits = 1 + data_bits + (parity != PARITY_NONE);
+	d->hfs_start = spb * 0.5 + 1;
+	for (i = 0; i < data_bits; i++)
+		d->hfs_bit[i] = spb * (1.5 + i) + 1;
+	d->hfs_parity = spb * (0.5 + data_bits + 1) + 1;
+	d->hfs_stop = spb * (bits + 0.5) + 1;
 
 	/*
-	 * Now we get the start bit... this is how we synchronize,
-	 * so reset the phase here.
+	 * The buffer holds up to just past the middle of the stop bit.
+	 * Since it's refilled after each character, it also needs to be
+	 * shorter than a character so the next start bit isn't missed.
 	 */
-	phase = phase_rate;
-	b = get_bit();
-	if (hfs_head == hfs_tail)
-		return -1;
-	if (b)
-		return -1;
-
-	/* Now read the five data bits */
-	for (i = 0; i < 5; i++) {
-		b = get_bit();
-		if (hfs_head == hfs_tail)
-			return -1;
-		ret |= b << i;
-	}
-
-	/* 
-	 * Now, get a stop bit, which we expect to be at least
-	 * 1.42 bits long.
-	 */
-	if (!get_stop_bit())
-		return -1;
-	if (hfs_head == hfs_tail)
-		return -1;
-	hfs_tail = hfs_head;
-
-	return ret;
+	if (stop_bits > 1.1)
+		d->hfs_len = spb * (bits + 1.1) + 2;
+	else
+		d->hfs_len = spb * (bits + stop_bits - 0.1) + 2;
+	d->hfs_buf = malloc(d->hfs_len * sizeof(*d->hfs_buf));
+	if (d->hfs_buf == NULL)
+		printf_errno("allocating dsp buffer");
+	d->hfs_head = 0;
+	d->hfs_fill = 0;
+	d->idle_max = spb * 1.6;
+	d->sync_max = d->hfs_len + d->idle_max;
+	d->idle_watch = false;
+	d->figs = false;
+	d->early_pending = false;
+	d->early_ch = 0;
+	atomic_store(&d->hfs, false);
+	create_filters(d);
 }
 
 static void
-setup_audio(void)
+fsk_demod_destroy(struct fsk_demod *d)
 {
-	int i;
-
-	if (dsp != -1)
-		close(dsp);
-	SETTING_WLOCK();
-	dsp = open(settings.dsp_name, O_RDONLY);
-	if (dsp == -1)
-		printf_errno("unable to open sound device %s", settings.dsp_name);
-	i = AFMT_S16_NE;
-	if (ioctl(dsp, SNDCTL_DSP_SETFMT, &i) == -1)
-		printf_errno("setting format");
-	if (i != AFMT_S16_NE)
-		printf_errno("16-bit native endian audio not supported");
-	if (ioctl(dsp, SNDCTL_DSP_CHANNELS, &dsp_channels) == -1)
-		printf_errno("setting mono");
-	if (ioctl(dsp, SNDCTL_DSP_SPEED, &settings.dsp_rate) == -1)
-		printf_errno("setting sample rate");
-	SETTING_UNLOCK();
+	free_fir_filter(d->mfilt);
+	free_fir_filter(d->sfilt);
+	free_bq_filter(d->mlpfilt);
+	free_bq_filter(d->slpfilt);
+	free_bq_filter(d->mapfilt);
+	free_bq_filter(d->sapfilt);
+	free_fir_filter(d->hilbert);
+	if (d->hfs_buf)
+		free(d->hfs_buf);
+	d->mfilt = d->sfilt = d->hilbert = NULL;
+	d->mlpfilt = d->slpfilt = d->mapfilt = d->sapfilt = NULL;
+	d->hfs_buf = NULL;
 }
 
 /*
- * This gets a single bit value.
+ * Reconfigures a demodulator in place.  This keeps the AFC setting.
  */
-static bool
-get_bit(void)
+void
+fsk_demod_retune(struct fsk_demod *d, double mark, double space, int baud_numerator, int baud_denominator)
 {
-	int nsamp;
-	double cv;
-	double tot;
-
-	for (nsamp = 0; phase < 1.03; phase += phase_rate) {
-		/* We only sample in the middle of the phase */
-		cv = current_value();
-		if (next(hfs_head, hfs_bufmax) != hfs_tail)
-			return false;
-		if (phase > 0.5 && nsamp == 0) {
-			tot = cv;
-#ifdef NOISE_CORRECT
-			mnoise = mnsamp;
-			snoise = snsamp;
-#endif
-			nsamp++;
-		}
-		/* Sampling is over, look for jitter */
-		if (phase > 0.97 && nsamp == 1) {
-			if ((cv < 0.0) != (tot <= 0)) {
-				// Value change... assume this is the end of the bit.
-				// Set start phase for next bit.
-				phase = 1 - phase;
-				return tot > 0;
-			}
-		}
-	}
-	/* We over-read this bit... adjust next bit phase */
-	assert(nsamp);
-	phase = -(1.0 - phase);
-	return tot > 0;
+	bool afc;
+
+	afc = atomic_load(&d->afc);
+	early_retract(d);
+	fsk_demod_destroy(d);
+	fsk_demod_init(d, mark, space, baud_numerator, baud_denominator,
+	    d->rate, d->lp_filter_q, d->data_bits, d->parity, d->stop_bits,
+	    d->noise_correct);
+	atomic_store(&d->afc, afc);
 }
 
 /*
- * This gets a stop bit.
+ * Throws away any partial character.
  */
-static bool
-get_stop_bit(void)
+void
+fsk_demod_reset(struct fsk_demod *d)
 {
-	int nsamp;
-	double cv;
-	bool ret = 0;
-
-	for (nsamp = 0; phase < 1.42; phase += phase_rate) {
-		cv = current_value();
-		if (hfs_head == hfs_tail)
-			return false;
-		if (phase > 0.5 && nsamp == 0) {
-			ret = cv >= 0.0;
-			nsamp++;
-		}
-#ifdef NOISE_CORRECT
-		else if (phase > 0.75 && nsamp == 1) {
-			mnoise = mnsamp;
-			nsamp++;
-		}
-		else if (phase > 1 && nsamp == 2) {
-#else
-		else if (phase > 1 && nsamp == 1) {
-#endif
-			if (cv < 0.0)
-				ret = false;
-			nsamp++;
-		}
-		if (phase > 1.39 && ret && cv < 0.0)
-			return ret;
+	early_retract(d);
+	d->hfs_fill = 0;
+	d->last_frame = 0;
+}
+
+void
+fsk_demod_feed(struct fsk_demod *d, const double *samples, size_t count)
+{
+	size_t n;
+
+	for (; count; count -= n, samples += n) {
+		n = count > RX_BLOCK ? RX_BLOCK : count;
+		fsk_demod_block(d, samples, n);
 	}
-	return ret;
 }
 
-static int16_t
-read_audio(void)
+uint64_t
+fsk_demod_frames(struct fsk_demod *d)
 {
-	int ret;
-	int16_t tmpbuf[16];	// Max 16 channels.  Heh.
+	return d->frames;
+}
 
-	/* Read into circular buffer */
+uint64_t
+fsk_demod_sync_frames(struct fsk_demod *d)
+{
+	return d->sync_frames;
+}
 
-	for (;;) {
-		ret = read(dsp, tmpbuf, sizeof(*tmpbuf) * dsp_channels);
-		if (ret == -1) {
-			if (errno != EINTR)
-				printf_errno("reading audio input");
-		}
-		else
-			break;
-	}
+uint64_t
+fsk_demod_framing_errors(struct fsk_demod *d)
+{
+	return d->framing_errors;
+}
+
+void *
+fsk_demod_arg(struct fsk_demod *d)
+{
+	return d->arg;
+}
 
-	return tmpbuf[0];
+void
+fsk_demod_set_afc(struct fsk_demod *d, bool enable)
+{
+	atomic_store(&d->afc, enable);
 }
 
 /*
- * The current demodulated value.  Essentially the difference between
- * the mark and space envelopes.
+ * The current AFC correction in Hz.  Only valid in the thread feeding
+ * the demodulator.
  */
-static double
-current_value(void)
+double
+fsk_demod_afc_offset(struct fsk_demod *d)
 {
-	int16_t sample;
-	double mv, emv, sv, esv, cv, a;
-	float mns, sns;
+	return d->afc_offset;
+}
 
-	if (pthread_mutex_trylock(&rx_lock) != 0) {
-		RX_LOCK();
-		hfs_tail = hfs_head;
-	}
-	sample = read_audio();
-
-	mv = fir_filter(sample, mfilt);
-	sv = fir_filter(sample, sfilt);
-	emv = bq_filter(mv*mv, mlpfilt);
-	esv = bq_filter(sv*sv, slpfilt);
-#ifdef NOISE_CORRECT
-	mns = emv;
-	sns = esv;
-	emv -= mnoise;
-	esv -= snoise;
-#endif
-	feed_waterfall(sample);
-	update_tuning_aid(mv, sv);
-	a = bq_filter((double)sample * sample, afilt);
-	audio_meter((int16_t)sqrt(a));
-	RX_UNLOCK();
+/*
+ * Index into hfs_buf of the value pos samples after the oldest one.
+ */
+static size_t
+hfs_index(struct fsk_demod *d, size_t pos)
+{
+	return (d->hfs_head + pos) % d->hfs_len;
+}
 
-	/*
-	 * TODO: A variable decision threshold may help out... essentially,
-	 * instead of taking zero as the crossing point, take the
-	 * envelope of both the mark and space signals as the extents,
-	 * and set the zero point at the average.  The only question is
-	 * how fast to have the envelopes respond to change since we're
-	 * only guaranteed a mark and a space for each character... and
-	 * extended mark for idle is entirely possible.
-	 */
-#ifdef NOISE_CORRECT
-	if (emv > esv)
-		mnsamp = mns;
-	else
-		snsamp = sns;
-#endif
-	cv = emv - esv;
+static const demod_block_fn demod_blocks[2][2] = {
+	{demod_plain, demod_afc},
+	{demod_nc, demod_nc_afc}
+};
 
-	/* Return the current value */
-	hfs_buf[hfs_head] = cv;
-	hfs_head = next(hfs_head, hfs_bufmax);
-	if (hfs_head == hfs_tail)
-		hfs_tail = next(hfs_tail, hfs_bufmax);
-	hfs_start = next(hfs_start, hfs_bufmax);
-	hfs_b0 = next(hfs_b0, hfs_bufmax);
-	hfs_b1 = next(hfs_b1, hfs_bufmax);
-	hfs_b2 = next(hfs_b2, hfs_bufmax);
-	hfs_b3 = next(hfs_b3, hfs_bufmax);
-	hfs_b4 = next(hfs_b4, hfs_bufmax);
-	hfs_stop1 = next(hfs_stop1, hfs_bufmax);
-	hfs_stop2 = next(hfs_stop2, hfs_bufmax);
-	return cv;
+static const diversity_block_fn diversity_blocks[2][2] = {
+	{diversity_plain, diversity_afc},
+	{diversity_nc, diversity_nc_afc}
+};
+
+/*
+ * Runs a block through the detector, slicer, and hunt for start.  The
+ * options are constant for each copy, so the compiler drops the tests
+ * from the loop.  The envelopes for the whole block are done first,
+ * so each stage is timed once per block rather than per sample.
+ */
+static inline void
+demod_block(struct fsk_demod *d, const double *buf, size_t n, const bool afc, const bool noise_correct)
+{
+	size_t i;
+	double emv[RX_BLOCK], esv[RX_BLOCK];
+	STAGE_START(t);
+	STAGE_ACCUM(env);
+	STAGE_ACCUM(slice);
+
+	for (i = 0; i < n; i++)
+		envelopes(d, buf[i], &emv[i], &esv[i], &d->mvbuf[i], &d->svbuf[i], afc);
+	STAGE_LAP(t, env);
+	for (i = 0; i < n; i++)
+		hunt_for_start(d, held_value(d, current_value(d, emv[i], esv[i], noise_correct)));
+	STAGE_LAP(t, slice);
+	STAGE_RECORD_IF(d->instrumented, STAGE_ENVELOPE, env);
+	STAGE_RECORD_IF(d->instrumented, STAGE_SLICER, slice);
 }
 
-// https://shepazu.github.io/Audio-EQ-Cookbook/audio-eq-cookbook.html
 static void
-create_filters(void)
+demod_plain(struct fsk_demod *d, const double *buf, size_t n)
 {
-	free_fir_filter(mfilt);
-	free_fir_filter(sfilt);
-	SETTING_RLOCK();
-	mfilt = create_matched_filter(settings.mark_freq);
-	sfilt = create_matched_filter(settings.space_freq);
-
-	/*
-	 * TODO: Do we need to get the envelopes separately, or just
-	 * take the envelope of the differences?
-	 */
-	free_bq_filter(mlpfilt);
-	free_bq_filter(slpfilt);
-	mlpfilt = calc_lpf_coef(((double)settings.baud_numerator / settings.baud_denominator)*1.1, settings.lp_filter_q);
-	slpfilt = calc_lpf_coef(((double)settings.baud_numerator / settings.baud_denominator)*1.1, settings.lp_filter_q);
-
-	/*
-	 * These are here to fix the phasing for the crossed bananas
-	 * display.  The centre frequencies aren't calculated, they were
-	 * selected via trial and error, so likely don't work for other
-	 * mark/space frequencies.
-	 * 
-	 * TODO: Figure out how to calculate phase in biquad IIR filters.
-	 */
-	free_bq_filter(mapfilt);
-	free_bq_filter(sapfilt);
-	mapfilt = calc_apf_coef(settings.mark_freq / 1.75, 1);
-	sapfilt = calc_apf_coef(settings.space_freq * 1.75, 1);
-	SETTING_UNLOCK();
-
-	/* For the audio level meter */
-	free_bq_filter(afilt);
-	afilt = calc_lpf_coef(10, 0.5);
+	demod_block(d, buf, n, false, false);
 }
 
-static struct bq_filter *
-calc_lpf_coef(double f0, double q)
+static void
+demod_afc(struct fsk_demod *d, const double *buf, size_t n)
 {
-	struct bq_filter *ret;
-	double w0, cw0, sw0, a[5], b[5], alpha;
+	demod_block(d, buf, n, true, false);
+}
 
-	ret = malloc(sizeof(*ret));
-	if (ret == NULL)
-		printf_errno("allocating bpf");
+static void
+demod_nc(struct fsk_demod *d, const double *buf, size_t n)
+{
+	demod_block(d, buf, n, false, true);
+}
 
-	SETTING_RLOCK();
-	w0 = 2.0 * M_PI * (f0 / settings.dsp_rate);
-	SETTING_UNLOCK();
-	cw0 = cos(w0);
-	sw0 = sin(w0);
+static void
+demod_nc_afc(struct fsk_demod *d, const double *buf, size_t n)
+{
+	demod_block(d, buf, n, true, true);
+}
 
-	alpha = sw0 / (2.0 * q);
-	b[0] = (1.0-cw0)/2.0;
-	b[1] = 1.0 - cw0;
-	b[2] = (1.0-cw0)/2.0;
-	a[0] = 1.0 + alpha;
-	a[1] = -2.0 * cw0;
-	a[2] = 1.0 - alpha;
-	ret->coef[0] = b[0]/a[0];
-	ret->coef[1] = b[1]/a[0];
-	ret->coef[2] = b[2]/a[0];
-	ret->coef[3] = a[1]/a[0];
-	ret->coef[4] = a[2]/a[0];
-	ret->buf[0] = 0;
-	ret->buf[1] = 0;
-	ret->buf[2] = 0;
-	ret->buf[3] = 0;
+/*
+ * n must not be more than RX_BLOCK.
+ */
+static void
+fsk_demod_block(struct fsk_demod *d, const double *buf, size_t n)
+{
+	demod_blocks[d->noise_correct][atomic_load(&d->afc)](d, buf, n);
+}
 
-	return ret;
+/*
+ * Diversity reception... the mark and space energies from two
+ * receivers are added together before deciding which is stronger.
+ * Only the filters of branch are used.
+ */
+static inline void
+diversity_block(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n, const bool afc, const bool noise_correct)
+{
+	size_t i;
+	double emv[RX_BLOCK], esv[RX_BLOCK];
+	double bemv, besv;
+	STAGE_START(t);
+	STAGE_ACCUM(env);
+	STAGE_ACCUM(slice);
+
+	for (i = 0; i < n; i++) {
+		envelopes(d, buf[i], &emv[i], &esv[i], &d->mvbuf[i], &d->svbuf[i], afc);
+		envelopes(branch, branch_buf[i], &bemv, &besv, &branch->mvbuf[i], &branch->svbuf[i], afc);
+		emv[i] += bemv;
+		esv[i] += besv;
+	}
+	STAGE_LAP(t, env);
+	for (i = 0; i < n; i++)
+		hunt_for_start(d, held_value(d, current_value(d, emv[i], esv[i], noise_correct)));
+	STAGE_LAP(t, slice);
+	STAGE_RECORD_IF(d->instrumented, STAGE_ENVELOPE, env);
+	STAGE_RECORD_IF(d->instrumented, STAGE_SLICER, slice);
 }
 
-static struct bq_filter *
-calc_bpf_coef(double f0, double q)
+static void
+diversity_plain(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n)
+{
+	diversity_block(d, branch, buf, branch_buf, n, false, false);
+}
+
+static void
+diversity_afc(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n)
+{
+	diversity_block(d, branch, buf, branch_buf, n, true, false);
+}
+
+static void
+diversity_nc(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n)
+{
+	diversity_block(d, branch, buf, branch_buf, n, false, true);
+}
+
+static void
+diversity_nc_afc(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n)
+{
+	diversity_block(d, branch, buf, branch_buf, n, true, true);
+}
+
+static void
+fsk_demod_diversity_block(struct fsk_demod *d, struct fsk_demod *branch, const double *buf, const double *branch_buf, size_t n)
+{
+	diversity_blocks[d->noise_correct][atomic_load(&d->afc)](d, branch, buf, branch_buf, n);
+}
+
+/*
+ * While the input is blanked after a transmission, the silence has to
+ * read as mark.  With noise correction, zero input comes out as the
+ * difference of the noise levels, which could be space.
+ */
+static inline double
+held_value(struct fsk_demod *d, double cv)
+{
+	if (d->mark_hold == 0)
+		return cv;
+	d->mark_hold--;
+	return 1.0;
+}
+
+/*
+ * This works by having a charlen buffer of cv, and any time we cross
+ * from mark to space, we look back and see if we have a stop bit at
+ * the end along with a start bit at the start.  If we do, we emit THAT
+ * character, and assume synchronization.
+ */
+static void
+hunt_for_start(struct fsk_demod *d, double cv)
+{
+	double *b = d->hfs_buf;
+	uint64_t edge;
+	int ch;
+	int i;
+
+	d->samples++;
+
+	/*
+	 * We got a stop bit, assume we're synchronized, and wait for up
+	 * to 1.6 bit times for space to start.
+	 *
+	 * If it doesn't start, go to "hunt for start" mode.
+	 */
+	if (d->idle_watch) {
+		if (cv < 0.0)
+			d->idle_watch = false;
+		else if (++d->idle >= d->idle_max) {
+			d->idle_watch = false;
+			d->figs = false;
+			d->mnoise = d->snoise = 0.0;	// No noise if no signal...
+			if (d->instrumented && !atomic_load(&d->hfs))
+				TRACE_BEGIN("HfS", d == &rx2 ? "right" : NULL);
+			atomic_store(&d->hfs, true);
+		}
+	}
+
+	b[d->hfs_head] = cv;
+	d->hfs_head = next(d->hfs_head, d->hfs_len - 1);
+	if (d->hfs_fill < d->hfs_len)
+		d->hfs_fill++;
+	if (d->early && !d->early_pending)
+		early_char(d);
+	if (d->hfs_fill < d->hfs_len)
+		return;
+
+	/*
+	 * An early character whose start has passed without being
+	 * emitted here didn't have a stop bit.
+	 */
+	edge = d->samples - d->hfs_len + 1;
+	if (d->early_pending && d->early_edge < edge)
+		early_retract(d);
+
+	if (b[hfs_index(d, 0)] >= 0.0 && b[hfs_index(d, 1)] < 0.0) {
+		/* If there's a valid character in there, emit it. */
+		if (b[hfs_index(d, d->hfs_start)] < 0.0 &&
+		    b[hfs_index(d, d->hfs_stop)] >= 0.0) {
+			ch = 0;
+			for (i = 0; i < d->data_bits; i++)
+				ch |= (b[hfs_index(d, d->hfs_bit[i])] > 0.0) << i;
+			if (d->parity != PARITY_NONE &&
+			    (b[hfs_index(d, d->hfs_parity)] > 0.0) != parity_bit(ch, d->data_bits, d->parity)) {
+				d->framing_errors++;
+				return;
+			}
+			/*
+			 * A later early character was part of this one,
+			 * and is about to be skipped.
+			 */
+			if (d->early_pending && d->early_edge != edge)
+				early_retract(d);
+			d->early_pending = false;
+			d->last_bit = edge + d->hfs_bit[d->data_bits - 1];
+			d->mnoise = d->mnsamp;
+			d->snoise = d->snsamp;
+			d->hfs_fill = 0;
+			d->idle = 0;
+			d->idle_watch = true;
+			d->frames++;
+			/*
+			 * A character that starts right after the last
+			 * one is good evidence we have the right speed.
+			 */
+			if (d->last_frame && d->samples - d->last_frame <= d->sync_max)
+				d->sync_frames++;
+			d->last_frame = d->samples;
+			if (d->instrumented && atomic_load(&d->hfs))
+				TRACE_END("HfS");
+			atomic_store(&d->hfs, false);
+			if (d->emit)
+				d->emit(d, ch);
+		}
+		else
+			d->framing_errors++;
+	}
+}
+
+/*
+ * Looks for a character whose last data bit is the newest value.  This
+ * uses the same tests as hunt_for_start(), but the parity and stop bits
+ * haven't arrived yet, so the character is only emitted early.
+ */
+static void
+early_char(struct fsk_demod *d)
+{
+	double *b = d->hfs_buf;
+	size_t last = d->hfs_bit[d->data_bits - 1];
+	size_t pos = d->hfs_len - 1 - last;
+	int ch;
+	int i;
+
+	// The start has to be after the end of the last character
+	if (pos < d->hfs_len - d->hfs_fill)
+		return;
+	if (b[hfs_index(d, pos)] < 0.0 || b[hfs_index(d, pos + 1)] >= 0.0 ||
+	    b[hfs_index(d, pos + d->hfs_start)] >= 0.0)
+		return;
+	ch = 0;
+	for (i = 0; i < d->data_bits; i++)
+		ch |= (b[hfs_index(d, pos + d->hfs_bit[i])] > 0.0) << i;
+	d->early_pending = true;
+	d->early_edge = d->samples - last;
+	d->last_bit = d->samples;
+	if (d->emit)
+		d->emit(d, ch | FSK_DEMOD_EARLY);
+}
+
+static void
+early_retract(struct fsk_demod *d)
+{
+	if (!d->early_pending)
+		return;
+	d->early_pending = false;
+	if (d->emit)
+		d->emit(d, FSK_DEMOD_RETRACT);
+}
+
+/*
+ * Zeros the filter histories and drops any partial character.
+ */
+static void
+flush_demod(struct fsk_demod *d)
+{
+	struct fir_filter *firs[] = {d->mfilt, d->sfilt, d->hilbert};
+	struct bq_filter *bqs[] = {d->mlpfilt, d->slpfilt, d->mapfilt, d->sapfilt};
+	size_t i;
+
+	for (i = 0; i < sizeof(firs) / sizeof(firs[0]); i++) {
+		if (firs[i])
+			memset(firs[i]->buf, 0, sizeof(firs[i]->buf[0]) * firs[i]->len);
+	}
+	for (i = 0; i < sizeof(bqs) / sizeof(bqs[0]); i++) {
+		if (bqs[i])
+			memset(bqs[i]->buf, 0, sizeof(bqs[i]->buf));
+	}
+	d->mtrack.valid = false;
+	d->strack.valid = false;
+	d->idle_watch = false;
+}
+
+/*
+ * Used when the input isn't the sound card.
+ */
+static void
+close_audio(void)
+{
+	if (dsp != -1)
+		close(dsp);
+	dsp = -1;
+	duplex = false;
+	SETTING_RLOCK();
+	stereo = STEREO_MONO;
+	dsp_channels = 1;
+	dsp_rate = settings.dsp_rate;
+	SETTING_UNLOCK();
+}
+
+static void
+setup_audio(void)
+{
+	int i;
+	bool duplex_failed = false;
+
+	if (dsp != -1)
+		close(dsp);
+	SETTING_WLOCK();
+	/*
+	 * Full duplex shares one handle, and so one channel count, so
+	 * it's only done in mono.  If the device can't do it, fall back
+	 * to opening it twice.
+	 */
+	duplex = settings.full_duplex && settings.afsk &&
+	    settings.stereo == STEREO_MONO && settings.afsk_file[0] == 0;
+	if (duplex) {
+		dsp = open(settings.dsp_name, O_RDWR);
+#ifdef SNDCTL_DSP_SETDUPLEX
+		if (dsp != -1 && ioctl(dsp, SNDCTL_DSP_SETDUPLEX, NULL) == -1) {
+			close(dsp);
+			dsp = -1;
+		}
+#endif
+		if (dsp == -1) {
+			duplex_failed = true;
+			duplex = false;
+		}
+	}
+	if (!duplex)
+		dsp = open(settings.dsp_name, O_RDONLY);
+	if (dsp == -1)
+		printf_errno("unable to open sound device %s", settings.dsp_name);
+	i = AFMT_S16_NE;
+	if (ioctl(dsp, SNDCTL_DSP_SETFMT, &i) == -1)
+		printf_errno("setting format");
+	if (i != AFMT_S16_NE)
+		printf_errno("16-bit native endian audio not supported");
+	stereo = settings.stereo;
+	dsp_channels = stereo == STEREO_MONO ? 1 : 2;
+	if (ioctl(dsp, SNDCTL_DSP_CHANNELS, &dsp_channels) == -1)
+		printf_errno("setting %s", stereo == STEREO_MONO ? "mono" : "stereo");
+	if (stereo != STEREO_MONO && dsp_channels < 2)
+		printf_errno("%s does not support stereo", settings.dsp_name);
+	if (ioctl(dsp, SNDCTL_DSP_SPEED, &settings.dsp_rate) == -1)
+		printf_errno("setting sample rate");
+	dsp_rate = settings.dsp_rate;
+	publish_settings();
+	SETTING_UNLOCK();
+	if (duplex_failed)
+		write_rx_str("\r\n[Full duplex: not supported by the sound device]\r\n");
+}
+
+/*
+ * Returns the sound card handle if AFSK is being sent through the
+ * capture thread, or -1 if it has its own.
+ */
+int
+get_duplex_dsp(void)
+{
+	return duplex ? dsp : -1;
+}
+
+/*
+ * Plays frames samples of AFSK (or silence) in full duplex mode.
+ */
+static void
+write_duplex(size_t frames)
+{
+	int16_t txbuf[RX_BLOCK];
+	size_t sent = 0;
+	int ret;
+
+	afsk_duplex_read(txbuf, frames);
+	while (sent < frames) {
+		ret = write(dsp, txbuf + sent, (frames - sent) * sizeof(txbuf[0]));
+		if (ret == -1) {
+			if (errno != EINTR)
+				printf_errno("writing audio output");
+		}
+		else
+			sent += ret / sizeof(txbuf[0]);
+	}
+}
+
+/*
+ * Reads up to frames samples of the first channel into buf, and if
+ * buf2 isn't NULL, the second channel into it.  Both are split out in
+ * the same pass.
+ */
+static size_t
+read_audio(double *buf, double *buf2, size_t frames)
+{
+	int ret;
+	size_t i;
+	int16_t tmpbuf[RX_BLOCK * 16];	// Max 16 channels.  Heh.
+
+	if (frames > RX_BLOCK)
+		frames = RX_BLOCK;
+	for (;;) {
+		ret = read(dsp, tmpbuf, sizeof(*tmpbuf) * dsp_channels * frames);
+		if (ret == -1) {
+			if (errno != EINTR)
+				printf_errno("reading audio input");
+		}
+		else
+			break;
+	}
+
+	frames = ret / (sizeof(*tmpbuf) * dsp_channels);
+	if (buf2) {
+		for (i = 0; i < frames; i++) {
+			buf[i] = tmpbuf[i * dsp_channels];
+			buf2[i] = tmpbuf[i * dsp_channels + 1];
+		}
+	}
+	else {
+		for (i = 0; i < frames; i++)
+			buf[i] = tmpbuf[i * dsp_channels];
+	}
+	return frames;
+}
+
+/*
+ * Runs a sample through the mark and space filters and returns the
+ * envelope energy of each, along with the filter outputs.
+ */
+static inline void
+envelopes(struct fsk_demod *d, double sample, double *emvp, double *esvp, double *mvp, double *svp, const bool afc)
+{
+	double mv, emv, sv, esv;
+
+	if (afc)
+		sample = afc_shift(d, sample);
+	mv = fir_filter(sample, d->mfilt);
+	sv = fir_filter(sample, d->sfilt);
+	emv = bq_filter(mv*mv, d->mlpfilt);
+	esv = bq_filter(sv*sv, d->slpfilt);
+	if (afc) {
+		d->afc_sample++;
+		afc_measure(d, &d->mtrack, mv, d->mfreq, emv > esv * AFC_DOMINANCE);
+		afc_measure(d, &d->strack, sv, d->sfreq, esv > emv * AFC_DOMINANCE);
+	}
+	*mvp = mv;
+	*svp = sv;
+	*emvp = emv;
+	*esvp = esv;
+}
+
+/*
+ * The current demodulated value.  Essentially the difference between
+ * the mark and space envelopes.
+ */
+static inline double
+current_value(struct fsk_demod *d, double emv, double esv, const bool noise_correct)
+{
+	double cv;
+	float mns, sns;
+
+	if (noise_correct) {
+		mns = emv;
+		sns = esv;
+		emv -= d->mnoise;
+		esv -= d->snoise;
+	}
+
+	/*
+	 * TODO: A variable decision threshold may help out... essentially,
+	 * instead of taking zero as the crossing point, take the
+	 * envelope of both the mark and space signals as the extents,
+	 * and set the zero point at the average.  The only question is
+	 * how fast to have the envelopes respond to change since we're
+	 * only guaranteed a mark and a space for each character... and
+	 * extended mark for idle is entirely possible.
+	 */
+	if (noise_correct) {
+		if (emv > esv)
+			d->mnsamp = mns;
+		else
+			d->snsamp = sns;
+	}
+	cv = emv - esv;
+
+	return cv;
+}
+
+// https://shepazu.github.io/Audio-EQ-Cookbook/audio-eq-cookbook.html
+static void
+create_filters(struct fsk_demod *d)
+{
+	double baud = (double)d->baud_numerator / d->baud_denominator;
+
+	d->mfilt = create_matched_filter(d->mark_freq, d->rate, baud);
+	d->sfilt = create_matched_filter(d->space_freq, d->rate, baud);
+	d->mfreq = d->mark_freq;
+	d->sfreq = d->space_freq;
+
+	/*
+	 * Don't let AFC wander further than half the shift, at that
+	 * point we'd be tracking the wrong tone.
+	 */
+	d->afc_limit = fabs(d->space_freq - d->mark_freq) / 2;
+	d->hilbert = create_hilbert_filter(AFC_HILBERT_LEN);
+	memset(&d->mtrack, 0, sizeof(d->mtrack));
+	memset(&d->strack, 0, sizeof(d->strack));
+	d->afc_sample = 0;
+	d->nco_re = 1.0;
+	d->nco_im = 0.0;
+	d->nco_renorm = 0;
+	d->afc_offset = 0;
+	d->nco_step_re = 1.0;
+	d->nco_step_im = 0.0;
+	atomic_store(&d->afc_hz, 0);
+
+	/*
+	 * TODO: Do we need to get the envelopes separately, or just
+	 * take the envelope of the differences?
+	 */
+	d->mlpfilt = calc_lpf_coef(baud * 1.1, d->lp_filter_q, d->rate);
+	d->slpfilt = calc_lpf_coef(baud * 1.1, d->lp_filter_q, d->rate);
+
+	/*
+	 * These are here to fix the phasing for the crossed bananas
+	 * display.  The centre frequencies aren't calculated, they were
+	 * selected via trial and error, so likely don't work for other
+	 * mark/space frequencies.
+	 * 
+	 * TODO: Figure out how to calculate phase in biquad IIR filters.
+	 */
+	d->mapfilt = calc_apf_coef(d->mark_freq / 1.75, 1, d->rate);
+	d->sapfilt = calc_apf_coef(d->space_freq * 1.75, 1, d->rate);
+}
+
+static struct bq_filter *
+calc_lpf_coef(double f0, double q, int rate)
 {
 	struct bq_filter *ret;
 	double w0, cw0, sw0, a[5], b[5], alpha;
@@ -562,9 +1235,41 @@ calc_bpf_coef(double f0, double q)
 	if (ret == NULL)
 		printf_errno("allocating bpf");
 
-	SETTING_RLOCK();
-	w0 = 2.0 * M_PI * (f0 / settings.dsp_rate);
-	SETTING_UNLOCK();
+	w0 = 2.0 * M_PI * (f0 / rate);
+	cw0 = cos(w0);
+	sw0 = sin(w0);
+
+	alpha = sw0 / (2.0 * q);
+	b[0] = (1.0-cw0)/2.0;
+	b[1] = 1.0 - cw0;
+	b[2] = (1.0-cw0)/2.0;
+	a[0] = 1.0 + alpha;
+	a[1] = -2.0 * cw0;
+	a[2] = 1.0 - alpha;
+	ret->coef[0] = b[0]/a[0];
+	ret->coef[1] = b[1]/a[0];
+	ret->coef[2] = b[2]/a[0];
+	ret->coef[3] = a[1]/a[0];
+	ret->coef[4] = a[2]/a[0];
+	ret->buf[0] = 0;
+	ret->buf[1] = 0;
+	ret->buf[2] = 0;
+	ret->buf[3] = 0;
+
+	return ret;
+}
+
+static struct bq_filter *
+calc_bpf_coef(double f0, double q, int rate)
+{
+	struct bq_filter *ret;
+	double w0, cw0, sw0, a[5], b[5], alpha;
+
+	ret = malloc(sizeof(*ret));
+	if (ret == NULL)
+		printf_errno("allocating bpf");
+
+	w0 = 2.0 * M_PI * (f0 / rate);
 	cw0 = cos(w0);
 	sw0 = sin(w0);
 	alpha = sw0 / (2.0 * q);
@@ -590,7 +1295,7 @@ calc_bpf_coef(double f0, double q)
 }
 
 static struct bq_filter *
-calc_apf_coef(double f0, double q)
+calc_apf_coef(double f0, double q, int rate)
 {
 	struct bq_filter *ret;
 	double w0, cw0, sw0, a[5], b[5], alpha;
@@ -599,9 +1304,7 @@ calc_apf_coef(double f0, double q)
 	if (ret == NULL)
 		printf_errno("allocating bpf");
 
-	SETTING_RLOCK();
-	w0 = 2.0 * M_PI * (f0 / settings.dsp_rate);
-	SETTING_UNLOCK();
+	w0 = 2.0 * M_PI * (f0 / rate);
 	cw0 = cos(w0);
 	sw0 = sin(w0);
 	alpha = sw0 / (2.0 * q);
@@ -642,7 +1345,7 @@ bq_filter(double value, struct bq_filter *f)
 }
 
 static double
-fir_filter(int16_t value, struct fir_filter *f)
+fir_filter(double value, struct fir_filter *f)
 {
 	size_t i;
 	float res = 0;
@@ -658,7 +1361,7 @@ fir_filter(int16_t value, struct fir_filter *f)
 }
 
 static struct fir_filter *
-create_matched_filter(double frequency)
+create_matched_filter(double frequency, int rate, double baud)
 {
 	size_t i;
 	struct fir_filter *ret;
@@ -671,10 +1374,8 @@ create_matched_filter(double frequency)
 	 * For the given sample rate, calculate the number of
 	 * samples in a complete wave
 	 */
-	SETTING_RLOCK();
-	ret->len = settings.dsp_rate / ((double)settings.baud_numerator / settings.baud_denominator) / 2;
-	wavelen = settings.dsp_rate / frequency;
-	SETTING_UNLOCK();
+	ret->len = rate / baud / 2;
+	wavelen = rate / frequency;
 
 	ret->buf = calloc(sizeof(*ret->buf), ret->len);
 	if (ret->buf == NULL)
@@ -692,17 +1393,166 @@ create_matched_filter(double frequency)
 	return ret;
 }
 
-#if 0 // suppress warning
-static int
-avail(int head, int tail, int max)
+/*
+ * Windowed ideal Hilbert transformer.  The real (in-phase) part of the
+ * analytic signal is the centre tap of the delay line.
+ */
+static struct fir_filter *
+create_hilbert_filter(size_t len)
 {
-	if (head == tail)
-		return max;
-	if (head < tail)
-		return tail - head;
-	return (max - head) + tail;
-}
-#endif
+	size_t i;
+	struct fir_filter *ret;
+	int k;
+
+	ret = malloc(sizeof(*ret));
+	if (ret == NULL)
+		printf_errno("allocating Hilbert filter");
+	ret->len = len;
+	ret->buf = calloc(sizeof(*ret->buf), ret->len);
+	if (ret->buf == NULL)
+		printf_errno("allocating Hilbert buffer");
+	ret->coef = malloc(sizeof(*ret->coef) * ret->len);
+	if (ret->coef == NULL)
+		printf_errno("allocating Hilbert coef");
+
+	for (i = 0; i < ret->len; i++) {
+		k = (int)i - (int)(ret->len / 2);
+		if (k % 2 == 0)
+			ret->coef[ret->len - i - 1] = 0;
+		else
+			ret->coef[ret->len - i - 1] = 2.0 / (M_PI * k) *
+			    (0.54 - 0.46 * cos(2.0 * M_PI * i / (ret->len - 1)));
+	}
+
+	return ret;
+}
+
+/*
+ * Shifts the sample down by afc_offset Hz.  This is the real part of
+ * the analytic signal multiplied by the NCO phasor.
+ */
+static double
+afc_shift(struct fsk_demod *d, double sample)
+{
+	struct fir_filter *h = d->hilbert;
+	size_t i;
+	double q = 0;
+	double in;
+	double re;
+
+	memmove(h->buf, &h->buf[1], sizeof(h->buf[0]) * (h->len - 1));
+	h->buf[h->len - 1] = sample;
+	// Only the odd taps are non-zero
+	for (i = 1; i < h->len; i += 2)
+		q += h->buf[i] * h->coef[i];
+	in = h->buf[h->len / 2];
+
+	re = in * d->nco_re - q * d->nco_im;
+
+	/* Advance the NCO */
+	in = d->nco_re * d->nco_step_re - d->nco_im * d->nco_step_im;
+	d->nco_im = d->nco_re * d->nco_step_im + d->nco_im * d->nco_step_re;
+	d->nco_re = in;
+	if (++d->nco_renorm == 1024) {
+		in = sqrt(d->nco_re * d->nco_re + d->nco_im * d->nco_im);
+		d->nco_re /= in;
+		d->nco_im /= in;
+		d->nco_renorm = 0;
+	}
+
+	return re;
+}
+
+static void
+afc_set_offset(struct fsk_demod *d, double offset)
+{
+	int hz;
+	double w;
+
+	if (offset > d->afc_limit)
+		offset = d->afc_limit;
+	if (offset < -d->afc_limit)
+		offset = -d->afc_limit;
+	d->afc_offset = offset;
+	w = -2.0 * M_PI * offset / d->rate;
+	d->nco_step_re = cos(w);
+	d->nco_step_im = sin(w);
+
+	hz = lround(offset);
+	if (hz != atomic_load(&d->afc_hz)) {
+		atomic_store(&d->afc_hz, hz);
+		if (d == &rx)
+			show_afc(atomic_load(&d->afc), hz);
+	}
+}
+
+/*
+ * Measures the period between rising zero crossings of a matched filter
+ * output while its tone is dominant.  Since the filter is linear, a
+ * steady tone comes out at the same frequency it went in, so the
+ * difference from the nominal frequency is the remaining error.
+ */
+static void
+afc_measure(struct fsk_demod *d, struct afc_track *t, double value, double nominal, bool dominant)
+{
+	double crossing;
+	double freq;
+
+	if (!dominant) {
+		t->valid = false;
+		t->last_value = value;
+		return;
+	}
+	if (t->last_value < 0 && value >= 0) {
+		crossing = d->afc_sample - 1 + t->last_value / (t->last_value - value);
+		if (t->valid && crossing > t->last_crossing) {
+			freq = d->rate / (crossing - t->last_crossing);
+			/* Ignore anything that's clearly not our tone */
+			if (fabs(freq - nominal) < d->afc_limit)
+				afc_set_offset(d, d->afc_offset + (freq - nominal) * AFC_GAIN);
+		}
+		t->last_crossing = crossing;
+		t->valid = true;
+	}
+	t->last_value = value;
+}
+
+bool
+get_afc(void)
+{
+	return atomic_load(&rx.afc);
+}
+
+void
+set_afc(bool enable)
+{
+	atomic_store(&rx.afc, enable);
+	atomic_store(&rx2.afc, enable);
+	show_afc(enable, atomic_load(&rx.afc_hz));
+}
+
+/*
+ * The current drift estimate in Hz, zero when AFC is off.
+ */
+int
+get_afc_offset(void)
+{
+	if (!atomic_load(&rx.afc))
+		return 0;
+	return atomic_load(&rx.afc_hz);
+}
+
+#if 0 // suppress warning
+static int
+avail(int head, int tail, int max)
+{
+	if (head == tail)
+		return max;
+	if (head < tail)
+		return tail - head;
+	return (max - head) + tail;
+}
+#endif
 
 #if 0 // suppress warning
 static int
@@ -725,25 +1575,39 @@ next(int val, int max)
 void
 toggle_reverse(bool *rev)
 {
-	void *tmp;
-
 	/*
 	 * RX stuff, swap filters
 	 */
 	*rev = !(*rev);
-	tmp = mfilt;
-	mfilt = sfilt;
-	sfilt = tmp;
+	swap_filters(&rx);
+	if (stereo != STEREO_MONO)
+		swap_filters(&rx2);
+	show_reverse(*rev);
+}
 
-	tmp = mlpfilt;
-	mlpfilt = slpfilt;
-	slpfilt = tmp;
+static void
+swap_filters(struct fsk_demod *d)
+{
+	void *tmp;
+	double f;
 
-	tmp = mapfilt;
-	mapfilt = sapfilt;
-	sapfilt = tmp;
+	tmp = d->mfilt;
+	d->mfilt = d->sfilt;
+	d->sfilt = tmp;
 
-	show_reverse(*rev);
+	tmp = d->mlpfilt;
+	d->mlpfilt = d->slpfilt;
+	d->slpfilt = tmp;
+
+	tmp = d->mapfilt;
+	d->mapfilt = d->sapfilt;
+	d->sapfilt = tmp;
+
+	f = d->mfreq;
+	d->mfreq = d->sfreq;
+	d->sfreq = f;
+	d->mtrack.valid = false;
+	d->strack.valid = false;
 }
 
 static void
@@ -772,43 +1636,45 @@ setup_spectrum_filters(size_t buckets)
 	double freq_step = 4000.0 / (buckets + 1);
 	double freq;
 	double q;
+	int rate;
+	bool matched;
 
 	WF_LOCK();
-	if (waterfall_bp) {
-		for (i = 0; i < waterfall_width; i++) {
-			if (waterfall_bp[i])
-#ifdef MATCHED_BUCKETS
-				free_fir_filter(waterfall_bp[i]);
-#else
-				free_bq_filter(waterfall_bp[i]);
-#endif
-		}
-		free(waterfall_bp);
-		waterfall_bp = NULL;
-	}
-	if (waterfall_lp) {
-		for (i = 0; i < waterfall_width; i++) {
-			if (waterfall_lp[i])
-				free_bq_filter(waterfall_lp[i]);
-		}
-		free(waterfall_lp);
-		waterfall_lp = NULL;
+	for (i = 0; i < waterfall_width; i++) {
+		if (waterfall_mf)
+			free_fir_filter(waterfall_mf[i]);
+		if (waterfall_bp)
+			free_bq_filter(waterfall_bp[i]);
+		if (waterfall_lp)
+			free_bq_filter(waterfall_lp[i]);
 	}
+	free(waterfall_mf);
+	waterfall_mf = NULL;
+	free(waterfall_bp);
+	waterfall_bp = NULL;
+	free(waterfall_lp);
+	waterfall_lp = NULL;
 	waterfall_width = 0;
 	if (buckets == 0) {
 		WF_UNLOCK();
 		return;
 	}
-	waterfall_bp = calloc(sizeof(*waterfall_bp), buckets);
-	if (waterfall_bp == NULL) {
-		waterfall_width = 0;
-		WF_UNLOCK();
-		return;
-	}
+	SETTING_RLOCK();
+	rate = settings.dsp_rate / settings.rx_decimation;
+	matched = settings.matched_waterfall;
+	SETTING_UNLOCK();
+	if (matched)
+		waterfall_mf = calloc(sizeof(*waterfall_mf), buckets);
+	else
+		waterfall_bp = calloc(sizeof(*waterfall_bp), buckets);
 	waterfall_lp = calloc(sizeof(*waterfall_lp), buckets);
-	if (waterfall_lp == NULL) {
+	if ((waterfall_mf == NULL && waterfall_bp == NULL) || waterfall_lp == NULL) {
+		free(waterfall_mf);
+		waterfall_mf = NULL;
 		free(waterfall_bp);
-		waterfall_width = 0;
+		waterfall_bp = NULL;
+		free(waterfall_lp);
+		waterfall_lp = NULL;
 		WF_UNLOCK();
 		return;
 	}
@@ -816,42 +1682,73 @@ setup_spectrum_filters(size_t buckets)
 	for (i = 0; i < buckets; i++) {
 		freq = (freq_step / 2) + freq_step * i;
 		q = freq / freq_step;
-#ifdef MATCHED_BUCKETS
-		waterfall_bp[i] = create_matched_filter(freq);
-#else
-		waterfall_bp[i] = calc_bpf_coef(freq, q);
-#endif
-		if (waterfall_bp[i] == NULL) {
-			WF_UNLOCK();
-			setup_spectrum_filters(0);
-			return;
-		}
-		waterfall_lp[i] = calc_bpf_coef(1, 0.5);
+		if (matched)
+			waterfall_mf[i] = create_matched_filter(freq, rate, (double)rx.baud_numerator / rx.baud_denominator);
+		else
+			waterfall_bp[i] = calc_bpf_coef(freq, q, rate);
+		waterfall_lp[i] = calc_bpf_coef(1, 0.5, rate);
 	}
 	WF_UNLOCK();
 	return;
 }
 
+/*
+ * Each bucket runs over the whole block so its filter state stays in
+ * cache.
+ */
 static void
-feed_waterfall(int16_t value)
+feed_waterfall(const double *buf, size_t n)
 {
-	size_t i;
+	size_t i, j;
 	double v;
 
 	if (tuning_style != TUNE_ASCIIFALL)
 		return;
 	WF_LOCK();
-	for (i = 0; i < waterfall_width; i++) {
-#ifdef MATCHED_BUCKETS
-		v = fir_filter(value, waterfall_bp[i]);
-#else
-		v = bq_filter(value, waterfall_bp[i]);
-#endif
-		bq_filter(v * v, waterfall_lp[i]);
+	if (waterfall_mf) {
+		for (i = 0; i < waterfall_width; i++) {
+			for (j = 0; j < n; j++) {
+				v = fir_filter(buf[j], waterfall_mf[i]);
+				bq_filter(v * v, waterfall_lp[i]);
+			}
+		}
+	}
+	else {
+		for (i = 0; i < waterfall_width; i++) {
+			for (j = 0; j < n; j++) {
+				v = bq_filter(buf[j], waterfall_bp[i]);
+				bq_filter(v * v, waterfall_lp[i]);
+			}
+		}
 	}
 	WF_UNLOCK();
 }
 
+static void
+feed_tuning_aid(const double *mv, const double *sv, size_t n)
+{
+	size_t i;
+
+	if (tuning_style == TUNE_NONE || tuning_style == TUNE_TIMING)
+		return;
+	for (i = 0; i < n; i++)
+		update_tuning_aid(mv[i], sv[i]);
+}
+
+/*
+ * The meter shows the input level, before any conditioning.
+ */
+static void
+feed_meter(const double *buf, size_t n)
+{
+	size_t i;
+	double a = 0;
+
+	for (i = 0; i < n; i++)
+		a = bq_filter(buf[i] * buf[i], afilt);
+	audio_meter((int16_t)sqrt(a));
+}
+
 double
 get_waterfall(size_t bucket)
 {
@@ -871,11 +1768,171 @@ rx_unlock(void *arg)
 	RX_UNLOCK();
 }
 
+/*
+ * Switches the receiver to a new configuration without a reinit().
+ * Must be called from the RX thread.
+ */
+void
+retune_rx(double mark, double space, int baud_numerator, int baud_denominator)
+{
+	bool rev;
+
+	rev = rx.mfreq != rx.mark_freq;
+	fsk_demod_retune(&rx, mark, space, baud_numerator, baud_denominator);
+	rx.emit = rx_char;
+	if (rev)
+		swap_filters(&rx);
+	if (stereo != STEREO_MONO) {
+		fsk_demod_retune(&rx2, mark, space, baud_numerator, baud_denominator);
+		rx2.emit = stereo == STEREO_DUAL ? rx_char : NULL;
+		if (rev)
+			swap_filters(&rx2);
+	}
+}
+
+static void
+rx_char(struct fsk_demod *d, int ret)
+{
+	char ch;
+	bool early;
+
+	if (ret & FSK_DEMOD_RETRACT) {
+		if (d->early_ch) {
+			TRACE_INSTANT("retract", d->early_ch, NULL);
+			rx_deliver(d, '\b');
+			d->early_ch = 0;
+			if (d == &rx) {
+				LATENCY_LOCK();
+				latency_retracted++;
+				LATENCY_UNLOCK();
+			}
+		}
+		return;
+	}
+	early = ret & FSK_DEMOD_EARLY;
+	ret &= ~FSK_DEMOD_EARLY;
+	if (d->data_bits > 5) {
+		/* ASCII, just drop anything that can't be displayed */
+		ch = ret & 0x7f;
+		if ((ch < ' ' && ch != '\r' && ch != '\n' && ch != '\a') ||
+		    ch == 0x7f)
+			return;
+	}
+	else
+		ch = baudot2asc(ret, d->figs);
+	if (early) {
+		/* Shifts and control characters wait for the stop bit */
+		if ((unsigned char)ch < ' ')
+			return;
+		d->early_ch = ch;
+		TRACE_INSTANT("char", (unsigned char)ch, "early");
+		rx_deliver(d, ch);
+		rx_latency(d, true);
+		return;
+	}
+	switch (ch) {
+		case 0x0e:
+			d->figs = true;
+			break;
+		case 0x0f:
+		case ' ':	// USOS
+			d->figs = false;
+			break;
+	}
+	TRACE_INSTANT("char", (unsigned char)ch, NULL);
+	if (d->early_ch)
+		d->early_ch = 0;
+	else {
+		rx_deliver(d, ch);
+		rx_latency(d, false);
+	}
+	if (d == &rx2)
+		return;
+	/*
+	 * XML-RPC clients only get confirmed characters, since one may
+	 * already have read an early one by the time it's retracted.
+	 */
+	switch (ch) {
+		case 0:
+		case 0x07:	// BEL
+		case 0x0e:	// FIGS
+		case 0x0f:	// LTRS
+			break;
+		default:
+			fldigi_add_rx(ch);
+			break;
+	}
+	/* The log only gets characters that had a stop bit */
+	CH_LOCK();
+	chbuf[chh] = ch;
+	chh = next(chh, sizeof(chbuf) - 1);
+	if (chh == cht) {
+		cht = next(cht, sizeof(chbuf) - 1);
+		printf_errno("ring buffer full!");
+	}
+	CH_UNLOCK();
+}
+
+/*
+ * Shows a character on the screen.  A backspace takes back the last
+ * early character.
+ */
+static void
+rx_deliver(struct fsk_demod *d, char ch)
+{
+	if (d == &rx2)
+		write_rx2(ch);
+	else
+		write_rx(ch);
+}
+
+/*
+ * Time from the middle of the last data bit to delivery.  The newest
+ * sample in the block is taken to have arrived when read() returned.
+ */
+static void
+rx_latency(struct fsk_demod *d, bool early)
+{
+	struct timespec now;
+	struct rx_latency *l;
+	double ms;
+
+	if (d != &rx || d->last_bit > block_end)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - block_time.tv_sec) * 1000.0 +
+	    (now.tv_nsec - block_time.tv_nsec) / 1000000.0;
+	ms += (block_end - d->last_bit) * 1000.0 / d->rate;
+	l = early ? &latency_early : &latency_late;
+	LATENCY_LOCK();
+	l->count++;
+	l->total_ms += ms;
+	if (ms > l->max_ms)
+		l->max_ms = ms;
+	LATENCY_UNLOCK();
+}
+
+void
+get_rx_latency(struct rx_latency *early, struct rx_latency *late, uint64_t *retracted)
+{
+	LATENCY_LOCK();
+	*early = latency_early;
+	*late = latency_late;
+	*retracted = latency_retracted;
+	LATENCY_UNLOCK();
+}
+
 static void *
 rx_thread(void *arg)
 {
-	int ret = -1;
-	char ch;
+	struct capture_block *cb;
+	struct ui_block *ub;
+	double *buf;
+	double *buf2;
+	size_t n;
+	size_t blank;
+	size_t high_water;
+	uint64_t dropped;
 	sigset_t blk;
 	(void)arg;
 
@@ -887,40 +1944,646 @@ rx_thread(void *arg)
 #else
 	pthread_set_name_np(pthread_self(), "RX");
 #endif
+	rt_thread_setup(RT_RX, -1, "RX");
 
 	pthread_cleanup_push(rx_unlock, NULL);
+	pthread_cleanup_push(stop_rx_helpers, NULL);
+
+	n = 1;
+	while (n < (size_t)(CAPTURE_SECONDS * dsp_rate / RX_BLOCK))
+		n <<= 1;
+	ring_init(&capture_ring, sizeof(struct capture_block), n);
+	ring_init(&ui_ring, sizeof(struct ui_block), UI_RING);
+	if (pthread_create(&capture_tid, NULL, capture_thread, NULL) != 0)
+		printf_errno("creating capture thread");
+	if (pthread_create(&ui_tid, NULL, ui_feed_thread, NULL) != 0)
+		printf_errno("creating UI feed thread");
+	HELPERS_LOCK();
+	helpers_running = true;
+	HELPERS_UNLOCK();
 
 	for (;;) {
-		ret = read_rtty_ch(ret);
-		if (is_fsk_char(ret)) {
-			ch = baudot2asc(ret, rxfigs);
-			switch (ch) {
-				case 0x0e:
-					rxfigs = true;
-					break;
-				case 0x0f:
-				case ' ':	// USOS
-					rxfigs = false;
-					break;
-			}
-			write_rx(ch);
-			CH_LOCK();
-			chbuf[chh] = ch;
-			chh = next(chh, sizeof(chbuf) - 1);
-			if (chh == cht) {
-				cht = next(cht, sizeof(chbuf) - 1);
-				printf_errno("ring buffer full!");
-			}
-			CH_UNLOCK();
+		cb = ring_read(&capture_ring);
+		if (pthread_mutex_trylock(&rx_lock) != 0) {
+			/*
+			 * We were transmitting, throw away anything
+			 * from before the transmission.  The capture ring
+			 * fills up while we wait, which isn't an overrun.
+			 */
+			ring_read_done(&capture_ring);
+			high_water = atomic_load(&capture_ring.high_water);
+			dropped = atomic_load(&capture_ring.dropped);
+			RX_LOCK();
+			rx_turnaround();
+			atomic_store(&capture_ring.high_water, high_water);
+			atomic_store(&capture_ring.dropped, dropped);
+			RX_UNLOCK();
+			pthread_testcancel();
+			continue;
+		}
+		buf = cb->buf;
+		buf2 = cb->buf2;
+		n = cb->n;
+		block_time = cb->time;
+		STAGE_START(t);
+		STAGE_ACCUM(handoff);
+		STAGE_ACCUM(ch);
+		if (cb->xrun) {
+			/*
+			 * Samples are missing, so the bit timing is off.
+			 * Start hunting for a start bit again rather than
+			 * decoding garbage until it drifts back.
+			 */
+			fsk_demod_reset(&rx);
+			if (stereo != STEREO_MONO)
+				fsk_demod_reset(&rx2);
 		}
+		ub = ring_write(&ui_ring);
+		if (ub) {
+			memcpy(ub->raw, buf, sizeof(buf[0]) * n);
+			ub->raw_n = n;
+		}
+		STAGE_LAP(t, handoff);
+		/*
+		 * Blanked samples never reach the conditioning stages, so
+		 * the AGC and blanker keep their levels from before the
+		 * transmission.  The demodulators get silence in their
+		 * place, which the mark hold reads as mark.
+		 */
+		if (turnaround_blank >= n) {
+			turnaround_blank -= n;
+			n /= dsp_rate / rx_rate;
+			memset(buf, 0, sizeof(buf[0]) * n);
+			memset(buf2, 0, sizeof(buf2[0]) * n);
+		}
+		else {
+			blank = turnaround_blank;
+			turnaround_blank = 0;
+			if (stereo != STEREO_MONO)
+				unblanked_chain(chain[1], buf2, n, blank);
+			n = unblanked_chain(chain[0], buf, n, blank);
+			STAGE_LAP(t, ch);
+			STAGE_RECORD(STAGE_CHAIN, ch);
+		}
+		block_end = rx.samples + n;
+		switch (stereo) {
+			case STEREO_MONO:
+				fsk_demod_block(&rx, buf, n);
+				break;
+			case STEREO_DUAL:
+				fsk_demod_block(&rx, buf, n);
+				fsk_demod_block(&rx2, buf2, n);
+				break;
+			case STEREO_DIVERSITY:
+				fsk_demod_diversity_block(&rx, &rx2, buf, buf2, n);
+				break;
+		}
+		if (ub) {
+			STAGE_START(ht);
+			memcpy(ub->buf, buf, sizeof(buf[0]) * n);
+			memcpy(ub->mv, rx.mvbuf, sizeof(rx.mvbuf[0]) * n);
+			memcpy(ub->sv, rx.svbuf, sizeof(rx.svbuf[0]) * n);
+			ub->n = n;
+			ring_write_done(&ui_ring);
+			STAGE_LAP(ht, handoff);
+		}
+		STAGE_RECORD(STAGE_HANDOFF, handoff);
+		autodetect_feed(buf, n);
+		ring_read_done(&capture_ring);
+		RX_UNLOCK();
 		pthread_testcancel();
 	}
 
 	pthread_cleanup_pop(true);
+	pthread_cleanup_pop(true);
+
+	return NULL;
+}
+
+/*
+ * Reads the sound card as fast as it delivers.  This never waits on
+ * anything else.
+ */
+static void *
+capture_thread(void *arg)
+{
+	struct capture_block *cb;
+	struct capture_block spare;
+	sigset_t blk;
+	unsigned xr;
+	bool gap = false;
+	(void)arg;
+
+	memset(&blk, 0xff, sizeof(blk));
+	assert(pthread_sigmask(SIG_BLOCK, &blk, NULL) == 0);
+
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), "RX capture");
+#else
+	pthread_set_name_np(pthread_self(), "RX capture");
+#endif
+	rt_thread_setup(RT_RX, 0, "RX capture");
+
+	/*
+	 * In full duplex, a block is played for each one read, so TX
+	 * runs off the same clock.  The first one keeps the output a
+	 * block ahead.
+	 */
+	if (duplex)
+		write_duplex(RX_BLOCK);
+	for (;;) {
+		// If the ring is full, keep reading so the device doesn't overrun
+		cb = ring_write(&capture_ring);
+		if (cb == NULL) {
+			cb = &spare;
+			gap = true;
+		}
+		xr = check_input_xrun(dsp);
+		if (xr) {
+			count_xruns(XRUN_RX, xr);
+			gap = true;
+		}
+		STAGE_START(t);
+		cb->n = read_audio(cb->buf, stereo == STEREO_MONO ? NULL : cb->buf2, RX_BLOCK);
+		STAGE_END(STAGE_CAPTURE, t);
+		clock_gettime(CLOCK_MONOTONIC, &cb->time);
+		if (duplex)
+			write_duplex(cb->n);
+		if (cb != &spare) {
+			cb->xrun = gap;
+			gap = false;
+			ring_write_done(&capture_ring);
+		}
+	}
 
 	return NULL;
 }
 
+/*
+ * The meter, waterfall, and tuning aid all take the curses lock, so
+ * they're fed from here rather than the RX thread.  Cancellation is only
+ * allowed while waiting so no lock is ever held when it happens.
+ */
+static void *
+ui_feed_thread(void *arg)
+{
+	struct ui_block *ub;
+	sigset_t blk;
+	int old;
+	(void)arg;
+
+	memset(&blk, 0xff, sizeof(blk));
+	assert(pthread_sigmask(SIG_BLOCK, &blk, NULL) == 0);
+
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), "RX UI");
+#else
+	pthread_set_name_np(pthread_self(), "RX UI");
+#endif
+
+	for (;;) {
+		ub = ring_read(&ui_ring);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+		STAGE_START(t);
+		STAGE_ACCUM(ui);
+		STAGE_ACCUM(wf);
+		feed_meter(ub->raw, ub->raw_n);
+		STAGE_LAP(t, ui);
+		feed_waterfall(ub->buf, ub->n);
+		STAGE_LAP(t, wf);
+		feed_tuning_aid(ub->mv, ub->sv, ub->n);
+		STAGE_LAP(t, ui);
+		STAGE_RECORD(STAGE_WATERFALL, wf);
+		STAGE_RECORD(STAGE_UI, ui);
+		ring_read_done(&ui_ring);
+		pthread_setcancelstate(old, NULL);
+	}
+
+	return NULL;
+}
+
+static void
+stop_rx_helpers(void *arg)
+{
+	(void)arg;
+
+	HELPERS_LOCK();
+	if (!helpers_running) {
+		HELPERS_UNLOCK();
+		return;
+	}
+	helpers_running = false;
+	HELPERS_UNLOCK();
+	pthread_cancel(capture_tid);
+	pthread_join(capture_tid, NULL);
+	pthread_cancel(ui_tid);
+	pthread_join(ui_tid, NULL);
+	ring_destroy(&capture_ring);
+	ring_destroy(&ui_ring);
+}
+
+static void
+ring_init(struct block_ring *r, size_t size, size_t count)
+{
+	r->blocks = malloc(size * count);
+	if (r->blocks == NULL)
+		printf_errno("allocating ring");
+	r->size = size;
+	r->count = count;
+	atomic_store(&r->head, 0);
+	atomic_store(&r->tail, 0);
+	atomic_store(&r->high_water, 0);
+	atomic_store(&r->dropped, 0);
+	if (sem_init(&r->ready, 0, 0) == -1)
+		printf_errno("creating ring semaphore");
+}
+
+static void
+ring_destroy(struct block_ring *r)
+{
+	sem_destroy(&r->ready);
+	free(r->blocks);
+	r->blocks = NULL;
+	r->count = 0;
+}
+
+/*
+ * Returns the next free block, or NULL if the ring is full.
+ */
+static void *
+ring_write(struct block_ring *r)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire) >= r->count) {
+		atomic_fetch_add(&r->dropped, 1);
+		return NULL;
+	}
+	return r->blocks + (head & (r->count - 1)) * r->size;
+}
+
+static void
+ring_write_done(struct block_ring *r)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed) + 1;
+	size_t fill;
+
+	atomic_store_explicit(&r->head, head, memory_order_release);
+	fill = head - atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (fill > atomic_load_explicit(&r->high_water, memory_order_relaxed))
+		atomic_store_explicit(&r->high_water, fill, memory_order_relaxed);
+	sem_post(&r->ready);
+}
+
+/*
+ * Waits for the oldest block.  This is a cancellation point.
+ */
+static void *
+ring_read(struct block_ring *r)
+{
+	size_t tail;
+
+	while (sem_wait(&r->ready) == -1) {
+		if (errno != EINTR)
+			printf_errno("waiting for ring");
+	}
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	return r->blocks + (tail & (r->count - 1)) * r->size;
+}
+
+static void
+ring_read_done(struct block_ring *r)
+{
+	atomic_fetch_add_explicit(&r->tail, 1, memory_order_release);
+}
+
+/*
+ * Throws away everything in the ring.  Only the consumer can call this.
+ */
+static size_t
+ring_drain(struct block_ring *r)
+{
+	size_t n = 0;
+
+	while (sem_trywait(&r->ready) == 0) {
+		ring_read_done(r);
+		n++;
+	}
+	return n;
+}
+
+static void
+ring_stats(struct block_ring *r, struct rx_ring_stats *st)
+{
+	size_t tail;
+
+	st->blocks = r->count;
+	st->block_ms = dsp_rate ? RX_BLOCK * 1000.0 / dsp_rate : 0;
+	tail = atomic_load(&r->tail);
+	st->fill = atomic_load(&r->head) - tail;
+	st->high_water = atomic_load(&r->high_water);
+	st->dropped = atomic_load(&r->dropped);
+}
+
+/*
+ * Fill levels of the capture and UI feed rings, for the RX thread.
+ */
+void
+get_rx_rings(struct rx_ring_stats *capture, struct rx_ring_stats *ui)
+{
+	memset(capture, 0, sizeof(*capture));
+	memset(ui, 0, sizeof(*ui));
+	HELPERS_LOCK();
+	if (helpers_running) {
+		ring_stats(&capture_ring, capture);
+		ring_stats(&ui_ring, ui);
+	}
+	HELPERS_UNLOCK();
+}
+
+/*
+ * Called when a transmission ends.  Audio captured during it is thrown
+ * away, and the filters are flushed so nothing from before it is mixed
+ * into the reply.  The relay transient is then blanked for the
+ * configured time.  The AFC offset, AGC gain, and noise levels all carry
+ * over since the reply is most likely on the same frequency at about
+ * the same level.  Bit timing comes from each start bit, and the
+ * slicer is held at mark during the blanking, so a start bit right
+ * after it is still found.
+ */
+static void
+rx_turnaround(void)
+{
+	size_t ch, i;
+
+	ring_drain(&capture_ring);
+	fsk_demod_reset(&rx);
+	flush_demod(&rx);
+	if (stereo != STEREO_MONO) {
+		fsk_demod_reset(&rx2);
+		flush_demod(&rx2);
+	}
+	for (ch = 0; ch < 2; ch++) {
+		for (i = 0; i < nstages; i++) {
+			if (chain[ch][i].state && chain[ch][i].flush)
+				chain[ch][i].flush(chain[ch][i].state);
+		}
+	}
+	SETTING_RLOCK();
+	turnaround_blank = (size_t)settings.turnaround_blank * dsp_rate / 1000;
+	SETTING_UNLOCK();
+	// The demodulators see it after decimation
+	rx.mark_hold = rx2.mark_hold = turnaround_blank / (dsp_rate / rx_rate);
+}
+
+static size_t
+run_chain(struct rx_stage *stages, double *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < nstages; i++)
+		n = stages[i].run(stages[i].state, buf, n);
+	return n;
+}
+
+/*
+ * Runs the chain on the samples after the first blank, and replaces
+ * the blanked ones with silence at the output rate.
+ */
+static size_t
+unblanked_chain(struct rx_stage *stages, double *buf, size_t n, size_t blank)
+{
+	size_t held;
+
+	if (blank == 0)
+		return run_chain(stages, buf, n);
+	held = blank / (dsp_rate / rx_rate);
+	n = run_chain(stages, buf + blank, n - blank);
+	memmove(buf + held, buf + blank, sizeof(buf[0]) * n);
+	memset(buf, 0, sizeof(buf[0]) * held);
+	return held + n;
+}
+
+static void
+free_chain(void)
+{
+	size_t ch, i;
+
+	for (ch = 0; ch < 2; ch++) {
+		for (i = 0; i < nstages; i++) {
+			if (chain[ch][i].state)
+				chain[ch][i].destroy(chain[ch][i].state);
+			chain[ch][i].state = NULL;
+		}
+	}
+	nstages = 0;
+}
+
+/*
+ * Builds the conditioning chain for each channel.  The blanker goes
+ * ahead of the resampler so impulses aren't smeared out by its filter.
+ */
+static void
+setup_chain(void)
+{
+	size_t ch, i;
+
+	free_chain();
+	SETTING_RLOCK();
+	for (ch = 0; ch < (stereo == STEREO_MONO ? 1U : 2U); ch++) {
+		i = 0;
+		if (settings.noise_blanker > 0)
+			chain[ch][i++] = new_blanker(settings.noise_blanker, dsp_rate);
+		if (settings.rx_decimation > 1)
+			chain[ch][i++] = new_resampler(settings.rx_decimation);
+		if (settings.agc)
+			chain[ch][i++] = new_agc(rx_rate);
+		nstages = i;
+	}
+	SETTING_UNLOCK();
+}
+
+/*
+ * Noise blanker... anything more than threshold times the average
+ * level is an impulse, and is zeroed along with a short hold time
+ * after it.
+ */
+static struct rx_stage
+new_blanker(double threshold, int rate)
+{
+	struct blanker *b;
+
+	b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		printf_errno("allocating noise blanker");
+	b->threshold = threshold;
+	b->alpha = 1.0 - exp(-1.0 / (BLANKER_AVG_TIME * rate));
+	b->hold = BLANKER_HOLD_TIME * rate + 1;
+	return (struct rx_stage){.run = blank_block, .destroy = free, .state = b};
+}
+
+static size_t
+blank_block(void *state, double *buf, size_t n)
+{
+	struct blanker *b = state;
+	size_t i;
+	double m;
+
+	for (i = 0; i < n; i++) {
+		m = fabs(buf[i]);
+		if (m > b->threshold * b->avg)
+			b->blank = b->hold;
+		/* Impulses are too short to move the average much */
+		b->avg += (m - b->avg) * b->alpha;
+		if (b->blank) {
+			b->blank--;
+			buf[i] = 0;
+		}
+	}
+	return n;
+}
+
+/*
+ * Integer decimation with a windowed sinc lowpass.  The filter is only
+ * evaluated for the samples that are kept.
+ */
+static struct rx_stage
+new_resampler(size_t factor)
+{
+	struct resampler *r;
+	size_t i;
+	double x, fc, sum = 0;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		printf_errno("allocating resampler");
+	r->factor = factor;
+	r->len = RESAMPLER_TAPS * factor + 1;
+	r->coef = malloc(sizeof(*r->coef) * r->len);
+	r->hist = calloc(sizeof(*r->hist), r->len * 2);
+	if (r->coef == NULL || r->hist == NULL)
+		printf_errno("allocating resampler");
+	fc = 0.45 / factor;
+	for (i = 0; i < r->len; i++) {
+		x = i - (r->len - 1) / 2.0;
+		if (x == 0)
+			r->coef[i] = 2 * fc;
+		else
+			r->coef[i] = sin(2 * M_PI * fc * x) / (M_PI * x);
+		// Blackman window
+		r->coef[i] *= 0.42 - 0.5 * cos(2 * M_PI * i / (r->len - 1)) +
+		    0.08 * cos(4 * M_PI * i / (r->len - 1));
+		sum += r->coef[i];
+	}
+	for (i = 0; i < r->len; i++)
+		r->coef[i] /= sum;
+	return (struct rx_stage){.run = resample_block, .destroy = free_resampler,
+	    .state = r, .flush = flush_resampler};
+}
+
+static void
+flush_resampler(void *state)
+{
+	struct resampler *r = state;
+
+	memset(r->hist, 0, sizeof(*r->hist) * r->len * 2);
+	r->phase = 0;
+}
+
+static void
+free_resampler(void *state)
+{
+	struct resampler *r = state;
+
+	free(r->coef);
+	free(r->hist);
+	free(r);
+}
+
+static size_t
+resample_block(void *state, double *buf, size_t n)
+{
+	struct resampler *r = state;
+	size_t i, j;
+	size_t out = 0;
+	const double *h;
+	double y;
+
+	for (i = 0; i < n; i++) {
+		r->hist[r->pos] = r->hist[r->pos + r->len] = buf[i];
+		if (++r->pos == r->len)
+			r->pos = 0;
+		if (++r->phase < r->factor)
+			continue;
+		r->phase = 0;
+		/* Oldest to newest */
+		h = &r->hist[r->pos];
+		y = 0;
+		for (j = 0; j < r->len; j++)
+			y += h[j] * r->coef[j];
+		buf[out++] = y;
+	}
+	return out;
+}
+
+/*
+ * Peak tracking AGC with a fast attack and slow decay.
+ */
+static struct rx_stage
+new_agc(int rate)
+{
+	struct agc *a;
+
+	a = calloc(1, sizeof(*a));
+	if (a == NULL)
+		printf_errno("allocating AGC");
+	a->attack = 1.0 - exp(-1.0 / (AGC_ATTACK_TIME * rate));
+	a->decay = 1.0 - exp(-1.0 / (AGC_DECAY_TIME * rate));
+	return (struct rx_stage){.run = agc_block, .destroy = free, .state = a};
+}
+
+static size_t
+agc_block(void *state, double *buf, size_t n)
+{
+	struct agc *a = state;
+	size_t i;
+	double m;
+
+	for (i = 0; i < n; i++) {
+		m = fabs(buf[i]);
+		if (m > a->peak)
+			a->peak += (m - a->peak) * a->attack;
+		else
+			a->peak -= a->peak * a->decay;
+		buf[i] *= AGC_TARGET / (a->peak + 1);
+	}
+	return n;
+}
+
+/*
+ * Adds a complete string to the RX window and the character buffer at
+ * once so it's not interleaved with anything else.
+ */
+void
+rx_string(const char *str)
+{
+	const char *c;
+
+	write_rx_str(str);
+	for (c = str; *c; c++)
+		fldigi_add_rx(*c);
+	CH_LOCK();
+	for (; *str; str++) {
+		chbuf[chh] = *str;
+		chh = next(chh, sizeof(chbuf) - 1);
+		if (chh == cht) {
+			cht = next(cht, sizeof(chbuf) - 1);
+			printf_errno("ring buffer full!");
+		}
+	}
+	CH_UNLOCK();
+}
+
 int
 get_rtty_ch(void)
 {
@@ -932,7 +2595,7 @@ get_rtty_ch(void)
 		cht = next(cht, sizeof(chbuf) - 1);
 	}
 	else {
-		if (atomic_load(&hfs))
+		if (atomic_load(&rx.hfs))
 			ret = FSK_DEMOD_HFS;
 		else
 			ret = FSK_DEMOD_SYNC;
@@ -1,18 +1,73 @@
 #ifndef FSK_DEMOD_H
 #define FSK_DEMOD_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lockprof.h"
+
+struct fsk_demod;
+
 int get_rtty_ch(void);
 void setup_rx(pthread_t *tid);
 void toggle_reverse(bool *rev);
 double get_waterfall(size_t bucket);
 void setup_spectrum_filters(size_t buckets);
+bool get_afc(void);
+void set_afc(bool enable);
+int get_afc_offset(void);
+void retune_rx(double mark, double space, int baud_numerator, int baud_denominator);
+void rx_string(const char *str);
+
+struct rx_latency {
+	uint64_t	count;
+	double		total_ms;
+	double		max_ms;
+};
+void get_rx_latency(struct rx_latency *early, struct rx_latency *late, uint64_t *retracted);
+
+struct rx_ring_stats {
+	size_t		blocks;
+	double		block_ms;
+	size_t		fill;
+	size_t		high_water;
+	uint64_t	dropped;
+};
+void get_rx_rings(struct rx_ring_stats *capture, struct rx_ring_stats *ui);
+int get_duplex_dsp(void);
+
+struct fsk_demod *fsk_demod_new(double mark, double space, int baud_numerator, int baud_denominator, int rate, void (*emit)(struct fsk_demod *d, int ch), void *arg);
+void fsk_demod_free(struct fsk_demod *d);
+void fsk_demod_feed(struct fsk_demod *d, const double *samples, size_t count);
+void fsk_demod_reset(struct fsk_demod *d);
+void fsk_demod_retune(struct fsk_demod *d, double mark, double space, int baud_numerator, int baud_denominator);
+uint64_t fsk_demod_frames(struct fsk_demod *d);
+uint64_t fsk_demod_sync_frames(struct fsk_demod *d);
+uint64_t fsk_demod_framing_errors(struct fsk_demod *d);
+void *fsk_demod_arg(struct fsk_demod *d);
+void fsk_demod_set_afc(struct fsk_demod *d, bool enable);
+double fsk_demod_afc_offset(struct fsk_demod *d);
 
 extern pthread_mutex_t rx_lock;
-#define RX_LOCK()	assert(pthread_mutex_lock(&rx_lock) == 0)
+LOCK_PROF_EXTERN(rx_lock_prof);
+#define RX_LOCK()	assert(PROF_MUTEX_LOCK(&rx_lock, rx_lock_prof) == 0)
 #define RX_UNLOCK()	assert(pthread_mutex_unlock(&rx_lock) == 0)
 
+// Maximum samples handled by the RX thread at a time
+#define RX_BLOCK	256
+
 #define FSK_DEMOD_HFS	-1
 #define FSK_DEMOD_SYNC	-2
 #define is_fsk_char(ch)	(ch >= 0)
 
+/*
+ * Flags passed to emit() by demodulators with early emission on.  An
+ * early character is sent as soon as its last data bit is decided.
+ * When the stop bit arrives, it's sent again without the flag, or a
+ * retraction is sent if there wasn't one.
+ */
+#define FSK_DEMOD_EARLY		0x100
+#define FSK_DEMOD_RETRACT	0x200
+
 #endif
@@ -27,25 +27,83 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bsdtty.h"
+#include "rtsched.h"
+#include "trace.h"
 #include "ui.h"
 
 static int fsk_tty = -1;
+/*
+ * Without CMSPAR, mark and space parity are sent as an extra data bit
+ * that's always set or clear.
+ */
+static unsigned char fsk_set_bits;
+static unsigned char fsk_clear_bits;
+static atomic_bool fsk_aborting;
 static pthread_mutex_t fsk_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define FSK_LOCK() pthread_mutex_lock(&fsk_mutex);
+STATIC_LOCK_PROF(fsk_prof, "fsk");
+#define FSK_LOCK() PROF_MUTEX_LOCK(&fsk_mutex, fsk_prof);
 #define FSK_UNLOCK() pthread_mutex_unlock(&fsk_mutex);
+/*
+ * FSK queue
+ *
+ * Characters are queued here and written to the UART in batches by
+ * the FSK thread, which waits for it to be writable rather than losing
+ * characters to EAGAIN.  They stay in the queue until they're written,
+ * so unsent() can count them.  Everything is protected by the FSK
+ * lock, and fsk_cond wakes the thread (and its drain wait) for new
+ * characters, the end of a transmission, an abort, or exiting.
+ */
+#define FSK_QUEUE_LEN	1024
+static unsigned char fsk_queue[FSK_QUEUE_LEN];
+static size_t fsk_qhead;
+static size_t fsk_qtail;
+static pthread_cond_t fsk_cond;
+static pthread_cond_t fsk_room = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fsk_ended = PTHREAD_COND_INITIALIZER;
+static bool fsk_cond_initialized;
+static bool fsk_end;
+static bool fsk_exit;
+static bool fsk_thread_running;
+static pthread_t fsk_threadid;
+/*
+ * The UART sends back to back, so the last stop bit of everything
+ * written so far finishes at fsk_wire_free (CLOCK_MONOTONIC
+ * nanoseconds).  TIOCOUTQ can only make it later, if the UART is
+ * slower than it should be.
+ */
+static uint64_t fsk_frame_ns;
+static atomic_uint_fast64_t fsk_wire_free;
 
+static void abort_fsk(void);
+static void drain_fsk(void);
 static void end_fsk_thread(void);
+static void * fsk_thread(void *arg);
 static void fsk_toggle_reverse(void);
 static void end_fsk_tx(void);
+static uint64_t mono_ns(void);
+static void note_fsk_written(size_t count);
 static void send_fsk_preamble(void);
 static void send_fsk_char(char ch);
 static void setup_fsk(void);
+static size_t fsk_unsent(void);
+static size_t write_fsk(const unsigned char *buf, size_t size);
 
 static void
 fsk_toggle_reverse(void)
@@ -53,49 +111,196 @@ fsk_toggle_reverse(void)
 	// FSK can't be reversed.
 }
 
+static uint64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Waits until the FSK thread has written everything and the last stop
+ * bit has left the UART, so PTT can be released.
+ */
 static void
 end_fsk_tx(void)
 {
-	useconds_t sl;
-
 	FSK_LOCK();
-	tcdrain(fsk_tty);
-	// Space still gets cut off... wait one char
-	SETTING_RLOCK();
-	sl = ((1/((double)settings.baud_numerator / settings.baud_denominator))*7.5)*1000000;
-	SETTING_UNLOCK();
-	usleep(sl);
+	if (fsk_aborting || !fsk_thread_running) {
+		FSK_UNLOCK();
+		return;
+	}
+	fsk_end = true;
+	pthread_cond_broadcast(&fsk_cond);
+	while (fsk_end)
+		pthread_cond_wait(&fsk_ended, &fsk_mutex);
 	FSK_UNLOCK();
 }
 
+/*
+ * Called by the FSK thread with the FSK lock held once the queue is
+ * empty.  Sleeps until the last stop bit is out, checking TIOCOUTQ in
+ * case the UART fell behind.  If anything is still queued there, one
+ * more character may be in the shift register.
+ */
+static void
+drain_fsk(void)
+{
+	struct timespec ts;
+	uint64_t now;
+	uint64_t until;
+	int queued;
+
+	while (!fsk_aborting && !fsk_exit) {
+		now = mono_ns();
+		until = atomic_load(&fsk_wire_free);
+		if (ioctl(fsk_tty, TIOCOUTQ, &queued) == 0 && queued > 0 &&
+		    now + (queued + 1) * fsk_frame_ns > until)
+			until = now + (queued + 1) * fsk_frame_ns;
+		if (until <= now)
+			break;
+		atomic_store(&fsk_wire_free, until);
+		ts.tv_sec = until / 1000000000;
+		ts.tv_nsec = until % 1000000000;
+		pthread_cond_timedwait(&fsk_cond, &fsk_mutex, &ts);
+	}
+}
+
 static void
 send_fsk_preamble(void)
 {
 	useconds_t sl;
-	
-	/* Hold it in mark for 1 byte time. */
+
+	/*
+	 * Hold it in mark for 1 byte time.  Nothing is queued yet, so
+	 * there's no need to keep fsk_unsent() waiting meanwhile.
+	 */
 	FSK_LOCK();
-	SETTING_RLOCK();
-	sl = ((1/((double)settings.baud_numerator / settings.baud_denominator))*7.5)*1000000;
-	SETTING_UNLOCK();
-	usleep(sl);
+	fsk_aborting = false;
+	sl = fsk_frame_ns / 1000;
 	FSK_UNLOCK();
+	usleep(sl);
 }
 
 static void
 send_fsk_char(char ch)
 {
 	FSK_LOCK();
-	if (write(fsk_tty, &ch, 1) != 1)
-		printf_errno("error sending FIGS/LTRS");
+	while (!fsk_aborting && fsk_qhead - fsk_qtail >= FSK_QUEUE_LEN)
+		pthread_cond_wait(&fsk_room, &fsk_mutex);
+	if (fsk_aborting || !fsk_thread_running) {
+		FSK_UNLOCK();
+		return;
+	}
+	fsk_queue[fsk_qhead++ % FSK_QUEUE_LEN] = (ch | fsk_set_bits) & ~fsk_clear_bits;
+	pthread_cond_broadcast(&fsk_cond);
+	FSK_UNLOCK();
+}
+
+/*
+ * The UART starts on the first of them as soon as the last character
+ * written before it is done, or right away if it's idle.
+ */
+static void
+note_fsk_written(size_t count)
+{
+	uint64_t now = mono_ns();
+	uint64_t start = atomic_load(&fsk_wire_free);
+
+	if (start < now)
+		start = now;
+	atomic_store(&fsk_wire_free, start + count * fsk_frame_ns);
+}
+
+/*
+ * Writes as much of buf as it can without the FSK lock held, waiting
+ * for the tty when it's full.  Returns how many were written, which is
+ * short only after an abort.
+ */
+static size_t
+write_fsk(const unsigned char *buf, size_t size)
+{
+	struct pollfd pfd = {.fd = fsk_tty, .events = POLLOUT};
+	size_t sent = 0;
+	ssize_t ret;
+	int timeout = fsk_frame_ns / 1000000 + 1;
+
+	TRACE_BEGIN_ARG("FSK write", size);
+	while (sent < size && !fsk_aborting) {
+		ret = write(fsk_tty, buf + sent, size - sent);
+		if (ret == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				printf_errno("error sending character");
+			// Wake up every character in case of an abort
+			poll(&pfd, 1, timeout);
+			continue;
+		}
+		note_fsk_written(ret);
+		sent += ret;
+	}
+	TRACE_END("FSK write");
+	return sent;
+}
+
+static void *
+fsk_thread(void *arg)
+{
+	unsigned char buf[FSK_QUEUE_LEN];
+	sigset_t blk;
+	size_t n, t, i;
+	size_t sent;
+	(void)arg;
+
+	memset(&blk, 0xff, sizeof(blk));
+	assert(pthread_sigmask(SIG_BLOCK, &blk, NULL) == 0);
+
+#ifdef __linux__
+	pthread_setname_np(pthread_self(), "FSK");
+#else
+	pthread_set_name_np(pthread_self(), "FSK");
+#endif
+	// Only one of the AFSK and FSK threads runs, so they share a slot
+	rt_thread_setup(RT_AFSK, 0, "FSK");
+
+	FSK_LOCK();
+	while (!fsk_exit) {
+		if (fsk_qhead == fsk_qtail) {
+			if (fsk_end) {
+				drain_fsk();
+				fsk_end = false;
+				pthread_cond_broadcast(&fsk_ended);
+			}
+			else
+				pthread_cond_wait(&fsk_cond, &fsk_mutex);
+			continue;
+		}
+		// Take everything queued, but leave it there until it's written
+		t = fsk_qtail;
+		n = fsk_qhead - t;
+		for (i = 0; i < n; i++)
+			buf[i] = fsk_queue[(t + i) % FSK_QUEUE_LEN];
+		FSK_UNLOCK();
+		sent = write_fsk(buf, n);
+		FSK_LOCK();
+		// abort_fsk() may have thrown it all away already
+		if (fsk_qtail == t) {
+			fsk_qtail += sent;
+			pthread_cond_broadcast(&fsk_room);
+		}
+	}
 	FSK_UNLOCK();
+	return NULL;
 }
 
 static void
 setup_fsk(void)
 {
+	pthread_condattr_t ca;
 	struct termios t;
 	int state = TIOCM_DTR | TIOCM_RTS;
+	int data_bits;
 #ifdef TIOCSFBAUD
 	struct baud_fraction bf;
 #endif
@@ -123,16 +328,62 @@ setup_fsk(void)
 
 	/* May as well set to 45 for devices that don't support FBAUD */
 	if (cfsetspeed(&t, settings.baud_numerator/settings.baud_denominator) == -1)
-		printf_errno("unable to set speed to 45 baud");
+		printf_errno("unable to set speed to %d baud", settings.baud_numerator/settings.baud_denominator);
 
 	/*
 	 * NOTE: With 8250 compatible UARTs, CS5 | CSTOPB is 1.5 stop
 	 * bits, not 2 as documented in the man page.  This is good since
-	 * it's what we want anyway.
+	 * it's what we want anyway.  With more data bits, it's 2, so 1.5
+	 * stop bits can only be done with Baudot.
 	 */
 	t.c_iflag = IGNBRK;
 	t.c_oflag = 0;
-	t.c_cflag = CS5 | CSTOPB | CLOCAL;
+	t.c_cflag = CLOCAL;
+	if (settings.stop_bits > 1)
+		t.c_cflag |= CSTOPB;
+	fsk_set_bits = 0;
+	fsk_clear_bits = 0;
+	data_bits = settings.data_bits;
+	switch (settings.parity) {
+		case PARITY_NONE:
+			break;
+		case PARITY_ODD:
+			t.c_cflag |= PARENB | PARODD;
+			break;
+		case PARITY_EVEN:
+			t.c_cflag |= PARENB;
+			break;
+		case PARITY_MARK:
+		case PARITY_SPACE:
+#ifdef CMSPAR
+			t.c_cflag |= PARENB | CMSPAR;
+			if (settings.parity == PARITY_MARK)
+				t.c_cflag |= PARODD;
+#else
+			if (data_bits == 8)
+				printf_errno("mark/space parity not supported with 8 data bits");
+			if (settings.parity == PARITY_MARK)
+				fsk_set_bits = 1 << data_bits;
+			else
+				fsk_clear_bits = 1 << data_bits;
+			data_bits++;
+#endif
+			break;
+	}
+	switch (data_bits) {
+		case 5:
+			t.c_cflag |= CS5;
+			break;
+		case 6:
+			t.c_cflag |= CS6;
+			break;
+		case 7:
+			t.c_cflag |= CS7;
+			break;
+		default:
+			t.c_cflag |= CS8;
+			break;
+	}
 #ifdef CNO_RTSDTR
 	t.c_cflag |= CNO_RTSDTR;
 #endif
@@ -151,20 +402,91 @@ setup_fsk(void)
 	ioctl(fsk_tty, TIOCSFBAUD, &bf);
 	ioctl(fsk_tty, TIOCGFBAUD, &bf);
 #endif
+	fsk_frame_ns = frame_bits() * settings.baud_denominator * 1000000000.0 / settings.baud_numerator;
 	SETTING_UNLOCK();
+
+	// The drain waits on it with a CLOCK_MONOTONIC deadline
+	if (!fsk_cond_initialized) {
+		assert(pthread_condattr_init(&ca) == 0);
+		assert(pthread_condattr_setclock(&ca, CLOCK_MONOTONIC) == 0);
+		assert(pthread_cond_init(&fsk_cond, &ca) == 0);
+		pthread_condattr_destroy(&ca);
+		fsk_cond_initialized = true;
+	}
+	fsk_qhead = fsk_qtail = 0;
+	fsk_end = false;
+	fsk_exit = false;
+	fsk_aborting = false;
+	atomic_store(&fsk_wire_free, 0);
+	if (pthread_create(&fsk_threadid, NULL, fsk_thread, NULL) != 0)
+		printf_errno("Creating FSK thread");
+	fsk_thread_running = true;
 	FSK_UNLOCK();
 }
 
 static void
 end_fsk_thread(void)
 {
-	// There is no FSK thread to end.
+	FSK_LOCK();
+	if (!fsk_thread_running) {
+		FSK_UNLOCK();
+		return;
+	}
+	fsk_exit = true;
+	fsk_thread_running = false;
+	pthread_cond_broadcast(&fsk_cond);
+	FSK_UNLOCK();
+	pthread_join(fsk_threadid, NULL);
+	// Nobody is left to wait for
+	FSK_LOCK();
+	fsk_qtail = fsk_qhead;
+	fsk_end = false;
+	pthread_cond_broadcast(&fsk_room);
+	pthread_cond_broadcast(&fsk_ended);
+	FSK_UNLOCK();
 }
 
+/*
+ * Throws away the queue and whatever the UART hasn't sent.  The FSK
+ * thread stops writing and draining when it sees fsk_aborting.
+ */
 static void
-flush_fsk(void)
+abort_fsk(void)
 {
+	FSK_LOCK();
+	fsk_aborting = true;
+	fsk_qtail = fsk_qhead;
 	tcflush(fsk_tty, TCOFLUSH);
+	atomic_store(&fsk_wire_free, 0);
+	pthread_cond_broadcast(&fsk_cond);
+	pthread_cond_broadcast(&fsk_room);
+	FSK_UNLOCK();
+}
+
+/*
+ * What's still in our queue, plus what the UART hasn't finished.
+ * That's the characters written whose last stop bit is still to come,
+ * or TIOCOUTQ if the UART has fallen further behind than that.
+ */
+static size_t
+fsk_unsent(void)
+{
+	uint64_t now = mono_ns();
+	uint64_t until;
+	size_t ret;
+	size_t wire = 0;
+	int queued;
+
+	FSK_LOCK();
+	ret = fsk_qhead - fsk_qtail;
+	until = atomic_load(&fsk_wire_free);
+	if (until > now && fsk_frame_ns)
+		wire = (until - now + fsk_frame_ns - 1) / fsk_frame_ns;
+	if (ioctl(fsk_tty, TIOCOUTQ, &queued) == 0 && queued > 0 &&
+	    (size_t)queued > wire)
+		wire = queued;
+	FSK_UNLOCK();
+	return ret + wire;
 }
 
 struct send_fsk_api fsk_api = {
@@ -174,5 +496,6 @@ struct send_fsk_api fsk_api = {
 	.send_char = send_fsk_char,
 	.setup = setup_fsk,
 	.end_fsk = end_fsk_thread,
-	.flush = flush_fsk
+	.abort = abort_fsk,
+	.unsent = fsk_unsent
 };
@@ -0,0 +1,277 @@
+/*-
+ * Copyright (c) 2018 Stephen Hurd, W8BSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Lock contention profiling.  A trylock is done first, so an uncontended
+ * lock costs one extra atomic add.  Only when it would block is the wait
+ * timed.  Each lock's stats are registered the first time it's taken.
+ *
+ * The holder is whoever acquired it last, which is exact while it's held
+ * unless the lock was released or retaken behind the macros' back (by a
+ * condition variable wait, for example).
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lockprof.h"
+
+#define MAX_THREAD_NAMES	64
+
+static struct lock_prof *locks;
+static char thread_names[MAX_THREAD_NAMES][16];
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef LOCK_PROFILING
+static int nthread_names;
+static _Thread_local int thread_index = -1;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Thread names are interned so the locks can refer to them by index
+ * even after the thread is gone.
+ */
+static int
+current_thread(void)
+{
+	char name[16];
+	int i;
+
+	if (thread_index != -1)
+		return thread_index;
+#ifdef __linux__
+	if (pthread_getname_np(pthread_self(), name, sizeof(name)) != 0)
+		strcpy(name, "?");
+#else
+	pthread_get_name_np(pthread_self(), name, sizeof(name));
+#endif
+	pthread_mutex_lock(&registry_mutex);
+	for (i = 0; i < nthread_names; i++) {
+		if (strcmp(thread_names[i], name) == 0)
+			break;
+	}
+	if (i == nthread_names) {
+		if (nthread_names < MAX_THREAD_NAMES) {
+			strcpy(thread_names[i], name);
+			nthread_names++;
+		}
+		else
+			i = MAX_THREAD_NAMES - 1;
+	}
+	pthread_mutex_unlock(&registry_mutex);
+	thread_index = i;
+	return i;
+}
+
+static void
+register_lock(struct lock_prof *p)
+{
+	pthread_mutex_lock(&registry_mutex);
+	if (!atomic_load(&p->registered)) {
+		p->next = locks;
+		locks = p;
+		atomic_store(&p->registered, true);
+	}
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+static void
+record_wait(struct lock_prof *p, uint64_t ns, int blocker)
+{
+	uint_fast64_t max;
+	int b;
+
+	atomic_fetch_add_explicit(&p->contended, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&p->wait_ns, ns, memory_order_relaxed);
+	b = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (b >= LOCKPROF_BUCKETS)
+		b = LOCKPROF_BUCKETS - 1;
+	atomic_fetch_add_explicit(&p->wait_hist[b], 1, memory_order_relaxed);
+	max = atomic_load_explicit(&p->max_wait_ns, memory_order_relaxed);
+	while (ns > max) {
+		if (atomic_compare_exchange_weak(&p->max_wait_ns, &max, ns)) {
+			atomic_store_explicit(&p->blocker, blocker, memory_order_relaxed);
+			break;
+		}
+	}
+}
+
+static void
+acquired(struct lock_prof *p)
+{
+	atomic_fetch_add_explicit(&p->acquired, 1, memory_order_relaxed);
+	atomic_store_explicit(&p->holder, current_thread(), memory_order_relaxed);
+}
+
+int
+lockprof_mutex_lock(pthread_mutex_t *m, struct lock_prof *p)
+{
+	uint64_t start;
+	int blocker;
+	int ret;
+
+	if (!atomic_load_explicit(&p->registered, memory_order_acquire))
+		register_lock(p);
+	ret = pthread_mutex_trylock(m);
+	if (ret == EBUSY) {
+		blocker = atomic_load_explicit(&p->holder, memory_order_relaxed);
+		start = now_ns();
+		ret = pthread_mutex_lock(m);
+		record_wait(p, now_ns() - start, blocker);
+	}
+	if (ret == 0)
+		acquired(p);
+	return ret;
+}
+
+int
+lockprof_rdlock(pthread_rwlock_t *l, struct lock_prof *p)
+{
+	uint64_t start;
+	int blocker;
+	int ret;
+
+	if (!atomic_load_explicit(&p->registered, memory_order_acquire))
+		register_lock(p);
+	ret = pthread_rwlock_tryrdlock(l);
+	if (ret == EBUSY) {
+		blocker = atomic_load_explicit(&p->holder, memory_order_relaxed);
+		start = now_ns();
+		ret = pthread_rwlock_rdlock(l);
+		record_wait(p, now_ns() - start, blocker);
+	}
+	if (ret == 0)
+		acquired(p);
+	return ret;
+}
+
+int
+lockprof_wrlock(pthread_rwlock_t *l, struct lock_prof *p)
+{
+	uint64_t start;
+	int blocker;
+	int ret;
+
+	if (!atomic_load_explicit(&p->registered, memory_order_acquire))
+		register_lock(p);
+	ret = pthread_rwlock_trywrlock(l);
+	if (ret == EBUSY) {
+		blocker = atomic_load_explicit(&p->holder, memory_order_relaxed);
+		start = now_ns();
+		ret = pthread_rwlock_wrlock(l);
+		record_wait(p, now_ns() - start, blocker);
+	}
+	if (ret == 0)
+		acquired(p);
+	return ret;
+}
+#endif
+
+/*
+ * The upper bound of the bucket holding the 99th percentile wait.
+ */
+static double
+p99_us(struct lock_prof *p, uint64_t contended)
+{
+	uint64_t want = contended - contended / 100;
+	uint64_t seen = 0;
+	int b;
+
+	for (b = 0; b < LOCKPROF_BUCKETS; b++) {
+		seen += atomic_load_explicit(&p->wait_hist[b], memory_order_relaxed);
+		if (seen >= want)
+			return ((UINT64_C(2) << b) - 1) / 1000.0;
+	}
+	return 0;
+}
+
+/*
+ * Fills out with up to max locks that have been taken, and returns how
+ * many.  Always zero without LOCK_PROFILING.
+ */
+size_t
+get_lock_stats(struct lock_stats *out, size_t max)
+{
+	struct lock_prof *p;
+	size_t n = 0;
+	int b;
+
+	pthread_mutex_lock(&registry_mutex);
+	for (p = locks; p != NULL && n < max; p = p->next, n++) {
+		out[n].name = p->name;
+		out[n].acquired = atomic_load_explicit(&p->acquired, memory_order_relaxed);
+		out[n].contended = atomic_load_explicit(&p->contended, memory_order_relaxed);
+		out[n].wait_ms = atomic_load_explicit(&p->wait_ns, memory_order_relaxed) / 1000000.0;
+		out[n].max_wait_us = atomic_load_explicit(&p->max_wait_ns, memory_order_relaxed) / 1000.0;
+		out[n].p99_wait_us = out[n].contended ? p99_us(p, out[n].contended) : 0;
+		if (out[n].p99_wait_us > out[n].max_wait_us)
+			out[n].p99_wait_us = out[n].max_wait_us;
+		b = atomic_load_explicit(&p->blocker, memory_order_relaxed);
+		out[n].blocker = b >= 0 ? thread_names[b] : "";
+	}
+	pthread_mutex_unlock(&registry_mutex);
+	return n;
+}
+
+/*
+ * Registered with atexit() before curses is set up, so it runs after the
+ * screen is restored.
+ */
+void
+print_lock_report(void)
+{
+	struct lock_stats st[64];
+	size_t n, i;
+
+	n = get_lock_stats(st, sizeof(st) / sizeof(st[0]));
+	if (n == 0)
+		return;
+	printf("%-16s %12s %10s %7s %10s %10s %10s  %s\n", "Lock", "Acquired",
+	    "Contended", "%", "Wait ms", "p99 us", "Max us", "Longest wait on");
+	for (i = 0; i < n; i++) {
+		printf("%-16s %12" PRIu64 " %10" PRIu64 " %7.3f %10.3f %10.1f %10.1f  %s\n",
+		    st[i].name, st[i].acquired, st[i].contended,
+		    st[i].acquired ? st[i].contended * 100.0 / st[i].acquired : 0.0,
+		    st[i].wait_ms, st[i].p99_wait_us, st[i].max_wait_us, st[i].blocker);
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Lock contention profiling.  Build with -DLOCK_PROFILING (make
+ * LOCK_PROFILING=1) and every lock taken through the *_LOCK() macros
+ * counts acquisitions and how long it had to wait.  Otherwise the
+ * macros are plain pthread calls.
+ */
+
+#define LOCKPROF_BUCKETS	40	// Powers of two of ns
+
+struct lock_prof {
+	const char		*name;
+	struct lock_prof	*next;
+	atomic_bool		registered;
+	atomic_uint_fast64_t	acquired;
+	atomic_uint_fast64_t	contended;
+	atomic_uint_fast64_t	wait_ns;
+	atomic_uint_fast64_t	max_wait_ns;
+	atomic_uint_fast64_t	wait_hist[LOCKPROF_BUCKETS];
+	// Thread name indexes of the last one to get it and the holder during the longest wait
+	atomic_int		holder;
+	atomic_int		blocker;
+};
+
+struct lock_stats {
+	const char	*name;
+	uint64_t	acquired;
+	uint64_t	contended;
+	double		wait_ms;
+	double		p99_wait_us;
+	double		max_wait_us;
+	const char	*blocker;
+};
+
+#ifdef LOCK_PROFILING
+#define LOCK_PROF(var, lname)		struct lock_prof var = { .name = lname, .holder = -1, .blocker = -1 }
+#define STATIC_LOCK_PROF(var, lname)	static LOCK_PROF(var, lname)
+#define PROF_MUTEX_LOCK(m, p)		lockprof_mutex_lock((m), &(p))
+#define PROF_RDLOCK(l, p)		lockprof_rdlock((l), &(p))
+#define PROF_WRLOCK(l, p)		lockprof_wrlock((l), &(p))
+
+int lockprof_mutex_lock(pthread_mutex_t *m, struct lock_prof *p);
+int lockprof_rdlock(pthread_rwlock_t *l, struct lock_prof *p);
+int lockprof_wrlock(pthread_rwlock_t *l, struct lock_prof *p);
+#else
+// Declares without defining, so there's nothing left
+#define LOCK_PROF(var, lname)		extern struct lock_prof var
+#define STATIC_LOCK_PROF(var, lname)	extern struct lock_prof var
+#define PROF_MUTEX_LOCK(m, p)		pthread_mutex_lock(m)
+#define PROF_RDLOCK(l, p)		pthread_rwlock_rdlock(l)
+#define PROF_WRLOCK(l, p)		pthread_rwlock_wrlock(l)
+#endif
+#define LOCK_PROF_EXTERN(var)		extern struct lock_prof var
+
+size_t get_lock_stats(struct lock_stats *out, size_t max);
+void print_lock_report(void);
+
+#endif
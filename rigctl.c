@@ -16,13 +16,15 @@
 #include <unistd.h>
 
 #include "bsdtty.h"
+#include "trace.h"
 #include "ui.h"
 
 static int sock_readln(int sock, char *buf, size_t bufsz);
 static int rigctld_socket = -1;
 static int rc_tty = -1;
 static pthread_mutex_t rigctl_mutex = PTHREAD_MUTEX_INITIALIZER;
-#define RC_LOCK() pthread_mutex_lock(&rigctl_mutex);
+STATIC_LOCK_PROF(rigctl_prof, "rigctl");
+#define RC_LOCK() PROF_MUTEX_LOCK(&rigctl_mutex, rigctl_prof);
 #define RC_UNLOCK() pthread_mutex_unlock(&rigctl_mutex);
 
 void
@@ -126,6 +128,7 @@ get_rig_freq_mode(uint64_t *freq, char *mbuf, size_t sz)
 	char tbuf[1024];
 
 	RC_LOCK();
+	TRACE_BEGIN("rig control", "fm");
 	if (rigctld_socket != -1) {
 		if (send(rigctld_socket, "fm\n", 3, 0) != 3)
 			goto next;
@@ -158,6 +161,7 @@ get_rig_freq_mode(uint64_t *freq, char *mbuf, size_t sz)
 		}
 		if (sscanf(buf, "%" SCNu64, freq) != 1)
 			goto next;
+		TRACE_END("rig control");
 		RC_UNLOCK();
 		return;
 	}
@@ -165,6 +169,7 @@ next:
 
 	*freq = 0;
 	mbuf[0] = 0;
+	TRACE_END("rig control");
 	RC_UNLOCK();
 	return;
 }
@@ -176,6 +181,7 @@ get_rig_freq(void)
 	char buf[1024];
 
 	RC_LOCK();
+	TRACE_BEGIN("rig control", "f");
 	if (rigctld_socket != -1) {
 		if (send(rigctld_socket, "f\n", 2, 0) != 2)
 			goto next;
@@ -189,12 +195,14 @@ get_rig_freq(void)
 			goto next;
 		}
 		if (sscanf(buf, "%" SCNu64, &ret) == 1) {
+			TRACE_END("rig control");
 			RC_UNLOCK();
 			return ret;
 		}
 	}
 next:
 
+	TRACE_END("rig control");
 	RC_UNLOCK();
 	return 0;
 }
@@ -207,6 +215,7 @@ get_rig_ptt(void)
 	bool cptt;
 
 	RC_LOCK();
+	TRACE_BEGIN("rig control", "t");
 	SETTING_RLOCK();
 	cptt = settings.ctl_ptt;
 	SETTING_UNLOCK();
@@ -217,9 +226,11 @@ get_rig_ptt(void)
 			if (sock_readln(rigctld_socket, buf, sizeof(buf)) <= 0)
 				printf_errno("lost connection getting rig PTT");
 			if (buf[0] == '1') {
+				TRACE_END("rig control");
 				RC_UNLOCK();
 				return true;
 			}
+			TRACE_END("rig control");
 			RC_UNLOCK();
 			return false;
 		}
@@ -228,6 +239,7 @@ next:
 
 	if (ioctl(rc_tty, TIOCMGET, &state) == -1)
 		printf_errno("getting RTS state");
+	TRACE_END("rig control");
 	RC_UNLOCK();
 	return !!(state & TIOCM_RTS);
 }
@@ -242,6 +254,7 @@ set_rig_ptt(bool val)
 	bool cptt;
 
 	RC_LOCK();
+	TRACE_BEGIN("rig control", val ? "T 1" : "T 0");
 	SETTING_RLOCK();
 	cptt = settings.ctl_ptt;
 	SETTING_UNLOCK();
@@ -264,6 +277,7 @@ set_rig_ptt(bool val)
 				usleep(10000);
 			}
 		}
+		TRACE_END("rig control");
 		RC_UNLOCK();
 		return ret;
 	}
@@ -271,6 +285,7 @@ next:
 
 	if (ioctl(rc_tty, val ? TIOCMBIS : TIOCMBIC, &state) != 0)
 		printf_errno("%s RTS bit", val ? "setting" : "resetting");
+	TRACE_END("rig control");
 	RC_UNLOCK();
 	return false;
 }
@@ -0,0 +1,226 @@
+/*-
+ * Copyright (c) 2018 Stephen Hurd, W8BSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Optional real-time scheduling, CPU pinning, and memory locking for the
+ * threads that move audio.  Anything that can't be done is reported in
+ * the RX window and the thread carries on at whatever it did get.
+ */
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#ifdef __FreeBSD__
+#include <sys/cpuset.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bsdtty.h"
+#include "rtsched.h"
+#include "ui.h"
+
+#ifdef __FreeBSD__
+typedef cpuset_t rt_cpuset_t;
+#else
+typedef cpu_set_t rt_cpuset_t;
+#endif
+
+// Enough stack for the deepest DSP call chain to never fault
+#define PREFAULT_STACK	(64 * 1024)
+
+static bool memory_locked;
+
+static void rt_report(const char *thread, const char *what, int err, const char *hint);
+static bool set_rt_priority(int policy, int prio, const char *name);
+static void set_nice(const char *name);
+static void prefault_stack(void);
+
+static void
+rt_report(const char *thread, const char *what, int err, const char *hint)
+{
+	char *msg;
+
+	if (asprintf(&msg, "\r\n[%s: %s: %s%s%s]\r\n", thread, what, strerror(err), hint ? ", " : "", hint ? hint : "") < 0)
+		return;
+	write_rx_str(msg);
+	free(msg);
+}
+
+/*
+ * Tries the requested priority, then whatever RLIMIT_RTPRIO allows.
+ * The limit is how unprivileged users get real-time priority (it's
+ * what pam_limits sets up for the audio group), so it's the closest
+ * we get to asking rtkit without pulling in D-Bus.
+ */
+static bool
+set_rt_priority(int policy, int prio, const char *name)
+{
+	struct sched_param sp;
+	const char *pname = policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO";
+	char what[64];
+	int ret;
+#ifdef RLIMIT_RTPRIO
+	struct rlimit rl;
+#endif
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = prio;
+	ret = pthread_setschedparam(pthread_self(), policy, &sp);
+	if (ret == 0)
+		return true;
+#ifdef RLIMIT_RTPRIO
+	if (ret == EPERM && getrlimit(RLIMIT_RTPRIO, &rl) == 0 && rl.rlim_cur > 0 && rl.rlim_cur < (rlim_t)prio) {
+		sp.sched_priority = rl.rlim_cur;
+		if (pthread_setschedparam(pthread_self(), policy, &sp) == 0) {
+			snprintf(what, sizeof(what), "%s priority %d", pname, prio);
+			rt_report(name, what, EPERM, "using the RLIMIT_RTPRIO limit instead");
+			return true;
+		}
+	}
+#endif
+	snprintf(what, sizeof(what), "%s priority %d", pname, prio);
+	rt_report(name, what, ret, ret == EPERM ? "needs root, CAP_SYS_NICE, or an RLIMIT_RTPRIO" : NULL);
+	return false;
+}
+
+/*
+ * Linux allows a per-thread nice value, which helps a bit under load
+ * when real-time priority isn't allowed.
+ */
+static void
+set_nice(const char *name)
+{
+#ifdef __linux__
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), -10) == -1)
+		rt_report(name, "nice -10", errno, NULL);
+#else
+	(void)name;
+#endif
+}
+
+/*
+ * Touches the stack so the first deep call in the audio path doesn't
+ * take page faults.  With the memory locked, it then stays resident.
+ */
+static void
+prefault_stack(void)
+{
+	volatile char stack[PREFAULT_STACK];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 256)
+		stack[i] = 0;
+}
+
+/*
+ * Called by each audio thread right after it starts.  prio_offset is added
+ * to the RT priority setting, so a thread that consumes another's output
+ * can run below it and never hold it up.
+ */
+void
+rt_thread_setup(enum rt_class class, int prio_offset, const char *name)
+{
+	int prio;
+	int policy;
+	int cpu;
+	long ncpus;
+	rt_cpuset_t set;
+	int ret;
+	char what[32];
+
+	SETTING_RLOCK();
+	prio = settings.rt_priority;
+	policy = settings.rt_round_robin ? SCHED_RR : SCHED_FIFO;
+	cpu = class == RT_AFSK ? settings.afsk_cpu : settings.rx_cpu;
+	SETTING_UNLOCK();
+
+	// CPU_SET() doesn't check the CPU fits in the set everywhere
+	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	if (cpu >= CPU_SETSIZE || (ncpus > 0 && cpu >= ncpus)) {
+		snprintf(what, sizeof(what), "pinning to CPU %d", cpu);
+		rt_report(name, what, EINVAL, "no such CPU");
+	}
+	else if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret != 0) {
+			snprintf(what, sizeof(what), "pinning to CPU %d", cpu);
+			rt_report(name, what, ret, NULL);
+		}
+	}
+
+	if (prio > 0) {
+		prio += prio_offset;
+		if (prio < sched_get_priority_min(policy))
+			prio = sched_get_priority_min(policy);
+		if (prio > sched_get_priority_max(policy))
+			prio = sched_get_priority_max(policy);
+		if (!set_rt_priority(policy, prio, name))
+			set_nice(name);
+		prefault_stack();
+	}
+}
+
+/*
+ * Locks everything mapped now and later, so the rings and thread stacks
+ * created after this are faulted in when they're allocated and are never
+ * paged out.  Needs to happen before the audio threads are started.
+ */
+void
+setup_rt_memory(void)
+{
+	bool lock;
+
+	SETTING_RLOCK();
+	lock = settings.lock_memory;
+	SETTING_UNLOCK();
+
+	if (lock && !memory_locked) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+			rt_report("bsdtty", "locking memory", errno, errno == ENOMEM || errno == EPERM ? "check RLIMIT_MEMLOCK" : NULL);
+		else
+			memory_locked = true;
+	}
+	else if (!lock && memory_locked) {
+		munlockall();
+		memory_locked = false;
+	}
+}
@@ -0,0 +1,12 @@
+#ifndef RTSCHED_H
+#define RTSCHED_H
+
+enum rt_class {
+	RT_RX,
+	RT_AFSK
+};
+
+void rt_thread_setup(enum rt_class class, int prio_offset, const char *name);
+void setup_rt_memory(void);
+
+#endif
@@ -0,0 +1,176 @@
+/*-
+ * Copyright (c) 2018 Stephen Hurd, W8BSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Histograms for the stage timing.  Each stage is only ever recorded by
+ * one thread, so the counters are plain relaxed loads and stores with no
+ * read-modify-write.  Readers may be a block behind, which doesn't matter
+ * for percentiles.
+ *
+ * Buckets are log-linear like HDR histograms: the power of two, then
+ * SUB_BUCKETS linear steps within it, so the error is under 1/SUB_BUCKETS
+ * at any scale.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "timing.h"
+
+#ifdef STAGE_TIMING
+#define SUB_BITS	4
+#define SUB_BUCKETS	(1 << SUB_BITS)
+#define MAX_BITS	40		// About 18 minutes in ns
+#define NBUCKETS	((MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS)
+
+struct stage_hist {
+	atomic_uint_fast64_t	max;
+	atomic_uint_fast64_t	bucket[NBUCKETS];
+};
+
+static struct stage_hist hists[STAGE_COUNT];
+
+static size_t
+bucket_index(uint64_t ns)
+{
+	int msb;
+
+	if (ns < SUB_BUCKETS)
+		return ns;
+	if (ns >= (UINT64_C(1) << MAX_BITS))
+		return NBUCKETS - 1;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - SUB_BITS + 1) * SUB_BUCKETS + ((ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/*
+ * The largest value that lands in bucket i.
+ */
+static uint64_t
+bucket_value(size_t i)
+{
+	size_t msb;
+
+	if (i < SUB_BUCKETS)
+		return i;
+	msb = i / SUB_BUCKETS + SUB_BITS - 1;
+	return (UINT64_C(1) << msb) + (((uint64_t)(i % SUB_BUCKETS) + 1) << (msb - SUB_BITS)) - 1;
+}
+
+#define BUMP(v, n)	atomic_store_explicit(&(v), atomic_load_explicit(&(v), memory_order_relaxed) + (n), memory_order_relaxed)
+
+void
+stage_record(enum timing_stage stage, uint64_t ns)
+{
+	struct stage_hist *h = &hists[stage];
+
+	BUMP(h->bucket[bucket_index(ns)], 1);
+	if (ns > atomic_load_explicit(&h->max, memory_order_relaxed))
+		atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+}
+
+static uint64_t
+percentile(const uint64_t *counts, uint64_t total, double pct)
+{
+	uint64_t want = total * pct / 100 + 1;
+	uint64_t seen = 0;
+	size_t i;
+
+	if (want > total)
+		want = total;
+	for (i = 0; i < NBUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= want)
+			return bucket_value(i);
+	}
+	return 0;
+}
+#endif
+
+static const char *stage_names[STAGE_COUNT] = {
+	[STAGE_CAPTURE] = "capture",
+	[STAGE_CHAIN] = "chain",
+	[STAGE_ENVELOPE] = "envelope",
+	[STAGE_SLICER] = "slicer",
+	[STAGE_HANDOFF] = "handoff",
+	[STAGE_WATERFALL] = "waterfall",
+	[STAGE_UI] = "ui",
+};
+
+/*
+ * Fills out with a summary of every stage and returns how many there
+ * are, which is zero if timing isn't compiled in.
+ */
+size_t
+get_stage_timing(struct stage_summary *out)
+{
+#ifdef STAGE_TIMING
+	uint64_t counts[NBUCKETS];
+	uint64_t total;
+	size_t s, i;
+
+	for (s = 0; s < STAGE_COUNT; s++) {
+		total = 0;
+		for (i = 0; i < NBUCKETS; i++) {
+			counts[i] = atomic_load_explicit(&hists[s].bucket[i], memory_order_relaxed);
+			total += counts[i];
+		}
+		out[s].name = stage_names[s];
+		out[s].blocks = total;
+		out[s].p50_ns = total ? percentile(counts, total, 50) : 0;
+		out[s].p99_ns = total ? percentile(counts, total, 99) : 0;
+		out[s].max_ns = atomic_load_explicit(&hists[s].max, memory_order_relaxed);
+		// The bucket's upper bound can be past the largest value in it
+		if (out[s].p50_ns > out[s].max_ns)
+			out[s].p50_ns = out[s].max_ns;
+		if (out[s].p99_ns > out[s].max_ns)
+			out[s].p99_ns = out[s].max_ns;
+	}
+	return STAGE_COUNT;
+#else
+	(void)out;
+	(void)stage_names;
+	return 0;
+#endif
+}
+
+/*
+ * Racy against the recording threads, so a block recorded during the
+ * reset may survive it.
+ */
+void
+reset_stage_timing(void)
+{
+#ifdef STAGE_TIMING
+	size_t s, i;
+
+	for (s = 0; s < STAGE_COUNT; s++) {
+		for (i = 0; i < NBUCKETS; i++)
+			atomic_store_explicit(&hists[s].bucket[i], 0, memory_order_relaxed);
+		atomic_store_explicit(&hists[s].max, 0, memory_order_relaxed);
+	}
+#endif
+}
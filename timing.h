@@ -0,0 +1,62 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per-block timing of the receive path.  Build with -DSTAGE_TIMING (make
+ * STAGE_TIMING=1) to enable it, otherwise the macros compile to nothing.
+ */
+
+enum timing_stage {
+	STAGE_CAPTURE,		// Sound card read, capture thread
+	STAGE_CHAIN,		// Decimation FIR, blanker, AGC
+	STAGE_ENVELOPE,		// Mark/space filters and envelopes
+	STAGE_SLICER,		// Bit decisions and hunt for start
+	STAGE_HANDOFF,		// Copying to the UI ring
+	STAGE_WATERFALL,	// Spectrum filters, UI thread
+	STAGE_UI,		// Meter and tuning aid, UI thread
+	STAGE_COUNT
+};
+
+struct stage_summary {
+	const char	*name;
+	uint64_t	blocks;
+	uint64_t	p50_ns;
+	uint64_t	p99_ns;
+	uint64_t	max_ns;
+};
+
+#ifdef STAGE_TIMING
+static inline uint64_t
+stage_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stage_record(enum timing_stage stage, uint64_t ns);
+
+#define STAGE_START(t)			uint64_t t = stage_clock()
+#define STAGE_END(stage, t)		stage_record((stage), stage_clock() - (t))
+#define STAGE_ACCUM(acc)		uint64_t acc = 0
+#define STAGE_LAP(t, acc)		do { uint64_t now_ = stage_clock(); (acc) += now_ - (t); (t) = now_; } while (0)
+#define STAGE_RECORD(stage, ns)		stage_record((stage), (ns))
+#define STAGE_RECORD_IF(c, stage, ns)	do { if (c) stage_record((stage), (ns)); } while (0)
+#else
+#define STAGE_START(t)
+#define STAGE_END(stage, t)
+#define STAGE_ACCUM(acc)
+#define STAGE_LAP(t, acc)
+#define STAGE_RECORD(stage, ns)
+#define STAGE_RECORD_IF(c, stage, ns)
+#endif
+
+size_t get_stage_timing(struct stage_summary *out);
+void reset_stage_timing(void);
+
+#endif
@@ -0,0 +1,258 @@
+/*-
+ * Copyright (c) 2018 Stephen Hurd, W8BSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Event tracer.  Every thread gets a ring the first time it records
+ * anything, so recording is a clock read and a few stores with no
+ * locking.  When a thread exits, its ring is kept for the next thread
+ * with the same name, so reinit() doesn't leak one per restart and the
+ * timeline keeps one row per thread.
+ *
+ * Dumping reads the rings while they're being written, so the oldest
+ * few events in a full ring may be torn.  Those are skipped.
+ */
+
+#include <pthread.h>
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#endif
+#include <inttypes.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "ui.h"
+
+#ifdef EVENT_TRACING
+#define TRACE_EVENTS	8192		// Per thread, a power of two
+#define TRACE_SLACK	64		// Skipped at the old end of a full ring
+
+struct trace_event {
+	uint64_t	ns;
+	const char	*name;
+	int64_t		arg;
+	char		phase;
+	char		detail[15];
+};
+
+struct trace_ring {
+	struct trace_ring	*next;
+	char			thread[16];
+	int			tid;
+	bool			live;
+	atomic_uint_fast64_t	head;
+	struct trace_event	ev[TRACE_EVENTS];
+};
+
+static struct trace_ring *rings;
+static int nrings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local struct trace_ring *ring;
+static volatile sig_atomic_t dump_requested;
+
+static void dump_trace(void);
+
+static void
+release_ring(void *arg)
+{
+	struct trace_ring *r = arg;
+
+	pthread_mutex_lock(&rings_mutex);
+	r->live = false;
+	pthread_mutex_unlock(&rings_mutex);
+}
+
+static void
+make_ring_key(void)
+{
+	pthread_key_create(&ring_key, release_ring);
+}
+
+static struct trace_ring *
+get_ring(void)
+{
+	struct trace_ring *r;
+	char name[16] = "";
+
+	pthread_once(&ring_key_once, make_ring_key);
+#ifdef __linux__
+	pthread_getname_np(pthread_self(), name, sizeof(name));
+#else
+	pthread_get_name_np(pthread_self(), name, sizeof(name));
+#endif
+	pthread_mutex_lock(&rings_mutex);
+	for (r = rings; r != NULL; r = r->next) {
+		if (!r->live && strcmp(r->thread, name) == 0)
+			break;
+	}
+	if (r == NULL) {
+		r = calloc(1, sizeof(*r));
+		if (r == NULL)
+			printf_errno("allocating trace ring");
+		strcpy(r->thread, name);
+		r->tid = ++nrings;
+		r->next = rings;
+		rings = r;
+	}
+	r->live = true;
+	pthread_mutex_unlock(&rings_mutex);
+	pthread_setspecific(ring_key, r);
+	ring = r;
+	return r;
+}
+
+void
+trace_event(char phase, const char *name, int64_t arg, const char *detail)
+{
+	struct trace_ring *r = ring;
+	struct trace_event *e;
+	struct timespec ts;
+	uint_fast64_t h;
+
+	if (r == NULL)
+		r = get_ring();
+	h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	e = &r->ev[h & (TRACE_EVENTS - 1)];
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	e->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	e->name = name;
+	e->arg = arg;
+	e->phase = phase;
+	if (detail) {
+		strncpy(e->detail, detail, sizeof(e->detail) - 1);
+		e->detail[sizeof(e->detail) - 1] = 0;
+	}
+	else
+		e->detail[0] = 0;
+	atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+/*
+ * Only printable ASCII goes in the JSON, anything else is replaced.
+ */
+static void
+json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if (*s < ' ' || *s > '~')
+			fputc('?', f);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void
+dump_trace(void)
+{
+	struct trace_ring *r;
+	struct trace_event *e;
+	uint_fast64_t h, i, first;
+	bool comma = false;
+	FILE *f;
+
+	f = fopen(TRACE_FILE, "w");
+	if (f == NULL)
+		return;
+	fputs("{\"traceEvents\":[\n", f);
+	pthread_mutex_lock(&rings_mutex);
+	for (r = rings; r != NULL; r = r->next) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", comma ? ",\n" : "", r->tid);
+		json_string(f, r->thread[0] ? r->thread : "bsdtty");
+		fputs("}}", f);
+		comma = true;
+		h = atomic_load_explicit(&r->head, memory_order_acquire);
+		first = h > TRACE_EVENTS ? h - TRACE_EVENTS + TRACE_SLACK : 0;
+		for (i = first; i < h; i++) {
+			e = &r->ev[i & (TRACE_EVENTS - 1)];
+			fprintf(f, ",\n{\"name\":");
+			json_string(f, e->name);
+			fprintf(f, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", e->phase, e->ns / 1000.0, r->tid);
+			if (e->phase == 'i')
+				fputs(",\"s\":\"t\"", f);
+			if (e->phase != 'E') {
+				fprintf(f, ",\"args\":{\"arg\":%" PRId64 ",\"detail\":", e->arg);
+				json_string(f, e->detail);
+				fputc('}', f);
+			}
+			fputc('}', f);
+		}
+	}
+	pthread_mutex_unlock(&rings_mutex);
+	fputs("\n],\"displayTimeUnit\":\"ms\"}\n", f);
+	fclose(f);
+}
+
+static void
+request_dump(int sig)
+{
+	(void)sig;
+	dump_requested = 1;
+}
+#endif
+
+/*
+ * Catches SIGUSR1 and dumps on exit.  The signal handler only sets a
+ * flag, and the main loop does the dump.
+ */
+void
+setup_trace(void)
+{
+#ifdef EVENT_TRACING
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = request_dump;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+	atexit(dump_trace);
+#endif
+}
+
+/*
+ * Polled from the input loop.
+ */
+void
+check_trace_dump(void)
+{
+#ifdef EVENT_TRACING
+	if (dump_requested) {
+		dump_requested = 0;
+		dump_trace();
+	}
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Event tracing.  Build with -DEVENT_TRACING (make EVENT_TRACING=1) and
+ * each thread records events into its own ring.  They're written to
+ * bsdtty-trace.json in Chrome trace format on SIGUSR1 and on exit, for
+ * viewing in chrome://tracing or Perfetto.  Otherwise the macros compile
+ * to nothing.
+ *
+ * name must be a string constant, detail is copied and truncated.
+ */
+
+#define TRACE_FILE	"bsdtty-trace.json"
+
+#ifdef EVENT_TRACING
+void trace_event(char phase, const char *name, int64_t arg, const char *detail);
+
+#define TRACE_BEGIN(name, detail)	trace_event('B', (name), 0, (detail))
+#define TRACE_BEGIN_ARG(name, arg)	trace_event('B', (name), (arg), NULL)
+#define TRACE_END(name)			trace_event('E', (name), 0, NULL)
+#define TRACE_INSTANT(name, arg, detail) trace_event('i', (name), (arg), (detail))
+#else
+#define TRACE_BEGIN(name, detail)	do {} while (0)
+#define TRACE_BEGIN_ARG(name, arg)	do {} while (0)
+#define TRACE_END(name)			do {} while (0)
+#define TRACE_INSTANT(name, arg, detail) do {} while (0)
+#endif
+
+void setup_trace(void);
+void check_trace_dump(void);
+
+#endif
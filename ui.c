@@ -33,6 +33,7 @@
 #include <form.h>
 #include <inttypes.h>
 #include <math.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -46,7 +47,9 @@
 #include "bsdtty.h"
 #include "fsk_demod.h"
 #include "rigctl.h"
+#include "timing.h"
 #include "ui.h"
+#include "xrun.h"
 
 /* UI Stuff */
 static WINDOW *status;
@@ -54,6 +57,11 @@ static WINDOW *status_title;
 static WINDOW *rx;
 static WINDOW *tuning_aid;
 static WINDOW *rx_title;
+// Second receiver for STEREO_DUAL, NULL when not split
+static WINDOW *rx2_title;
+static WINDOW *rx2;
+static bool rx_split;
+static char rx_label[32] = " RX ";
 static WINDOW *tx;
 static WINDOW *tx_title;
 static size_t tx_width;
@@ -61,10 +69,20 @@ static size_t tx_height;
 static bool reset_tuning;
 static uint64_t last_freq;
 static char last_mode[32] = "";
+/*
+ * Keys read by check_abort_key() while a macro is being sent, for
+ * get_input() to return afterwards.  Only the main thread uses them.
+ */
+#define PENDING_KEYS	64
+static int pending_keys[PENDING_KEYS];
+static size_t pending_head;
+static size_t pending_tail;
+#define INPUT_TIMEOUT	160	// ms, how often the input loop wakes up
 static pthread_mutex_t curses_lock = PTHREAD_MUTEX_INITIALIZER;
+STATIC_LOCK_PROF(curses_lock_prof, "curses");
 #define CURS_LOCK()	do {                                  \
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL); \
-	assert(pthread_mutex_lock(&curses_lock) == 0);        \
+	assert(PROF_MUTEX_LOCK(&curses_lock, curses_lock_prof) == 0); \
 } while(0)
 #define CURS_UNLOCK()	do {                                  \
 	assert(pthread_mutex_unlock(&curses_lock) == 0);      \
@@ -73,6 +91,8 @@ static pthread_mutex_t curses_lock = PTHREAD_MUTEX_INITIALIZER;
 static void update_captured_call_locked(const char *call);
 
 enum tuning_styles tuning_style = TUNE_ASCIINANAS;
+// What to go back to when the stage timing is toggled off
+static enum tuning_styles timing_saved_style;
 
 static bool baudot_char(int ch, const void *ab);
 static bool baudot_macro_char(int ch, const void *ab);
@@ -88,6 +108,8 @@ static void toggle_figs(int y, int x);
 static void w_printf(WINDOW *win, const char *format, ...);
 static char *unescape_config(char *str);
 static void update_waterfall(void);
+static void draw_rx_title(void);
+static void write_rx_window(WINDOW *win, char ch);
 static void draw_tx_title(enum tuning_styles style);
 static void show_reverse_locked(bool rev);
 
@@ -163,13 +185,14 @@ update_tuning_aid(double mark, double space)
 	static double maxs = 0;
 	static double cmaxm = 0;
 	static double cmaxs = 0;
+	const struct settings_snapshot *snap;
 	double mmult, smult;
 	int madd, sadd;
 	int y, x;
 	chtype ch;
 	int och;
 
-	if (tuning_style == TUNE_NONE)
+	if (tuning_style == TUNE_NONE || tuning_style == TUNE_TIMING)
 		return;
 
 	if (tuning_style == TUNE_ASCIIFALL) {
@@ -187,9 +210,8 @@ update_tuning_aid(double mark, double space)
 	}
 
 	if (nsamp == -1) {
-		SETTING_RLOCK();
-		nsamp = settings.dsp_rate/((((double)settings.baud_numerator / settings.baud_denominator)));
-		SETTING_UNLOCK();
+		snap = SETTINGS_SNAPSHOT();
+		nsamp = snap->dsp_rate / snap->rx_decimation / ((double)snap->baud_numerator / snap->baud_denominator);
 	}
 	if (buf == NULL) {
 		buf = malloc(sizeof(*buf) * nsamp * 2);
@@ -216,10 +238,9 @@ update_tuning_aid(double mark, double space)
 		 * value.
 		 */
 		if (cmaxm < maxm / 3 && cmaxs < maxs / 3) {
-			SETTING_RLOCK();
-			maxm *= 1 - ((double)nsamp / settings.dsp_rate);
-			maxs *= 1 - ((double)nsamp / settings.dsp_rate);
-			SETTING_UNLOCK();
+			snap = SETTINGS_SNAPSHOT();
+			maxm *= 1 - ((double)nsamp * snap->rx_decimation / snap->dsp_rate);
+			maxs *= 1 - ((double)nsamp * snap->rx_decimation / snap->dsp_rate);
 		}
 		cmaxm = cmaxs = 0;
 		mmult = maxm / (tx_width / 2 - 2);
@@ -294,9 +315,13 @@ get_input(void)
 	int ret;
 	MEVENT ev;
 
-	typeahead(STDIN_FILENO);
-	ret = wgetch(tx);
-	typeahead(-1);
+	if (pending_tail != pending_head)
+		ret = pending_keys[pending_tail++ % PENDING_KEYS];
+	else {
+		typeahead(STDIN_FILENO);
+		ret = wgetch(tx);
+		typeahead(-1);
+	}
 	switch(ret) {
 		case ERR:
 			return -1;
@@ -355,39 +380,83 @@ get_input(void)
 }
 
 void
-write_tx(char ch)
+write_tx_str(const char *str)
 {
 	CURS_LOCK();
-	if (ch == '\r')
-		waddch(tx, '\n');
-	waddch(tx, ch);
+	for (; *str; str++) {
+		if (*str == '\r')
+			waddch(tx, '\n');
+		waddch(tx, *str);
+	}
 	wrefresh(tx);
 	CURS_UNLOCK();
 }
 
 void
 write_rx(char ch)
+{
+	CURS_LOCK();
+	write_rx_window(rx, ch);
+	CURS_UNLOCK();
+}
+
+/*
+ * The second receiver in dual receiver mode.
+ */
+void
+write_rx2(char ch)
+{
+	CURS_LOCK();
+	if (rx2)
+		write_rx_window(rx2, ch);
+	CURS_UNLOCK();
+}
+
+void
+write_rx_str(const char *str)
+{
+	CURS_LOCK();
+	for (; *str; str++)
+		write_rx_window(rx, *str);
+	CURS_UNLOCK();
+}
+
+/*
+ * Curses lock must be held.
+ */
+static void
+write_rx_window(WINDOW *win, char ch)
 {
 	int x, y;
 	int my;
 
-	CURS_LOCK();
-	getyx(rx, y, x);
-	my = getmaxy(rx);
+	getyx(win, y, x);
+	my = getmaxy(win);
 	switch (ch) {
 		case '\r':
-			wmove(rx, y, 0);
+			wmove(win, y, 0);
 			break;
 		case '\n':
 			if (y == my - 1)
-				scroll(rx);
+				scroll(win);
 			else
 				y++;
-			wmove(rx, y, x);
+			wmove(win, y, x);
 			break;
 		case 7:
 			beep();
 			break;
+		case '\b':
+			// Takes back an early character
+			if (x > 0)
+				x--;
+			else if (y > 0) {
+				y--;
+				x = getmaxx(win) - 1;
+			}
+			mvwaddch(win, y, x, ' ');
+			wmove(win, y, x);
+			break;
 		case 5:
 			// Ignore Who Are You?
 			break;
@@ -396,16 +465,16 @@ write_rx(char ch)
 		case 0x0f:
 			break;
 		default:
-			waddch(rx, ch);
+			waddch(win, ch);
 			break;
 	}
-	wrefresh(rx);
-	CURS_UNLOCK();
+	wrefresh(win);
 }
 
 static void
 show_freq(void)
 {
+	const struct settings_snapshot *snap;
 	uint64_t freq;
 	char fstr[32];
 	char mode[32];
@@ -424,15 +493,13 @@ show_freq(void)
 	get_rig_freq_mode(&freq, mode, sizeof(mode));
 	if (freq == 0)
 		return;
-	SETTING_RLOCK();
-	freq += settings.freq_offset;
-	SETTING_UNLOCK();
+	snap = SETTINGS_SNAPSHOT();
+	freq += snap->freq_offset;
 	if (freq != last_freq) {
 		update = true;
-		SETTING_RLOCK();
-		switch (toupper(settings.callsign[0])) {
+		switch (toupper(snap->callsign_prefix[0])) {
 			case 'A':
-				if (toupper(settings.callsign[0]) > 'L')
+				if (toupper(snap->callsign_prefix[0]) > 'L')
 					break;
 				/* Fall-through */
 			case 'K':
@@ -441,7 +508,6 @@ show_freq(void)
 				american = true;
 				break;
 		}
-		SETTING_UNLOCK();
 		if (american) {
 			if ((freq >= 135870 && freq <= 137800) ||
 			    (freq >= 472170 && freq <= 479000) ||
@@ -517,6 +583,32 @@ show_freq(void)
 	last_freq = freq;
 }
 
+/*
+ * Reads everything typed so far, and returns true if there's a CTRL-D
+ * in it.  The other keys are kept for get_input().  This lets a macro
+ * being sent from the main thread be aborted.  Curses isn't asked
+ * unless there's something to read.
+ */
+bool
+check_abort_key(void)
+{
+	struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+	bool ret = false;
+	int ch;
+
+	if (poll(&pfd, 1, 0) != 1)
+		return false;
+	wtimeout(tx, 0);
+	while ((ch = wgetch(tx)) != ERR) {
+		if (ch == 4)
+			ret = true;
+		else if (pending_head - pending_tail < PENDING_KEYS)
+			pending_keys[pending_head++ % PENDING_KEYS] = ch;
+	}
+	wtimeout(tx, INPUT_TIMEOUT);
+	return ret;
+}
+
 bool
 check_input(void)
 {
@@ -524,6 +616,8 @@ check_input(void)
 	int ch;
 
 	show_freq();
+	if (pending_tail != pending_head)
+		return true;
 	typeahead(STDIN_FILENO);
 	ch = wgetch(rx);
 	typeahead(-1);
@@ -566,6 +660,22 @@ printf_errno(const char *format, ...)
 	exit(EXIT_FAILURE);
 }
 
+static void
+draw_rx_title(void)
+{
+	size_t i;
+	int x;
+
+	wmove(rx_title, 0, 0);
+	for (i = 0; i < 3; i++)
+		waddch(rx_title, ACS_HLINE);
+	waddstr(rx_title, rx_label);
+	x = getcurx(rx_title);
+	for (i = x; i < tx_width; i++)
+		waddch(rx_title, ACS_HLINE);
+	wrefresh(rx_title);
+}
+
 static void
 draw_tx_title(enum tuning_styles style)
 {
@@ -585,6 +695,9 @@ draw_tx_title(enum tuning_styles style)
 		case TUNE_NONE:
 			waddstr(tx_title, " TX ");
 			break;
+		case TUNE_TIMING:
+			waddstr(tx_title, " Stage timing ");
+			break;
 	}
 
 	x = getcurx(tx_title);
@@ -598,6 +711,7 @@ setup_windows(void)
 {
 	struct winsize ws;
 	int datrows;
+	int rxrows;
 	int i;
 	int x;
 
@@ -614,7 +728,23 @@ setup_windows(void)
 		printf_errno("creating status window");
 	if ((rx_title = newwin(1, ws.ws_col, 2, 0)) == NULL)
 		printf_errno("creating rx_title window");
-	if ((rx = newwin(ws.ws_row - 4 - datrows, ws.ws_col, 3, 0)) == NULL)
+	rxrows = ws.ws_row - 4 - datrows;
+	if (rx_split && rxrows >= 3) {
+		/* The second receiver gets the bottom half */
+		rxrows = (rxrows - 1) / 2;
+		if ((rx2_title = newwin(1, ws.ws_col, 3 + rxrows, 0)) == NULL)
+			printf_errno("creating rx2_title window");
+		if ((rx2 = newwin(ws.ws_row - 5 - datrows - rxrows, ws.ws_col, 4 + rxrows, 0)) == NULL)
+			printf_errno("creating rx2 window");
+		scrollok(rx2_title, FALSE);
+		idlok(rx2, TRUE);
+		wsetscrreg(rx2, 0, ws.ws_row - 5 - datrows - rxrows - 1);
+		scrollok(rx2, TRUE);
+		wclear(rx2_title);
+		wclear(rx2);
+		wmove(rx2, 0, 0);
+	}
+	if ((rx = newwin(rxrows, ws.ws_col, 3, 0)) == NULL)
 		printf_errno("creating rx window");
 	if ((tx_title = newwin(1, ws.ws_col, ws.ws_row - datrows - 1, 0)) == NULL)
 		printf_errno("creating tx_title window");
@@ -628,7 +758,7 @@ setup_windows(void)
 	scrollok(status, FALSE);
 	scrollok(rx_title, FALSE);
 	idlok(rx, TRUE);
-	wsetscrreg(rx, 0, ws.ws_row - 4 - datrows - 1);
+	wsetscrreg(rx, 0, rxrows - 1);
 	scrollok(rx, TRUE);
 	scrollok(tx_title, FALSE);
 	idlok(tx, TRUE);
@@ -651,27 +781,32 @@ setup_windows(void)
 	wmove(tx_title, 0, 0);
 	wmove(tx, 0, 0);
 	wmove(tuning_aid, 0, 0);
-	for (i = 0; i < 3; i++) {
+	for (i = 0; i < 3; i++)
 		waddch(status_title, ACS_HLINE);
-		waddch(rx_title, ACS_HLINE);
-	}
 	waddstr(status_title, " Status ");
 	x = getcurx(status_title);
 	for (i = x; i < ws.ws_col; i++)
 		waddch(status_title, ACS_HLINE);
-	waddstr(rx_title, " RX ");
-	x = getcurx(rx_title);
-	for (i = x; i < ws.ws_col; i++)
-		waddch(rx_title, ACS_HLINE);
 	wrefresh(status_title);
 	wrefresh(status);
-	wrefresh(rx_title);
 	wrefresh(rx);
 	wrefresh(tx);
+	draw_rx_title();
+	if (rx2) {
+		wmove(rx2_title, 0, 0);
+		for (i = 0; i < 3; i++)
+			waddch(rx2_title, ACS_HLINE);
+		waddstr(rx2_title, " RX 2 ");
+		x = getcurx(rx2_title);
+		for (i = x; i < ws.ws_col; i++)
+			waddch(rx2_title, ACS_HLINE);
+		wrefresh(rx2_title);
+		wrefresh(rx2);
+	}
 	draw_tx_title(tuning_style);
-	wtimeout(tx, 160);
-	wtimeout(tuning_aid, 160);
-	wtimeout(rx, 160);
+	wtimeout(tx, INPUT_TIMEOUT);
+	wtimeout(tuning_aid, INPUT_TIMEOUT);
+	wtimeout(rx, INPUT_TIMEOUT);
 	wtimeout(stdscr, -1);
 	keypad(rx, TRUE);
 	keypad(tx, TRUE);
@@ -689,6 +824,11 @@ teardown_windows(void)
 	delwin(tx_title);
 	delwin(rx);
 	delwin(rx_title);
+	if (rx2) {
+		delwin(rx2);
+		delwin(rx2_title);
+		rx2 = rx2_title = NULL;
+	}
 	delwin(status);
 	delwin(status_title);
 	wclear(stdscr);
@@ -827,6 +967,28 @@ struct field_info {
 		.flen = 5,
 		.eol = true
 	},
+	{
+		.name = "Data bits",
+		.key = "databits",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, data_bits),
+		.flen = 2
+	},
+	{
+		.name = "Parity (0-4)",
+		.key = "parity",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, parity),
+		.flen = 2
+	},
+	{
+		.name = "Stop bits",
+		.key = "stopbits",
+		.type = STYPE_DOUBLE,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, stop_bits),
+		.flen = 4,
+		.eol = true
+	},
 	{
 		.name = "Character set",
 		.key = "charset",
@@ -834,6 +996,119 @@ struct field_info {
 		.ptr = (char *)(&settings) + offsetof(struct bt_settings, charset),
 		.flen = 2
 	},
+	{
+		.name = "Stereo mode (0-2)",
+		.key = "stereo",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, stereo),
+		.flen = 2,
+		.eol = true
+	},
+	{
+		.name = "RX decimation",
+		.key = "rxdecimation",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, rx_decimation),
+		.flen = 3
+	},
+	{
+		.name = "Noise blanker",
+		.key = "noiseblanker",
+		.type = STYPE_DOUBLE,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, noise_blanker),
+		.flen = 5
+	},
+	{
+		.name = "AGC",
+		.key = "agc",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, agc),
+		.flen = 2,
+		.eol = true
+	},
+	{
+		.name = "Turnaround blank",
+		.key = "turnaroundblank",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, turnaround_blank),
+		.flen = 5,
+		.eol = true
+	},
+	{
+		.name = "RT priority",
+		.key = "rtpriority",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, rt_priority),
+		.flen = 3
+	},
+	{
+		.name = "RT round robin",
+		.key = "rtroundrobin",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, rt_round_robin),
+		.flen = 2
+	},
+	{
+		.name = "Lock memory",
+		.key = "lockmemory",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, lock_memory),
+		.flen = 2,
+		.eol = true
+	},
+	{
+		.name = "RX CPU",
+		.key = "rxcpu",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, rx_cpu),
+		.flen = 4
+	},
+	{
+		.name = "AFSK CPU",
+		.key = "afskcpu",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, afsk_cpu),
+		.flen = 4,
+		.eol = true
+	},
+	{
+		.name = "Noise correction",
+		.key = "noisecorrect",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, noise_correct),
+		.flen = 2
+	},
+	{
+		.name = "Matched waterfall",
+		.key = "matchedwaterfall",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, matched_waterfall),
+		.flen = 2,
+		.eol = true
+	},
+	{
+		.name = "I/Q input",
+		.key = "iqinput",
+		.type = STYPE_STRING,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, iq_name),
+		.flen = 20,
+		.eol = true
+	},
+	{
+		.name = "I/Q sample rate",
+		.key = "iqrate",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, iq_rate),
+		.flen = 7
+	},
+	{
+		.name = "I/Q channels",
+		.key = "iqchannels",
+		.type = STYPE_INT,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, iq_channels),
+		.flen = 5,
+		.eol = true
+	},
 	{
 		.name = "AFSK mode",
 		.key = "afsk",
@@ -842,6 +1117,54 @@ struct field_info {
 		.flen = 2,
 		.eol = true
 	},
+	{
+		.name = "AFSK NCO",
+		.key = "afsknco",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, afsk_nco),
+		.flen = 2,
+		.eol = true
+	},
+	{
+		.name = "AFSK output",
+		.key = "afskfile",
+		.type = STYPE_STRING,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, afsk_file),
+		.flen = 20,
+		.eol = true
+	},
+	{
+		.name = "Full duplex",
+		.key = "fullduplex",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, full_duplex),
+		.flen = 2,
+		.eol = true
+	},
+	{
+		.name = "AFC",
+		.key = "afc",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, afc),
+		.flen = 2,
+		.eol = true
+	},
+	{
+		.name = "Early characters",
+		.key = "earlychars",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, early_chars),
+		.flen = 2,
+		.eol = true
+	},
+	{
+		.name = "Auto-detect",
+		.key = "autodetect",
+		.type = STYPE_BOOL,
+		.ptr = (char *)(&settings) + offsetof(struct bt_settings, autodetect),
+		.flen = 2,
+		.eol = true
+	},
 	{
 		.name = "Callsign",
 		.key = "callsign",
@@ -1187,6 +1510,10 @@ done:
 	touchwin(status);
 	touchwin(rx_title);
 	touchwin(rx);
+	if (rx2) {
+		touchwin(rx2_title);
+		touchwin(rx2);
+	}
 	touchwin(tx_title);
 	touchwin(tx);
 	touchwin(tuning_aid);
@@ -1195,6 +1522,10 @@ done:
 	wrefresh(status);
 	wrefresh(rx_title);
 	wrefresh(rx);
+	if (rx2) {
+		wrefresh(rx2_title);
+		wrefresh(rx2);
+	}
 	wrefresh(tx_title);
 	if (tuning_style == TUNE_NONE)
 		wrefresh(tx);
@@ -1597,6 +1928,11 @@ clear_rx_window(void)
 	werase(rx);
 	wmove(rx, 0, 0);
 	wrefresh(rx);
+	if (rx2) {
+		werase(rx2);
+		wmove(rx2, 0, 0);
+		wrefresh(rx2);
+	}
 	CURS_UNLOCK();
 }
 
@@ -1627,6 +1963,7 @@ update_waterfall(void)
 	struct timespec now;
 	struct timespec diff;
 	double d = 4000.0 / tx_width;
+	const struct settings_snapshot *snap;
 
 #if defined(CLOCK_MONOTONIC_FAST)
 	clock_gettime(CLOCK_MONOTONIC_FAST, &now);
@@ -1661,10 +1998,9 @@ update_waterfall(void)
 	}
 	for (i = 0; i < tx_width; i++)
 		mvwaddch(tuning_aid, tx_height - 2, i, chars[max == min ? 0 : (int)((get_waterfall(i) - min) / ((max - min) / (sizeof(chars) - 1)))]);
-	SETTING_RLOCK();
-	mvwaddch(tuning_aid, tx_height - 1, settings.mark_freq / d, ACS_VLINE);
-	mvwaddch(tuning_aid, tx_height - 1, settings.space_freq / d, ACS_VLINE);
-	SETTING_UNLOCK();
+	snap = SETTINGS_SNAPSHOT();
+	mvwaddch(tuning_aid, tx_height - 1, snap->mark_freq / d, ACS_VLINE);
+	mvwaddch(tuning_aid, tx_height - 1, snap->space_freq / d, ACS_VLINE);
 	wrefresh(tuning_aid);
 	CURS_UNLOCK();
 }
@@ -1672,6 +2008,8 @@ update_waterfall(void)
 void
 toggle_tuning_aid()
 {
+	if (tuning_style == TUNE_TIMING)
+		tuning_style = timing_saved_style;
 	tuning_style++;
 	if (tuning_style > TUNE_LAST)
 		tuning_style = TUNE_NONE;
@@ -1690,7 +2028,145 @@ toggle_tuning_aid()
 		case TUNE_ASCIIFALL:
 			setup_spectrum_filters(tx_width);
 			break;
+		case TUNE_TIMING:
+			break;
+	}
+	CURS_UNLOCK();
+}
+
+/*
+ * The stage timing replaces the tuning aid until it's toggled off again,
+ * then the tuning aid that was there comes back.
+ */
+void
+toggle_timing_display(void)
+{
+	CURS_LOCK();
+	if (tuning_style == TUNE_TIMING) {
+		tuning_style = timing_saved_style;
+		wclear(tuning_aid);
+		if (tuning_style == TUNE_NONE) {
+			redrawwin(tx);
+			wrefresh(tx);
+		}
+		else
+			wrefresh(tuning_aid);
+	}
+	else {
+		timing_saved_style = tuning_style;
+		tuning_style = TUNE_TIMING;
 	}
+	draw_tx_title(tuning_style);
+	CURS_UNLOCK();
+	show_timing(true);
+}
+
+/*
+ * Redraws the stage timing about once a second while it's shown.  Only
+ * called in RX mode, since it shares the window with TX.
+ */
+void
+show_timing(bool force)
+{
+	static time_t last;
+	struct stage_summary stages[STAGE_COUNT];
+	size_t nstages;
+	size_t s;
+	time_t now;
+
+	if (tuning_style != TUNE_TIMING)
+		return;
+	now = time(NULL);
+	if (now == last && !force)
+		return;
+	last = now;
+	nstages = get_stage_timing(stages);
+	CURS_LOCK();
+	werase(tuning_aid);
+	if (nstages == 0)
+		mvwaddstr(tuning_aid, 0, 0, "Not compiled in, build with STAGE_TIMING=1");
+	else {
+		mvwprintw(tuning_aid, 0, 0, "%-10s %10s %10s %10s %10s", "Stage", "Blocks", "p50 us", "p99 us", "max us");
+		for (s = 0; s < nstages && s + 1 < tx_height; s++)
+			mvwprintw(tuning_aid, s + 1, 0, "%-10s %10" PRIu64 " %10.1f %10.1f %10.1f",
+			    stages[s].name, stages[s].blocks, stages[s].p50_ns / 1000.0,
+			    stages[s].p99_ns / 1000.0, stages[s].max_ns / 1000.0);
+	}
+	wrefresh(tuning_aid);
+	CURS_UNLOCK();
+}
+
+void
+show_afc(bool enabled, int offset)
+{
+	char buf[7];
+
+	if (enabled)
+		snprintf(buf, sizeof(buf), "%+4dHz", offset);
+	else
+		snprintf(buf, sizeof(buf), "%6s", "");
+	CURS_LOCK();
+	mvwaddstr(status, 0, 51, buf);
+	wrefresh(status);
+	CURS_UNLOCK();
+}
+
+/*
+ * Shows the number of sound card overruns and underruns so far, if there
+ * have been any.  The threads that count them can't wait on the curses
+ * lock, so this is polled from the input loop.
+ */
+void
+show_xruns(bool force)
+{
+	static uint64_t shown;
+	uint64_t count;
+	char buf[5];
+
+	count = xrun_count();
+	if (count == shown && !force)
+		return;
+	shown = count;
+	if (count == 0)
+		snprintf(buf, sizeof(buf), "%4s", "");
+	else
+		snprintf(buf, sizeof(buf), "X%-3" PRIu64, count > 999 ? 999 : count);
+	CURS_LOCK();
+	if (count)
+		wcolor_set(status, TTY_COLOR_OUT_OF_BAND, NULL);
+	mvwaddstr(status, 0, 62, buf);
+	wcolor_set(status, TTY_COLOR_NORMAL, NULL);
+	wrefresh(status);
+	CURS_UNLOCK();
+}
+
+/*
+ * Splits the RX window in two for a second receiver.
+ */
+void
+set_rx_split(bool split)
+{
+	CURS_LOCK();
+	if (split != rx_split) {
+		rx_split = split;
+		if (rx) {
+			teardown_windows();
+			setup_windows();
+		}
+	}
+	CURS_UNLOCK();
+}
+
+/*
+ * Replaces the RX window title, NULL restores the default.
+ */
+void
+show_rx_title(const char *label)
+{
+	CURS_LOCK();
+	snprintf(rx_label, sizeof(rx_label), " %s ", label ? label : "RX");
+	if (rx_title)
+		draw_rx_title();
 	CURS_UNLOCK();
 }
 
@@ -18,7 +18,8 @@
 enum tuning_styles {
 	TUNE_NONE,
 	TUNE_ASCIINANAS,
-	TUNE_ASCIIFALL
+	TUNE_ASCIIFALL,
+	TUNE_TIMING	// Not in the CTRL-W cycle
 };
 #define TUNE_LAST TUNE_ASCIIFALL
 
@@ -28,9 +29,13 @@ void setup_curses(void);
 void update_tuning_aid(double mark, double space);
 void mark_tx_extent(bool start);
 int get_input(void);
-void write_tx(char ch);
+void write_tx_str(const char *str);
 void write_rx(char ch);
+void write_rx2(char ch);
+void write_rx_str(const char *str);
+void set_rx_split(bool split);
 bool check_input(void);
+bool check_abort_key(void);
 noreturn void printf_errno(const char *format, ...);
 void show_reverse(bool rev);
 void change_settings(void);
@@ -42,6 +47,11 @@ void clear_rx_window(void);
 void update_captured_call(const char *call);
 void update_serial(unsigned value);
 void toggle_tuning_aid();
+void toggle_timing_display(void);
+void show_timing(bool force);
+void show_afc(bool enabled, int offset);
+void show_xruns(bool force);
+void show_rx_title(const char *label);
 void debug_status(int y, int x, char *str);
 
 #endif
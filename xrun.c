@@ -0,0 +1,128 @@
+/*-
+ * Copyright (c) 2018 Stephen Hurd, W8BSD
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Sound card overrun and underrun accounting.  The capture thread checks
+ * for input overruns before each read, and the AFSK thread checks for
+ * output underruns before each write.  Where the driver keeps its own
+ * counts (SNDCTL_DSP_GETERROR), those are used, otherwise a completely
+ * full input buffer or completely empty output buffer is counted.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/soundcard.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "lockprof.h"
+#include "xrun.h"
+
+static struct xrun_stats xruns[2];
+static pthread_mutex_t xrun_mutex = PTHREAD_MUTEX_INITIALIZER;
+STATIC_LOCK_PROF(xrun_prof, "xrun");
+#define XRUN_LOCK()	assert(PROF_MUTEX_LOCK(&xrun_mutex, xrun_prof) == 0)
+#define XRUN_UNLOCK()	assert(pthread_mutex_unlock(&xrun_mutex) == 0)
+static atomic_uint_fast64_t xrun_total;
+
+/*
+ * Returns the number of input overruns since the last call.
+ */
+unsigned
+check_input_xrun(int fd)
+{
+	audio_buf_info info;
+#ifdef SNDCTL_DSP_GETERROR
+	audio_errinfo ei;
+
+	if (ioctl(fd, SNDCTL_DSP_GETERROR, &ei) == 0)
+		return ei.rec_overruns;
+#endif
+	if (ioctl(fd, SNDCTL_DSP_GETISPACE, &info) == -1)
+		return 0;
+	// Nowhere for the next fragment to go
+	if (info.fragstotal > 0 && info.bytes >= info.fragstotal * info.fragsize)
+		return 1;
+	return 0;
+}
+
+/*
+ * Returns the number of output underruns since the last call.  Before
+ * the first write after the device is opened, the buffer is empty
+ * because nothing has been played yet, so started should be false.
+ */
+unsigned
+check_output_xrun(int fd, bool started)
+{
+	audio_buf_info info;
+#ifdef SNDCTL_DSP_GETERROR
+	audio_errinfo ei;
+
+	if (ioctl(fd, SNDCTL_DSP_GETERROR, &ei) == 0)
+		return started ? ei.play_underruns : 0;
+#endif
+	if (!started)
+		return 0;
+	if (ioctl(fd, SNDCTL_DSP_GETOSPACE, &info) == -1)
+		return 0;
+	// Everything we wrote has been played
+	if (info.fragstotal > 0 && info.bytes >= info.fragstotal * info.fragsize)
+		return 1;
+	return 0;
+}
+
+void
+count_xruns(enum xrun_dir dir, unsigned count)
+{
+	if (count == 0)
+		return;
+	XRUN_LOCK();
+	if (xruns[dir].count == 0)
+		xruns[dir].first = time(NULL);
+	xruns[dir].last = time(NULL);
+	xruns[dir].count += count;
+	XRUN_UNLOCK();
+	atomic_fetch_add(&xrun_total, count);
+}
+
+void
+get_xruns(enum xrun_dir dir, struct xrun_stats *st)
+{
+	XRUN_LOCK();
+	*st = xruns[dir];
+	XRUN_UNLOCK();
+}
+
+/*
+ * Both directions together, cheap enough to poll.
+ */
+uint64_t
+xrun_count(void)
+{
+	return atomic_load(&xrun_total);
+}
@@ -0,0 +1,25 @@
+#ifndef XRUN_H
+#define XRUN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+enum xrun_dir {
+	XRUN_RX,	// Input overruns
+	XRUN_TX,	// Output underruns
+};
+
+struct xrun_stats {
+	uint64_t	count;
+	time_t		first;
+	time_t		last;
+};
+
+unsigned check_input_xrun(int fd);
+unsigned check_output_xrun(int fd, bool started);
+void count_xruns(enum xrun_dir dir, unsigned count);
+void get_xruns(enum xrun_dir dir, struct xrun_stats *st);
+uint64_t xrun_count(void);
+
+#endif